@@ -75,7 +75,7 @@ ID AnnotatedString::MakeMark(CommandSet* commands, Site* site,
   return id;
 }
 
-void AnnotatedString::MakeDeleteAttributesBySite(CommandSet* commands, const Site& site) {
+void AnnotatedString::MakeDeleteAttributesBySite(CommandSet* commands, const Site& site) const {
   annotations_by_type_.ForEach([&](Attribute::DataCase dc, AVL<ID, Annotation> by_type) {
     by_type.ForEach([&](ID id, const Annotation& an) {
       if (site.CreatedID(id) || site.CreatedID(an.attribute())) {
@@ -128,6 +128,11 @@ void AnnotatedString::IntegrateInsert(ID id, const InsertCommand& cmd) {
   if (chars_.Lookup(id)) return;
   ID after = cmd.after();
   ID before = cmd.before();
+  if (cmd.characters().length() > 1 &&
+      chars_.Lookup(after)->next == before) {
+    IntegrateInsertRun(id, cmd.characters(), after, before);
+    return;
+  }
   for (auto c : cmd.characters()) {
     IntegrateInsertChar(id, c, after, before);
     after = id;
@@ -135,6 +140,62 @@ void AnnotatedString::IntegrateInsert(ID id, const InsertCommand& cmd) {
   }
 }
 
+// As IntegrateInsertChar for each of chars, with nothing between after and
+// before to order them against: each character's final links are known up
+// front, and the run's ids increase, so each index gains them in one sorted
+// bulk add.
+void AnnotatedString::IntegrateInsertRun(ID id, absl::string_view chars,
+                                         ID after, ID before) {
+  const size_t n = chars.length();
+  const CharInfo caft = *chars_.Lookup(after);
+  const CharInfo cbef = *chars_.Lookup(before);
+  auto nth = [id](size_t i) {
+    ID out = id;
+    out.clock += i;
+    return out;
+  };
+  const ID last = nth(n - 1);
+
+  std::vector<ID> breaks;
+  for (size_t i = 0; i < n; i++) {
+    if (chars[i] == '\n') breaks.push_back(nth(i));
+  }
+  if (!breaks.empty()) {
+    auto prev_line_id = after;
+    const CharInfo* plic = &caft;
+    while (prev_line_id != Begin() && (!plic->visible || plic->chr != '\n')) {
+      prev_line_id = plic->prev;
+      plic = chars_.Lookup(prev_line_id);
+    }
+    const LineBreak prev_lb = *line_breaks_.Lookup(prev_line_id);
+    const LineBreak next_lb = *line_breaks_.Lookup(prev_lb.next);
+    std::vector<std::pair<ID, LineBreak>> new_breaks;
+    for (size_t i = 0; i < breaks.size(); i++) {
+      const ID prev = i == 0 ? prev_line_id : breaks[i - 1];
+      const ID next = i + 1 == breaks.size() ? prev_lb.next : breaks[i + 1];
+      new_breaks.emplace_back(breaks[i], LineBreak{prev, next});
+    }
+    line_breaks_ =
+        line_breaks_.AddSorted(new_breaks)
+            .Add(prev_line_id, LineBreak{prev_lb.prev, breaks.front()})
+            .Add(prev_lb.next, LineBreak{breaks.back(), next_lb.next});
+  }
+
+  std::vector<std::pair<ID, CharInfo>> new_chars;
+  new_chars.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    const ID prev = i == 0 ? after : nth(i - 1);
+    const ID next = i + 1 == n ? before : nth(i + 1);
+    new_chars.emplace_back(
+        nth(i), CharInfo{true, chars[i], next, prev, prev, before, AVL<ID>()});
+  }
+  chars_ = chars_.AddSorted(new_chars)
+               .Add(after, CharInfo{caft.visible, caft.chr, id, caft.prev,
+                                    caft.after, caft.before, caft.annotations})
+               .Add(before, CharInfo{cbef.visible, cbef.chr, cbef.next, last,
+                                     cbef.after, cbef.before, cbef.annotations});
+}
+
 void AnnotatedString::IntegrateInsertChar(ID id, char c, ID after, ID before) {
   for (;;) {
     const CharInfo* caft = chars_.Lookup(after);
@@ -305,6 +366,33 @@ std::string AnnotatedString::Render(ID beg, ID end) const {
   return r;
 }
 
+size_t AnnotatedString::RenderChunk(ID* loc, char* buf, size_t size) const {
+  size_t n = 0;
+  while (n != size && *loc != End()) {
+    const CharInfo* ci = chars_.Lookup(*loc);
+    if (ci->visible) {
+      buf[n++] = ci->chr;
+    }
+    *loc = ci->next;
+  }
+  return n;
+}
+
+AnnotatedString::Stats AnnotatedString::GetStats() const {
+  Stats stats;
+  chars_.ForEach([&](ID id, const CharInfo& ci) {
+    // Begin and End are neither
+    if (id.site == 0) return;
+    (ci.visible ? stats.chars : stats.tombstones)++;
+  });
+  attributes_.ForEach([&](ID, Attribute::DataCase) { stats.attributes++; });
+  annotations_.ForEach([&](ID, Attribute::DataCase type) {
+    stats.annotations_by_type[type]++;
+  });
+  graveyard_.ForEach([&](ID) { stats.graveyard++; });
+  return stats;
+}
+
 AnnotatedStringMsg AnnotatedString::AsProto() const {
   AnnotatedStringMsg out;
   chars_.ForEach([&](ID id, const CharInfo& ci) {
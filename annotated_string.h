@@ -15,6 +15,7 @@
 
 #include <stdint.h>
 #include <atomic>
+#include <map>
 #include "absl/strings/string_view.h"
 #include "absl/types/optional.h"
 #include "avl.h"
@@ -122,11 +123,14 @@ class AnnotatedString {
   static ID MakeMark(CommandSet* commands, Site* site,
                      const Annotation& annotation);
 
-  void MakeDeleteAttributesBySite(CommandSet* commands, const Site& site);
+  void MakeDeleteAttributesBySite(CommandSet* commands, const Site& site) const;
 
   AnnotatedString Integrate(const CommandSet& commands) const;
   void Integrate(const Command& command);
 
+  // true if id names a character (visible or deleted) of this string
+  bool HasChar(ID id) const { return chars_.Lookup(id) != nullptr; }
+
   // return <0 if a before b, >0 if a after b, ==0 if a==b
   int OrderIDs(ID a, ID b) const;
   void MakeOrderedIDs(ID* a, ID* b) const {
@@ -137,6 +141,21 @@ class AnnotatedString {
 
   std::string Render() const { return Render(Begin(), End()); }
   std::string Render(ID begin, ID end) const;
+  // Copies the visible characters from *loc on into buf, up to size of them
+  // or until End(), leaving *loc at the first not copied. Returns how many
+  // were copied: short of size only once *loc is End().
+  size_t RenderChunk(ID* loc, char* buf, size_t size) const;
+
+  // How much the string holds, for diagnostics; walks all of it
+  struct Stats {
+    size_t chars = 0;
+    // deleted characters, kept as anchors for concurrent edits
+    size_t tombstones = 0;
+    size_t attributes = 0;
+    std::map<Attribute::DataCase, size_t> annotations_by_type;
+    size_t graveyard = 0;
+  };
+  Stats GetStats() const;
 
   bool SameContentIdentity(const AnnotatedString& other) const {
     return chars_.SameIdentity(other.chars_);
@@ -174,6 +193,9 @@ class AnnotatedString {
   static AnnotatedString FromProto(const AnnotatedStringMsg& msg);
 
  private:
+  // reads and writes the representation directly
+  friend class BufferSnapshot;
+
   void IntegrateInsert(ID id, const InsertCommand& cmd);
   void IntegrateDelChar(ID id);
   void IntegrateDecl(ID id, const Attribute& decl);
@@ -182,6 +204,7 @@ class AnnotatedString {
   void IntegrateDelMark(ID id);
 
   void IntegrateInsertChar(ID id, char c, ID after, ID before);
+  void IntegrateInsertRun(ID id, absl::string_view chars, ID after, ID before);
 
   struct CharInfo {
     bool visible;
@@ -246,8 +269,14 @@ class AnnotatedString {
     // F(const Attribute& attr)
     template <class F>
     void ForEachAttrValue(F&& f) {
+      ForEachAttrIDAndValue([&f](ID, const Attribute& attr) { f(attr); });
+    }
+
+    // F(ID attr_id, const Attribute& attr)
+    template <class F>
+    void ForEachAttrIDAndValue(F&& f) {
       // Log() << "FEAV: " << pos_.id << " " << cur_->annotations.Empty();
-      cur_->annotations.ForEach([this, f](ID id) {
+      cur_->annotations.ForEach([this, &f](ID id) {
         // Log() << "EXAM " << id.id << " on " << pos_.id;
         const auto* dc = str_->annotations_.Lookup(id);
         if (!dc) {
@@ -263,7 +292,7 @@ class AnnotatedString {
           return;
         }
         // Log() << attr->DebugString();
-        f(*attr);
+        f(ID(ann.attribute()), *attr);
       });
     }
 
@@ -315,6 +344,12 @@ class AnnotatedString {
       it_.ForEachAttrValue(std::forward<F>(f));
     }
 
+    // F(ID attr_id, const Attribute& attr)
+    template <class F>
+    void ForEachAttrIDAndValue(F&& f) {
+      it_.ForEachAttrIDAndValue(std::forward<F>(f));
+    }
+
    private:
     AllIterator it_;
   };
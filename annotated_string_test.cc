@@ -0,0 +1,81 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "annotated_string.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+// The line start ids of s, walking forward from its start and back from its
+// end (so both links of every line break are followed)
+static std::pair<std::vector<ID>, std::vector<ID>> LineStarts(
+    const AnnotatedString& s) {
+  std::pair<std::vector<ID>, std::vector<ID>> out;
+  AnnotatedString::LineIterator fwd(s, AnnotatedString::Begin());
+  for (;; fwd.MoveNext()) {
+    out.first.push_back(fwd.id());
+    if (fwd.is_end()) break;
+  }
+  AnnotatedString::LineIterator back(s, AnnotatedString::End());
+  for (;; back.MovePrev()) {
+    out.second.push_back(back.id());
+    if (back.is_begin()) break;
+  }
+  return out;
+}
+
+TEST(AnnotatedString, InsertRunMatchesCharByCharInsert) {
+  Site base_site;
+  AnnotatedString base;
+  base.Insert(&base_site, "first line\nsecond\nthird\n",
+              AnnotatedString::Begin());
+  // after Begin, mid-line, just before a newline and at the very end
+  std::vector<ID> positions{AnnotatedString::Begin()};
+  for (AnnotatedString::AllIterator it(base, AnnotatedString::Begin());
+       !it.is_end(); it.MoveNext()) {
+    if (it.id() != AnnotatedString::Begin()) positions.push_back(it.id());
+  }
+  for (ID after : positions) {
+    for (const char* text : {"x\ny", "\n\nab\n", "one\ntwo\nthree"}) {
+      Site site;
+      CommandSet run;
+      base.MakeInsert(&run, &site, text, after);
+      ASSERT_EQ(1, run.commands_size());
+      const Command& cmd = run.commands(0);
+      ASSERT_GT(cmd.insert().characters().size(), 1u);
+
+      // the same insert, one character per command, so that each goes
+      // through IntegrateInsertChar
+      CommandSet chars;
+      ID id(cmd.id());
+      ID prev(cmd.insert().after());
+      for (char c : cmd.insert().characters()) {
+        Command* one = chars.add_commands();
+        one->set_id(id.id);
+        one->mutable_insert()->set_after(prev.id);
+        one->mutable_insert()->set_before(cmd.insert().before());
+        one->mutable_insert()->set_characters(std::string(1, c));
+        prev = id;
+        id.clock++;
+      }
+
+      AnnotatedString by_run = base.Integrate(run);
+      AnnotatedString by_char = base.Integrate(chars);
+      EXPECT_EQ(by_char.Render(), by_run.Render());
+      EXPECT_EQ(by_char.AsProto().SerializeAsString(),
+                by_run.AsProto().SerializeAsString())
+          << "inserting after " << after.id;
+      EXPECT_EQ(LineStarts(by_char), LineStarts(by_run))
+          << "inserting after " << after.id;
+    }
+  }
+}
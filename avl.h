@@ -15,6 +15,8 @@
 
 #include <algorithm>
 #include <memory>
+#include <utility>
+#include <vector>
 
 template <class K, class V = void>
 class AVL {
@@ -37,6 +39,14 @@ class AVL {
 
   bool Empty() const { return root_ == nullptr; }
 
+  // As Add for each of entries, whose keys must increase and be new. Each
+  // stretch of entries falling between two neighbouring keys of this tree is
+  // built balanced and joined in whole: O(m log(size / m + 1)) for m
+  // entries, rather than O(m log size), and no intermediate trees.
+  AVL AddSorted(const std::vector<std::pair<K, V>> &entries) const {
+    return AVL(Union(root_, entries.data(), entries.data() + entries.size()));
+  }
+
   template <class F>
   void ForEach(F &&f) const {
     ForEachImpl(root_.get(), std::forward<F>(f));
@@ -44,6 +54,10 @@ class AVL {
 
   bool SameIdentity(AVL avl) const { return root_ == avl.root_; }
 
+  // every node's subtrees differ in height by at most one, and its recorded
+  // height is right
+  bool Balanced() const { return CheckedHeight(root_) >= 0; }
+
  private:
   struct Node;
   typedef std::shared_ptr<Node> NodePtr;
@@ -72,6 +86,17 @@ class AVL {
 
   static long Height(const NodePtr &n) { return n ? n->height : 0; }
 
+  // n's height, or -1 if it isn't Balanced
+  static long CheckedHeight(const NodePtr &n) {
+    if (n == nullptr) return 0;
+    const long left = CheckedHeight(n->left);
+    const long right = CheckedHeight(n->right);
+    if (left < 0 || right < 0) return -1;
+    if (left > right + 1 || right > left + 1) return -1;
+    const long height = 1 + std::max(left, right);
+    return n->height == height ? height : -1;
+  }
+
   static NodePtr MakeNode(K key, V value, const NodePtr &left,
                           const NodePtr &right) {
     return std::make_shared<Node>(std::move(key), std::move(value), left, right,
@@ -217,6 +242,40 @@ class AVL {
     }
     abort();
   }
+
+  static NodePtr BuildBalanced(const std::pair<K, V> *begin,
+                               const std::pair<K, V> *end) {
+    if (begin == end) return nullptr;
+    const std::pair<K, V> *mid = begin + (end - begin) / 2;
+    return MakeNode(mid->first, mid->second, BuildBalanced(begin, mid),
+                    BuildBalanced(mid + 1, end));
+  }
+
+  static NodePtr Union(const NodePtr &node, const std::pair<K, V> *begin,
+                       const std::pair<K, V> *end) {
+    if (begin == end) return node;
+    if (node == nullptr) return BuildBalanced(begin, end);
+    const std::pair<K, V> *split = std::lower_bound(
+        begin, end, node->kv.first,
+        [](const std::pair<K, V> &kv, const K &key) { return kv.first < key; });
+    return Join(Union(node->left, begin, split), node->kv.first,
+                node->kv.second, Union(node->right, split, end));
+  }
+
+  // the tree of left, key and right, every key of left being below key and
+  // every key of right above it
+  static NodePtr Join(const NodePtr &left, const K &key, const V &value,
+                      const NodePtr &right) {
+    if (Height(left) > Height(right) + 1) {
+      return Rebalance(left->kv.first, left->kv.second, left->left,
+                       Join(left->right, key, value, right));
+    }
+    if (Height(right) > Height(left) + 1) {
+      return Rebalance(right->kv.first, right->kv.second,
+                       Join(left, key, value, right->left), right->right);
+    }
+    return MakeNode(key, value, left, right);
+  }
 };
 
 template <class K>
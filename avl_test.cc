@@ -13,6 +13,7 @@
 // limitations under the License.
 #include "avl.h"
 #include <gtest/gtest.h>
+#include <vector>
 
 TEST(AvlTest, NoOp) { AVL<int, int> avl; }
 
@@ -21,3 +22,31 @@ TEST(AvlTest, Lookup) {
   EXPECT_EQ(nullptr, avl.Lookup(2));
   EXPECT_EQ(42, *avl.Lookup(1));
 }
+
+TEST(AvlTest, AddSorted) {
+  AVL<int, int> avl;
+  for (int i = 0; i < 100; i++) avl = avl.Add(i * 1000, i);
+  for (int stride : {1, 7, 250, 1001}) {
+    for (int n : {0, 1, 7, 500}) {
+      // runs of keys between each of the tree's, of lengths set by stride
+      std::vector<std::pair<int, int>> entries;
+      for (int k = 1; static_cast<int>(entries.size()) < n; k += stride) {
+        if (k % 1000 != 0) entries.emplace_back(k, -1);
+      }
+      auto added = avl.AddSorted(entries);
+      int size = 0;
+      int last = -1;
+      added.ForEach([&](int k, int v) {
+        EXPECT_LT(last, k);
+        last = k;
+        size++;
+      });
+      EXPECT_EQ(100 + n, size);
+      EXPECT_TRUE(added.Balanced()) << "stride " << stride << " n " << n;
+      for (int i = 0; i < 100; i++) EXPECT_EQ(i, *added.Lookup(i * 1000));
+      for (const auto& e : entries) EXPECT_EQ(-1, *added.Lookup(e.first));
+      // the original is untouched
+      EXPECT_EQ(nullptr, avl.Lookup(1));
+    }
+  }
+}
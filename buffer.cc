@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "buffer.h"
+#include <algorithm>
 #include <unordered_map>
 #include "absl/strings/str_cat.h"
 #include "log.h"
@@ -41,17 +42,26 @@ class CollaboratorRegistry {
 
 Buffer::Buffer(Project* project, const boost::filesystem::path& filename,
                absl::optional<AnnotatedString> initial_string,
-               absl::optional<int> site_id, bool synthetic)
+               absl::optional<int> site_id, bool synthetic, bool headless,
+               const std::vector<uint16_t>& restored_sites)
     : project_(project),
       synthetic_(synthetic),
+      headless_(headless),
+      restored_sites_(restored_sites),
       version_(0),
       updating_(false),
       last_used_(absl::Now() - absl::Seconds(1000000)),
       filename_(filename),
       site_(site_id) {
   if (initial_string) state_.content = *initial_string;
-  init_thread_ =
-      std::thread([this]() { CollaboratorRegistry::Get().Run(this); });
+  init_thread_ = std::thread([this]() {
+    CollaboratorRegistry::Get().Run(this);
+    {
+      absl::MutexLock lock(&mu_);
+      collaborators_added_ = true;
+    }
+    FinishedFirstPass(nullptr);
+  });
 }
 
 void Buffer::RegisterCollaborator(
@@ -99,6 +109,9 @@ void Buffer::AddCollaborator(AsyncCommandCollaboratorPtr&& collaborator) {
         : BufferListener(buffer), collab_(collab) {}
 
     void Update(const CommandSet* updates) { collab_->Push(updates); }
+    void UpdateViewport(const Viewport& viewport) {
+      collab_->PushViewport(viewport);
+    }
 
    private:
     AsyncCommandCollaborator* const collab_;
@@ -146,17 +159,33 @@ void Buffer::AddCollaborator(SyncCollaboratorPtr&& collaborator) {
   absl::MutexLock lock(&mu_);
   SyncCollaborator* raw = collaborator.get();
   collaborators_.emplace_back(std::move(collaborator));
+  first_pass_pending_.insert(raw);
   collaborator_threads_.emplace_back([this, raw]() {
     try {
       RunSync(raw);
     } catch (std::exception& e) {
       Log() << raw->name() << " collaborator sync broke: " << e.what();
     }
+    FinishedFirstPass(raw);
     absl::MutexLock lock(&mu_);
     done_collaborators_.insert(raw);
   });
 }
 
+void Collaborator::MarkResponse() {
+  last_response_ = absl::Now();
+  // responses that answer nothing (such as pulled file contents) aren't
+  // latencies
+  if (last_request_ <= answered_request_) return;
+  answered_request_ = last_request_;
+  const int64_t ms = absl::ToInt64Milliseconds(last_response_ - last_request_);
+  int bucket = 0;
+  while (bucket < kLatencyBuckets - 1 && ms >= (int64_t(1) << bucket)) {
+    bucket++;
+  }
+  latency_histogram_[bucket]++;
+}
+
 namespace {
 struct Shutdown {};
 }  // namespace
@@ -265,7 +294,20 @@ void Buffer::PushChanges(const CommandSet* commands, bool become_used) {
               });
 }
 
-AnnotatedString Buffer::ContentSnapshot() {
+void Buffer::PublishPresence(Presence presence) {
+  UpdateState(nullptr, false, [&presence](EditNotification& state) {
+    state.presence = std::move(presence);
+  });
+}
+
+void Buffer::PublishViewport(const Viewport& viewport) {
+  absl::MutexLock lock(&mu_);
+  for (auto* l : listeners_) {
+    l->UpdateViewport(viewport);
+  }
+}
+
+AnnotatedString Buffer::ContentSnapshot() const {
   absl::MutexLock lock(&mu_);
   return state_.content;
 }
@@ -277,6 +319,7 @@ void Buffer::SinkResponse(Collaborator* collaborator,
     collaborator->MarkResponse();
   }
 
+  if (response.viewport) PublishViewport(*response.viewport);
   if (HasUpdates(response)) {
     PublishToListeners(&response.content_updates, nullptr);
     UpdateState(collaborator, response.become_used,
@@ -303,6 +346,7 @@ void Buffer::SinkResponse(Collaborator* collaborator,
 void Buffer::PublishToListeners(const CommandSet* commands,
                                 BufferListener* except) {
   absl::MutexLock lock(&mu_);
+  command_log_.Append(*commands);
   for (auto* l : listeners_) {
     if (l == except) continue;
     l->Update(commands);
@@ -334,14 +378,44 @@ void Buffer::RunSync(SyncCollaborator* collaborator) {
   uint64_t processed_version = 0;
   try {
     for (;;) {
-      SinkResponse(collaborator, collaborator->Edit(NextNotification(
-                                     collaborator, &processed_version)));
+      const EditNotification notification =
+          NextNotification(collaborator, &processed_version);
+      SinkResponse(collaborator, collaborator->Edit(notification));
+      if (notification.fully_loaded) FinishedFirstPass(collaborator);
     }
   } catch (Shutdown) {
     return;
   }
 }
 
+void Buffer::FinishedFirstPass(Collaborator* collaborator) {
+  {
+    absl::MutexLock lock(&mu_);
+    if (first_pass_pending_.erase(collaborator) == 0 && collaborator) return;
+    if (!collaborators_added_ || !first_pass_pending_.empty() ||
+        first_pass_announced_ || state_.shutdown) {
+      return;
+    }
+    first_pass_announced_ = true;
+  }
+  Log() << filename_ << ": first pass complete";
+  UpdateState(nullptr, false, [](EditNotification& state) {
+    state.first_pass_complete = true;
+  });
+}
+
+Buffer::Stats Buffer::GetStats() const {
+  absl::MutexLock lock(&mu_);
+  Stats stats;
+  stats.version = version_;
+  stats.logged_commands = command_log_.size();
+  stats.listeners = listeners_.size();
+  for (const auto& c : collaborators_) {
+    stats.collaborators.emplace_back(c->name(), c->latency_histogram());
+  }
+  return stats;
+}
+
 std::vector<std::string> Buffer::ProfileData() const {
   auto now = absl::Now();
   absl::MutexLock lock(&mu_);
@@ -366,18 +440,19 @@ BufferListener::BufferListener(Buffer* buffer) : buffer_(buffer) {}
 
 BufferListener::~BufferListener() {
   absl::MutexLock lock(&buffer_->mu_);
-  buffer_->listeners_.erase(this);
+  auto& listeners = buffer_->listeners_;
+  auto it = std::find(listeners.begin(), listeners.end(), this);
+  if (it != listeners.end()) listeners.erase(it);
 }
 
 void BufferListener::Start(
     std::function<void(const AnnotatedString&)> initial) {
   absl::MutexLock lock(&buffer_->mu_);
-  buffer_->listeners_.insert(this);
+  buffer_->listeners_.push_back(this);
   initial(buffer_->state_.content);
 }
 
-std::unique_ptr<BufferListener> Buffer::Listen(
-    std::function<void(const AnnotatedString&)> initial,
+std::unique_ptr<BufferListener> Buffer::NewListener(
     std::function<void(const CommandSet*)> update) {
   class FnListener final : public BufferListener {
    public:
@@ -390,7 +465,51 @@ std::unique_ptr<BufferListener> Buffer::Listen(
     std::function<void(const CommandSet*)> update_;
   };
 
-  std::unique_ptr<BufferListener> listener(new FnListener(this, update));
+  return std::unique_ptr<BufferListener>(new FnListener(this, update));
+}
+
+std::unique_ptr<BufferListener> Buffer::Listen(
+    std::function<void(const AnnotatedString&)> initial,
+    std::function<void(const CommandSet*)> update) {
+  std::unique_ptr<BufferListener> listener = NewListener(update);
   listener->Start(initial);
   return listener;
 }
+
+std::unique_ptr<BufferListener> Buffer::ListenFrom(
+    uint16_t site, const VersionVector& have,
+    std::function<void(const VersionVector& seen, const CommandSet& missing)>
+        initial,
+    std::function<void(const CommandSet*)> update) {
+  absl::MutexLock lock(&mu_);
+  CommandSet missing;
+  // the peer's own commands it made itself, not heard from here
+  auto relayed = [site](uint16_t other) { return other != site; };
+  if (!command_log_.SawAllBut(site, have) ||
+      !command_log_.Since(have, relayed, &missing)) {
+    return nullptr;
+  }
+  std::unique_ptr<BufferListener> listener = NewListener(update);
+  listeners_.push_back(listener.get());
+  initial(command_log_.seen(), missing);
+  return listener;
+}
+
+VersionVector Buffer::CommandsSeen() const {
+  absl::MutexLock lock(&mu_);
+  return command_log_.seen();
+}
+
+bool Buffer::WithCommandsSince(
+    const VersionVector& have,
+    std::function<void(const CommandSet& missing)> f) const {
+  absl::MutexLock lock(&mu_);
+  CommandSet missing;
+  // the peer hears only this site's commands from here; it has the rest
+  // from their makers
+  const uint16_t own = site_.site_id();
+  auto relayed = [own](uint16_t other) { return other == own; };
+  if (!command_log_.Since(have, relayed, &missing)) return false;
+  f(missing);
+  return true;
+}
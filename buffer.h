@@ -13,21 +13,48 @@
 // limitations under the License.
 #pragma once
 
+#include <array>
 #include <boost/filesystem.hpp>
 #include <thread>
+#include <vector>
 #include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/types/optional.h"
 #include "annotated_string.h"
+#include "command_log.h"
 #include "selector.h"
 
 class Project;
 
+// Ephemeral state attached to a buffer from outside its document: replaced
+// wholesale by each publish, never integrated into content (so never synced
+// or saved)
+struct Presence {
+  // start of line ids (per LineIterator) linked to another buffer's cursor
+  std::vector<ID> linked_lines;
+};
+
+// The lines a client's editor displays: passed through a buffer to the
+// collaborators carrying it to the server, which scopes what it streams
+struct Viewport {
+  // start of the first line shown (per LineIterator)
+  ID first_line = AnnotatedString::Begin();
+  int lines = 0;
+
+  bool operator==(const Viewport& other) const {
+    return first_line == other.first_line && lines == other.lines;
+  }
+  bool operator!=(const Viewport& other) const { return !operator==(other); }
+};
+
 struct EditNotification {
   bool fully_loaded = false;
+  // every sync collaborator has answered the fully loaded content
+  bool first_pass_complete = false;
   bool shutdown = false;
   uint64_t referenced_file_version = 0;
   AnnotatedString content;
+  Presence presence;
 };
 
 struct EditResponse {
@@ -36,6 +63,7 @@ struct EditResponse {
   bool become_loaded = false;
   bool referenced_file_changed = false;
   CommandSet content_updates;
+  absl::optional<Viewport> viewport;
 };
 
 void IntegrateResponse(const EditResponse& response, EditNotification* state);
@@ -49,6 +77,7 @@ class BufferListener {
  private:
   friend class Buffer;
   virtual void Update(const CommandSet* updates) = 0;
+  virtual void UpdateViewport(const Viewport& viewport) {}
   void Start(std::function<void(const AnnotatedString&)> init);
   BufferListener(Buffer* buffer);
 
@@ -60,15 +89,28 @@ class Collaborator {
   virtual ~Collaborator() {}
 
   const char* name() const { return name_; }
-  absl::Duration push_delay_from_idle() const { return push_delay_from_idle_; }
-  absl::Duration push_delay_from_start() const {
+  // how long to let edits settle before pushing them: overridable by
+  // collaborators whose push cost changes as the buffer does
+  virtual absl::Duration push_delay_from_idle() const {
+    return push_delay_from_idle_;
+  }
+  virtual absl::Duration push_delay_from_start() const {
     return push_delay_from_start_;
   }
 
+  // response latencies: bucket i counts those under 2^i ms, the last bucket
+  // everything slower
+  static constexpr int kLatencyBuckets = 16;
+  typedef std::array<uint64_t, kLatencyBuckets> LatencyHistogram;
+
   void MarkRequest() { last_request_ = absl::Now(); }
-  void MarkResponse() { last_response_ = absl::Now(); }
+  void MarkResponse();
   void MarkChange() { last_change_ = absl::Now(); }
 
+  const LatencyHistogram& latency_histogram() const {
+    return latency_histogram_;
+  }
+
   const absl::Time& last_response() const { return last_response_; }
   const absl::Time& last_request() const { return last_request_; }
   const absl::Time& last_change() const { return last_change_; }
@@ -88,6 +130,9 @@ class Collaborator {
   absl::Time last_request_ = absl::Now();
   absl::Time last_change_ = absl::Now();
   absl::Duration last_notify_ = absl::Seconds(0);
+  // the request last responded to
+  absl::Time answered_request_ = absl::Now();
+  LatencyHistogram latency_histogram_{};
 };
 
 typedef std::unique_ptr<Collaborator> CollaboratorPtr;
@@ -109,6 +154,8 @@ class AsyncCommandCollaborator : public Collaborator {
   virtual void Push(const CommandSet* commands) = 0;
   // return true if successful, false if done
   virtual bool Pull(CommandSet* commands) = 0;
+  // the viewport published into the buffer moved
+  virtual void PushViewport(const Viewport& viewport) {}
 
  protected:
   AsyncCommandCollaborator(const char* name,
@@ -163,10 +210,24 @@ class Buffer {
       return *this;
     }
 
+    // The initial string was restored from a snapshot, and these are the
+    // sites its content came from
+    Builder& SetRestoredSites(const std::vector<uint16_t>& sites) {
+      restored_sites_ = sites;
+      return *this;
+    }
+
+    // Driven by a program rather than a person: nothing is displayed
+    Builder& SetHeadless(bool headless = true) {
+      headless_ = headless;
+      return *this;
+    }
+
     std::unique_ptr<Buffer> Make() {
       assert(filename_);
-      return std::unique_ptr<Buffer>(new Buffer(
-          project_, *filename_, initial_string_, site_id_, synthetic_));
+      return std::unique_ptr<Buffer>(
+          new Buffer(project_, *filename_, initial_string_, site_id_,
+                     synthetic_, headless_, restored_sites_));
     }
 
    private:
@@ -175,6 +236,8 @@ class Buffer {
     absl::optional<int> site_id_;
     Project* project_ = nullptr;
     bool synthetic_ = false;
+    bool headless_ = false;
+    std::vector<uint16_t> restored_sites_;
   };
 
   Buffer(const Buffer&) = delete;
@@ -194,27 +257,66 @@ class Buffer {
   const boost::filesystem::path& filename() const { return filename_; }
   bool read_only() const { return false; }
   bool synthetic() const { return synthetic_; }
+  bool headless() const { return headless_; }
+  // non-empty if the buffer started from a snapshot rather than its file
+  const std::vector<uint16_t>& restored_sites() const {
+    return restored_sites_;
+  }
   bool is_server() const { return project_ != nullptr; }
   bool is_client() const { return !is_server(); }
 
   std::vector<std::string> ProfileData() const;
 
+  // For diagnostics, alongside ContentSnapshot().GetStats()
+  struct Stats {
+    uint64_t version;
+    size_t logged_commands;
+    size_t listeners;
+    std::vector<std::pair<std::string, Collaborator::LatencyHistogram>>
+        collaborators;
+  };
+  Stats GetStats() const;
+
   static void RegisterCollaborator(
       std::function<void(Buffer*)> maybe_init_collaborator);
 
   void PushChanges(const CommandSet* cmds, bool become_used);
-  AnnotatedString ContentSnapshot();
+  void PublishPresence(Presence presence);
+  void PublishViewport(const Viewport& viewport);
+  AnnotatedString ContentSnapshot() const;
 
+  // Listeners hear each update in the order they started listening, so one
+  // may rely on another that started before it having seen the update.
   std::unique_ptr<BufferListener> Listen(
       std::function<void(const AnnotatedString&)> initial,
       std::function<void(const CommandSet*)> update);
+  // As Listen, but for a peer on site that has already seen `have`: initial
+  // gets this buffer's version vector and the logged commands the peer lacks
+  // in place of a snapshot, deletions it may have missed included. nullptr if
+  // the log no longer reaches back that far, or if the peer has seen other
+  // sites' commands it never logged.
+  std::unique_ptr<BufferListener> ListenFrom(
+      uint16_t site, const VersionVector& have,
+      std::function<void(const VersionVector& seen, const CommandSet& missing)>
+          initial,
+      std::function<void(const CommandSet*)> update);
+
+  VersionVector CommandsSeen() const;
+  // Calls f with the logged commands a peer that has seen `have` lacks,
+  // deletions it may have missed included; nothing is published to listeners
+  // until it returns. False (without calling f) if the log no longer reaches
+  // back that far.
+  bool WithCommandsSince(const VersionVector& have,
+                         std::function<void(const CommandSet& missing)> f)
+      const;
 
  private:
   friend class BufferListener;
 
   Buffer(Project* project, const boost::filesystem::path& filename,
          absl::optional<AnnotatedString> initial_string,
-         absl::optional<int> site_id, bool synthetic);
+         absl::optional<int> site_id, bool synthetic, bool headless,
+         const std::vector<uint16_t>& restored_sites);
 
   void AddCollaborator(AsyncCollaboratorPtr&& collaborator);
   void AddCollaborator(AsyncCommandCollaboratorPtr&& collaborator);
@@ -227,19 +329,33 @@ class Buffer {
   void RunPush(AsyncCollaborator* collaborator);
   void RunPull(AsyncCollaborator* collaborator);
   void RunSync(SyncCollaborator* collaborator);
+  // collaborator has answered the fully loaded content, or given up
+  void FinishedFirstPass(Collaborator* collaborator) LOCKS_EXCLUDED(mu_);
 
   void UpdateState(Collaborator* collaborator, bool become_used,
                    std::function<void(EditNotification& new_state)>);
   void PublishToListeners(const CommandSet* command_set,
                           BufferListener* except);
+  std::unique_ptr<BufferListener> NewListener(
+      std::function<void(const CommandSet*)> update);
 
   Project* const project_;
   mutable absl::Mutex mu_;
   const bool synthetic_;
+  const bool headless_;
+  const std::vector<uint16_t> restored_sites_;
   uint64_t version_ GUARDED_BY(mu_);
   std::set<Collaborator*> declared_no_edit_collaborators_ GUARDED_BY(mu_);
   std::set<Collaborator*> done_collaborators_ GUARDED_BY(mu_);
-  std::set<BufferListener*> listeners_ GUARDED_BY(mu_);
+  // sync collaborators yet to finish their first pass, which can only
+  // complete once every collaborator is added
+  std::set<Collaborator*> first_pass_pending_ GUARDED_BY(mu_);
+  bool collaborators_added_ GUARDED_BY(mu_) = false;
+  bool first_pass_announced_ GUARDED_BY(mu_) = false;
+  // in the order they started listening
+  std::vector<BufferListener*> listeners_ GUARDED_BY(mu_);
+  // everything published to listeners
+  CommandLog command_log_ GUARDED_BY(mu_);
   bool updating_ GUARDED_BY(mu_);
   absl::Time last_used_ GUARDED_BY(mu_);
   const boost::filesystem::path filename_;
@@ -0,0 +1,437 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "buffer_snapshot.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cstring>
+#include <unordered_map>
+#include "absl/strings/str_cat.h"
+#include "log.h"
+#include "project.h"
+#include "read.h"
+#include "wrap_syscall.h"
+
+DEFINE_bool(buffer_snapshots, true,
+            "Snapshot open buffers so that a restarted server shows them "
+            "annotated without waiting for collaborators");
+
+namespace {
+
+constexpr char kMagic[8] = {'c', 'e', 'd', 's', 'n', 'a', 'p', '\0'};
+// written in host order: a snapshot is only read back on the same machine
+constexpr uint32_t kByteOrder = 0x01020304;
+constexpr uint32_t kVersion = 1;
+
+// offsets are from the start of the snapshot
+struct Section {
+  uint64_t offset;
+  uint64_t count;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint64_t size;
+  Section filename;     // bytes
+  Section chars;        // CharRecords
+  Section attributes;   // AttributeRecords
+  Section annotations;  // AnnotationRecords
+  Section blob;         // bytes: serialized Attributes
+};
+
+struct CharRecord {
+  uint64_t id;
+  uint64_t next;
+  uint64_t prev;
+  uint64_t after;
+  uint64_t before;
+  uint8_t visible;
+  char chr;
+  uint8_t padding[6];
+};
+static_assert(sizeof(CharRecord) == 48, "CharRecord layout changed");
+
+struct AttributeRecord {
+  uint64_t id;
+  uint64_t offset;  // into blob
+  uint64_t length;
+};
+
+struct AnnotationRecord {
+  uint64_t id;
+  uint64_t begin;
+  uint64_t end;
+  uint64_t attribute;
+};
+
+bool Kept(Attribute::DataCase type) {
+  return type != Attribute::kCursor && type != Attribute::kSelection;
+}
+
+void AppendSection(std::string* out, const void* records, size_t count,
+                   size_t size, Section* section) {
+  out->resize((out->size() + 7) & ~size_t(7), '\0');
+  section->offset = out->size();
+  section->count = count;
+  out->append(static_cast<const char*>(records), count * size);
+}
+
+bool Fits(absl::string_view data, const Section& section, size_t size) {
+  return section.offset <= data.size() &&
+         section.count <= (data.size() - section.offset) / size;
+}
+
+// records are copied out rather than aliased: the data needn't be aligned
+template <class T>
+T Record(absl::string_view data, const Section& section, uint64_t i) {
+  T record;
+  memcpy(&record, data.data() + section.offset + i * sizeof(T), sizeof(T));
+  return record;
+}
+
+}  // namespace
+
+std::string BufferSnapshot::Encode(const boost::filesystem::path& filename,
+                                   const AnnotatedString& content) {
+  std::vector<CharRecord> chars;
+  content.chars_.ForEach([&](ID id, const AnnotatedString::CharInfo& ci) {
+    CharRecord r;
+    memset(&r, 0, sizeof(r));
+    r.id = id.id;
+    r.next = ci.next.id;
+    r.prev = ci.prev.id;
+    r.after = ci.after.id;
+    r.before = ci.before.id;
+    r.visible = ci.visible;
+    r.chr = ci.chr;
+    chars.push_back(r);
+  });
+  std::string blob;
+  std::vector<AttributeRecord> attributes;
+  content.attributes_by_type_.ForEach(
+      [&](Attribute::DataCase type, AVL<ID, Attribute> by_type) {
+        if (!Kept(type)) return;
+        by_type.ForEach([&](ID id, const Attribute& attr) {
+          AttributeRecord r{id.id, blob.size(), 0};
+          attr.AppendToString(&blob);
+          r.length = blob.size() - r.offset;
+          attributes.push_back(r);
+        });
+      });
+  std::vector<AnnotationRecord> annotations;
+  content.annotations_by_type_.ForEach(
+      [&](Attribute::DataCase type, AVL<ID, Annotation> by_type) {
+        if (!Kept(type)) return;
+        by_type.ForEach([&](ID id, const Annotation& anno) {
+          annotations.push_back(AnnotationRecord{id.id, anno.begin(),
+                                                 anno.end(), anno.attribute()});
+        });
+      });
+  // the graveyard isn't kept: nothing the old process made can still arrive
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.byte_order = kByteOrder;
+  header.version = kVersion;
+  std::string out(sizeof(header), '\0');
+  const std::string name = filename.string();
+  AppendSection(&out, name.data(), name.size(), 1, &header.filename);
+  AppendSection(&out, chars.data(), chars.size(), sizeof(CharRecord),
+                &header.chars);
+  AppendSection(&out, attributes.data(), attributes.size(),
+                sizeof(AttributeRecord), &header.attributes);
+  AppendSection(&out, annotations.data(), annotations.size(),
+                sizeof(AnnotationRecord), &header.annotations);
+  AppendSection(&out, blob.data(), blob.size(), 1, &header.blob);
+  header.size = out.size();
+  memcpy(&out[0], &header, sizeof(header));
+  return out;
+}
+
+absl::optional<BufferSnapshot::Restored> BufferSnapshot::Decode(
+    absl::string_view data, const boost::filesystem::path& filename,
+    absl::string_view text) {
+  const absl::optional<Restored> none;
+  Header h;
+  if (data.size() < sizeof(h)) return none;
+  memcpy(&h, data.data(), sizeof(h));
+  if (memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 ||
+      h.byte_order != kByteOrder || h.version != kVersion ||
+      h.size != data.size()) {
+    return none;
+  }
+  if (!Fits(data, h.filename, 1) || !Fits(data, h.chars, sizeof(CharRecord)) ||
+      !Fits(data, h.attributes, sizeof(AttributeRecord)) ||
+      !Fits(data, h.annotations, sizeof(AnnotationRecord)) ||
+      !Fits(data, h.blob, 1)) {
+    return none;
+  }
+  if (data.substr(h.filename.offset, h.filename.count) != filename.string()) {
+    return none;
+  }
+
+  // Everything is checked before anything is built: the snapshot may be
+  // stale or damaged, and a bad id would otherwise send a walk astray.
+  std::unordered_map<uint64_t, uint64_t> index;
+  index.reserve(h.chars.count);
+  for (uint64_t i = 0; i < h.chars.count; i++) {
+    ID id = Record<CharRecord>(data, h.chars, i).id;
+    if (id.site == 0 && id != AnnotatedString::Begin() &&
+        id != AnnotatedString::End()) {
+      return none;
+    }
+    if (!index.emplace(id.id, i).second) return none;
+  }
+  // walk the document, checking it links up and still spells out text
+  static constexpr uint64_t kUnvisited = ~uint64_t(0);
+  std::vector<uint64_t> order;  // record index by position
+  std::vector<uint64_t> position(h.chars.count, kUnvisited);
+  order.reserve(h.chars.count);
+  size_t text_pos = 0;
+  ID prev = AnnotatedString::End();
+  ID at = AnnotatedString::Begin();
+  for (;;) {
+    auto it = index.find(at.id);
+    if (it == index.end() || position[it->second] != kUnvisited) return none;
+    const CharRecord r = Record<CharRecord>(data, h.chars, it->second);
+    if (at != AnnotatedString::Begin() && r.prev != prev.id) return none;
+    position[it->second] = order.size();
+    order.push_back(it->second);
+    if (r.visible) {
+      if (at.site == 0) return none;
+      if (text_pos == text.size() || text[text_pos] != r.chr) return none;
+      text_pos++;
+    }
+    if (at == AnnotatedString::End()) break;
+    prev = at;
+    at = r.next;
+  }
+  if (text_pos != text.size() || order.size() != h.chars.count) return none;
+  // concurrent inserts are ordered through after and before: each must name
+  // a character the snapshot holds (Begin and End name each other)
+  for (uint64_t i = 0; i < h.chars.count; i++) {
+    const CharRecord r = Record<CharRecord>(data, h.chars, i);
+    if (index.count(r.after) == 0 || index.count(r.before) == 0) return none;
+  }
+
+  std::vector<std::pair<uint64_t, Attribute>> attributes;
+  std::unordered_map<uint64_t, Attribute::DataCase> attribute_types;
+  attributes.reserve(h.attributes.count);
+  for (uint64_t i = 0; i < h.attributes.count; i++) {
+    const auto r = Record<AttributeRecord>(data, h.attributes, i);
+    if (ID(r.id).site == 0 || r.offset > h.blob.count ||
+        r.length > h.blob.count - r.offset) {
+      return none;
+    }
+    Attribute attr;
+    if (!attr.ParseFromArray(data.data() + h.blob.offset + r.offset,
+                             r.length) ||
+        !Kept(attr.data_case()) ||
+        !attribute_types.emplace(r.id, attr.data_case()).second) {
+      return none;
+    }
+    attributes.emplace_back(r.id, std::move(attr));
+  }
+  // likewise the attributes that refer to others
+  for (const auto& attr : attributes) {
+    const Attribute& value = attr.second;
+    if ((value.has_fixit() && value.fixit().diagnostic() != 0 &&
+         attribute_types.count(value.fixit().diagnostic()) == 0) ||
+        (value.has_buffer_ref() && value.buffer_ref().buffer() != 0 &&
+         attribute_types.count(value.buffer_ref().buffer()) == 0)) {
+      return none;
+    }
+  }
+
+  // (mark position, mark id) for each visible character a mark covers
+  std::vector<std::pair<uint64_t, uint64_t>> marked;
+  std::vector<AnnotationRecord> annotations;
+  annotations.reserve(h.annotations.count);
+  for (uint64_t i = 0; i < h.annotations.count; i++) {
+    const auto r = Record<AnnotationRecord>(data, h.annotations, i);
+    auto begin = index.find(r.begin);
+    auto end = index.find(r.end);
+    if (ID(r.id).site == 0 || begin == index.end() || end == index.end() ||
+        attribute_types.count(r.attribute) == 0) {
+      return none;
+    }
+    const uint64_t first = position[begin->second];
+    const uint64_t last = position[end->second];
+    if (first > last) return none;
+    for (uint64_t p = first; p < last; p++) {
+      if (Record<CharRecord>(data, h.chars, order[p]).visible) {
+        marked.emplace_back(p, r.id);
+      }
+    }
+    annotations.push_back(r);
+  }
+  std::sort(marked.begin(), marked.end());
+
+  Restored out;
+  std::unordered_map<uint16_t, uint16_t> sites;
+  auto remap = [&sites](uint64_t raw) {
+    ID id(raw);
+    if (id.site == 0) return id;
+    const uint16_t old_site = id.site;
+    auto it = sites.find(old_site);
+    if (it == sites.end()) {
+      Site fresh;
+      it = sites.emplace(old_site, fresh.site_id()).first;
+    }
+    id.site = it->second;
+    return id;
+  };
+
+  AnnotatedString& content = out.content;
+  std::vector<ID> lines{AnnotatedString::Begin()};
+  auto next_mark = marked.begin();
+  for (uint64_t p = 0; p < order.size(); p++) {
+    const CharRecord r = Record<CharRecord>(data, h.chars, order[p]);
+    AVL<ID> marks;
+    for (; next_mark != marked.end() && next_mark->first == p; ++next_mark) {
+      marks = marks.Add(remap(next_mark->second));
+    }
+    const ID id = remap(r.id);
+    content.chars_ = content.chars_.Add(
+        id, AnnotatedString::CharInfo{r.visible != 0, r.chr, remap(r.next),
+                                      remap(r.prev), remap(r.after),
+                                      remap(r.before), marks});
+    if (r.visible && r.chr == '\n' && id.site != 0) lines.push_back(id);
+  }
+  lines.push_back(AnnotatedString::End());
+  for (size_t i = 0; i < lines.size(); i++) {
+    ID prev_line = i == 0 ? AnnotatedString::End() : lines[i - 1];
+    ID next_line = i == lines.size() - 1 ? AnnotatedString::Begin()
+                                          : lines[i + 1];
+    content.line_breaks_ = content.line_breaks_.Add(
+        lines[i], AnnotatedString::LineBreak{prev_line, next_line});
+  }
+
+  for (auto& attr : attributes) {
+    // the only attributes that refer to others
+    Attribute& value = attr.second;
+    if (value.has_fixit() && value.fixit().diagnostic() != 0) {
+      value.mutable_fixit()->set_diagnostic(
+          remap(value.fixit().diagnostic()).id);
+    }
+    if (value.has_buffer_ref() && value.buffer_ref().buffer() != 0) {
+      value.mutable_buffer_ref()->set_buffer(
+          remap(value.buffer_ref().buffer()).id);
+    }
+    content.IntegrateDecl(remap(attr.first), value);
+  }
+  for (const auto& r : annotations) {
+    const ID id = remap(r.id);
+    const Attribute::DataCase type = attribute_types[r.attribute];
+    Annotation anno;
+    anno.set_begin(remap(r.begin).id);
+    anno.set_end(remap(r.end).id);
+    anno.set_attribute(remap(r.attribute).id);
+    content.annotations_ = content.annotations_.Add(id, type);
+    const auto* by_type = content.annotations_by_type_.Lookup(type);
+    content.annotations_by_type_ = content.annotations_by_type_.Add(
+        type, (by_type ? *by_type : AVL<ID, Annotation>()).Add(id, anno));
+  }
+
+  for (const auto& site : sites) out.sites.push_back(site.second);
+  std::sort(out.sites.begin(), out.sites.end());
+  return out;
+}
+
+boost::filesystem::path BufferSnapshot::PathFor(
+    const Project* project, const boost::filesystem::path& filename) {
+  const std::string name = filename.string();
+  const uLong crc =
+      crc32(0, reinterpret_cast<const Bytef*>(name.data()), name.size());
+  return project->aspect<ProjectRoot>()->Path() / ".cedsnap" /
+         absl::StrCat(absl::Hex(crc, absl::kZeroPad8), "-",
+                      filename.filename().string());
+}
+
+void BufferSnapshot::Save(const Project* project,
+                          const boost::filesystem::path& filename,
+                          const AnnotatedString& content) {
+  LogTimer timer("save_snapshot");
+  const boost::filesystem::path path = PathFor(project, filename);
+  boost::filesystem::create_directories(path.parent_path());
+  const std::string data = Encode(filename, content);
+  timer.Mark("encode");
+  const std::string tmp = absl::StrCat(path.string(), ".", getpid());
+  int fd = WrapSyscall("open", [&]() {
+    return open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  });
+  try {
+    for (size_t done = 0; done < data.size();) {
+      done += WrapSyscall("write", [&]() {
+        return write(fd, data.data() + done, data.size() - done);
+      });
+    }
+  } catch (...) {
+    close(fd);
+    unlink(tmp.c_str());
+    throw;
+  }
+  close(fd);
+  WrapSyscall("rename",
+              [&]() { return rename(tmp.c_str(), path.string().c_str()); });
+  timer.Mark("write");
+}
+
+absl::optional<BufferSnapshot::Restored> BufferSnapshot::Load(
+    const Project* project, const boost::filesystem::path& filename) {
+  if (!FLAGS_buffer_snapshots) return absl::optional<Restored>();
+  const boost::filesystem::path path = PathFor(project, filename);
+  int fd = open(path.string().c_str(), O_RDONLY);
+  if (fd == -1) return absl::optional<Restored>();
+  LogTimer timer("load_snapshot");
+  try {
+    struct stat st;
+    WrapSyscall("fstat", [&]() { return fstat(fd, &st); });
+    if (st.st_size == 0) {
+      close(fd);
+      return absl::optional<Restored>();
+    }
+    void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    fd = -1;
+    if (mem == MAP_FAILED) throw std::runtime_error("mmap failed");
+    absl::optional<Restored> restored;
+    try {
+      const std::string text = Read(filename);
+      timer.Mark("read");
+      restored = Decode(
+          absl::string_view(static_cast<const char*>(mem), st.st_size),
+          filename, text);
+    } catch (...) {
+      munmap(mem, st.st_size);
+      throw;
+    }
+    munmap(mem, st.st_size);
+    timer.Mark("decode");
+    if (!restored) Log() << "Ignoring stale snapshot " << path;
+    return restored;
+  } catch (std::exception& e) {
+    if (fd != -1) close(fd);
+    Log() << "Failed loading snapshot " << path << ": " << e.what();
+    return absl::optional<Restored>();
+  }
+}
@@ -0,0 +1,65 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <gflags/gflags.h>
+#include <boost/filesystem/path.hpp>
+#include <string>
+#include <vector>
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "annotated_string.h"
+
+class Project;
+
+DECLARE_bool(buffer_snapshots);
+
+// Snapshots of a buffer's whole AnnotatedString, so that a restarted server
+// can show previously open buffers fully annotated without waiting for
+// every collaborator to run again.
+//
+// The format is position independent and read in place from a mapping:
+// characters and marks are fixed size records whose ids refer to each other,
+// and only attribute values are kept as serialized protos. Cursors and
+// selections belong to sessions, and aren't kept.
+class BufferSnapshot {
+ public:
+  // A snapshot's content, with each site of the process that wrote it
+  // renumbered to a site of this one that nothing else uses
+  struct Restored {
+    AnnotatedString content;
+    std::vector<uint16_t> sites;
+  };
+
+  static std::string Encode(const boost::filesystem::path& filename,
+                            const AnnotatedString& content);
+  // nullopt unless data is an intact snapshot of filename whose text is
+  // (still) text
+  static absl::optional<Restored> Decode(
+      absl::string_view data, const boost::filesystem::path& filename,
+      absl::string_view text);
+
+  // where the snapshot of filename lives, under the project root
+  static boost::filesystem::path PathFor(
+      const Project* project, const boost::filesystem::path& filename);
+
+  // Atomically replaces the snapshot of filename; throws on failure
+  static void Save(const Project* project,
+                   const boost::filesystem::path& filename,
+                   const AnnotatedString& content);
+  // The snapshot of filename, if one was saved while the file on disk had
+  // its current contents
+  static absl::optional<Restored> Load(const Project* project,
+                                       const boost::filesystem::path& filename);
+};
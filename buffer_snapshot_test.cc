@@ -0,0 +1,167 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "buffer_snapshot.h"
+#include <string.h>
+#include <algorithm>
+#include "gtest/gtest.h"
+
+namespace {
+
+struct Annotated {
+  AnnotatedString str;
+  ID diagnostic;
+};
+
+Annotated MakeAnnotated(Site* site) {
+  Annotated out;
+  AnnotatedString& str = out.str;
+  ID a = str.Insert(site, "hello\nworld\n", AnnotatedString::Begin());
+  CommandSet cmds;
+  str.MakeDelete(&cmds, a);
+  for (const auto& cmd : cmds.commands()) str.Integrate(cmd);
+  str.Insert(site, "!", a);
+
+  cmds.Clear();
+  Attribute tags;
+  tags.mutable_tags()->add_tags("keyword");
+  ID tag = AnnotatedString::MakeDecl(&cmds, site, tags);
+  Attribute diag;
+  diag.mutable_diagnostic()->set_message("oops");
+  out.diagnostic = AnnotatedString::MakeDecl(&cmds, site, diag);
+  Attribute fix;
+  fix.mutable_fixit()->set_diagnostic(out.diagnostic.id);
+  ID fixit = AnnotatedString::MakeDecl(&cmds, site, fix);
+  Attribute cursor;
+  cursor.mutable_cursor();
+  ID cur = AnnotatedString::MakeDecl(&cmds, site, cursor);
+  Annotation anno;
+  anno.set_begin(AnnotatedString::Iterator(str, AnnotatedString::Begin())
+                     .Next()
+                     .id()
+                     .id);
+  anno.set_end(AnnotatedString::LineIterator(str, AnnotatedString::Begin())
+                   .Next()
+                   .id()
+                   .id);
+  anno.set_attribute(tag.id);
+  AnnotatedString::MakeMark(&cmds, site, anno);
+  anno.set_attribute(fixit.id);
+  AnnotatedString::MakeMark(&cmds, site, anno);
+  anno.set_attribute(cur.id);
+  AnnotatedString::MakeMark(&cmds, site, anno);
+  for (const auto& cmd : cmds.commands()) str.Integrate(cmd);
+  return out;
+}
+
+std::vector<std::string> TagsAt(const AnnotatedString& str, int offset) {
+  AnnotatedString::Iterator it(str, AnnotatedString::Begin());
+  for (int i = 0; i <= offset; i++) it.MoveNext();
+  std::vector<std::string> tags;
+  it.ForEachAttrValue([&tags](const Attribute& attr) {
+    if (attr.has_tags()) tags.push_back(attr.tags().tags(0));
+  });
+  return tags;
+}
+
+}  // namespace
+
+TEST(BufferSnapshotTest, RoundTrips) {
+  Site site;
+  Annotated in = MakeAnnotated(&site);
+  const std::string text = in.str.Render();
+  EXPECT_EQ("hello\nworld!", text);
+
+  auto out = BufferSnapshot::Decode(BufferSnapshot::Encode("/x/a.cc", in.str),
+                                    "/x/a.cc", text);
+  ASSERT_TRUE(out);
+  EXPECT_EQ(text, out->content.Render());
+  ASSERT_EQ(1, out->sites.size());
+  EXPECT_NE(site.site_id(), out->sites[0]);
+  EXPECT_EQ(std::vector<std::string>{"keyword"}, TagsAt(out->content, 0));
+  EXPECT_EQ(std::vector<std::string>{"keyword"}, TagsAt(out->content, 4));
+  EXPECT_EQ(std::vector<std::string>(), TagsAt(out->content, 6));
+
+  // lines are indexed
+  AnnotatedString::LineIterator line(out->content, AnnotatedString::Begin());
+  line.MoveNext();
+  EXPECT_EQ("\nworld!", out->content.Render(line.id(), AnnotatedString::End()));
+
+  // cursors aren't kept, and references follow renumbered sites
+  int cursors = 0;
+  out->content.ForEachAnnotation(
+      Attribute::kCursor,
+      [&cursors](ID, ID, ID, const Attribute&) { cursors++; });
+  EXPECT_EQ(0, cursors);
+  int fixits = 0;
+  out->content.ForEachAttribute(
+      Attribute::kFixit, [&](ID id, const Attribute& attr) {
+        fixits++;
+        EXPECT_EQ(out->sites[0], id.site);
+        ID diag = attr.fixit().diagnostic();
+        EXPECT_EQ(out->sites[0], diag.site);
+        EXPECT_EQ(in.diagnostic.clock, diag.clock);
+      });
+  EXPECT_EQ(1, fixits);
+
+  // the restored string takes further edits
+  Site editor;
+  out->content.Insert(&editor, "x", AnnotatedString::Begin());
+  EXPECT_EQ("xhello\nworld!", out->content.Render());
+}
+
+TEST(BufferSnapshotTest, RejectsStaleSnapshots) {
+  Site site;
+  Annotated in = MakeAnnotated(&site);
+  const std::string data = BufferSnapshot::Encode("/x/a.cc", in.str);
+  EXPECT_FALSE(BufferSnapshot::Decode(data, "/x/a.cc", "hello\nworld"));
+  EXPECT_FALSE(BufferSnapshot::Decode(data, "/x/a.cc", "hello\nworld!!"));
+  EXPECT_FALSE(BufferSnapshot::Decode(data, "/x/b.cc", "hello\nworld!"));
+}
+
+TEST(BufferSnapshotTest, RejectsDamagedSnapshots) {
+  Site site;
+  Annotated in = MakeAnnotated(&site);
+  const std::string text = in.str.Render();
+  const std::string data = BufferSnapshot::Encode("/x/a.cc", in.str);
+  EXPECT_FALSE(BufferSnapshot::Decode(data.substr(0, data.size() - 1),
+                                      "/x/a.cc", text));
+  // flipping any byte either leaves the snapshot decodable
+  // as the same text or gets it rejected
+  for (size_t i = 0; i < data.size(); i++) {
+    std::string bad = data;
+    bad[i] ^= 0x5a;
+    auto out = BufferSnapshot::Decode(bad, "/x/a.cc", text);
+    if (out) EXPECT_EQ(text, out->content.Render());
+  }
+}
+
+TEST(BufferSnapshotTest, RejectsDanglingIds) {
+  Site site;
+  Annotated in = MakeAnnotated(&site);
+  const std::string text = in.str.Render();
+  std::string data = BufferSnapshot::Encode("/x/a.cc", in.str);
+  // the first character's record: its id, then its next
+  AnnotatedString::Iterator first(in.str, AnnotatedString::Begin());
+  first.MoveNext();
+  const uint64_t link[2] = {first.id().id, first.Next().id().id};
+  const size_t record =
+      data.find(std::string(reinterpret_cast<const char*>(link), 16));
+  ASSERT_NE(std::string::npos, record);
+  // point its after at a character the snapshot doesn't hold
+  const uint64_t dangling = ID(site.site_id(), 1000000).id;
+  std::string bad = data;
+  memcpy(&bad[record + 24], &dangling, sizeof(dangling));
+  EXPECT_TRUE(BufferSnapshot::Decode(data, "/x/a.cc", text));
+  EXPECT_FALSE(BufferSnapshot::Decode(bad, "/x/a.cc", text));
+}
@@ -0,0 +1,126 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+// A rows x cols frame of cells (glyph + style packed into one trivially
+// copyable value) that a render pass draws into. Comparing against the
+// previously emitted frame yields just the spans that need to be output.
+template <class Cell>
+class CellGrid {
+ public:
+  static_assert(std::is_trivially_copyable<Cell>::value,
+                "cells are compared bytewise");
+
+  // unchanged runs shorter than this between two changed runs are emitted
+  // as part of one span: cheaper than another cursor move
+  static constexpr int kMergeGap = 4;
+
+  CellGrid() {}
+  CellGrid(int rows, int cols, Cell fill) { Reset(rows, cols, fill); }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+
+  void Reset(int rows, int cols, Cell fill) {
+    rows_ = rows;
+    cols_ = cols;
+    cells_.assign(static_cast<size_t>(rows) * cols, fill);
+  }
+
+  void Set(int row, int col, Cell cell) {
+    if (row < 0 || col < 0 || row >= rows_ || col >= cols_) return;
+    cells_[static_cast<size_t>(row) * cols_ + col] = cell;
+  }
+
+  Cell Get(int row, int col) const {
+    return cells_[static_cast<size_t>(row) * cols_ + col];
+  }
+
+  const Cell* Row(int row) const {
+    return cells_.data() + static_cast<size_t>(row) * cols_;
+  }
+
+  // Copies src into this grid with its top-left cell at (row, col), clipped
+  // to this grid. convert(const SrcCell&, Cell*) writes each destination
+  // cell, or leaves it alone to treat the source cell as transparent.
+  template <class SrcCell, class F>
+  void Composite(const CellGrid<SrcCell>& src, int row, int col,
+                 F&& convert) {
+    const int first_row = std::max(0, -row);
+    const int last_row = std::min(src.rows(), rows_ - row);
+    const int first_col = std::max(0, -col);
+    const int last_col = std::min(src.cols(), cols_ - col);
+    for (int r = first_row; r < last_row; r++) {
+      const SrcCell* in = src.Row(r);
+      Cell* out = MutableRow(row + r) + col;
+      for (int c = first_col; c < last_col; c++) {
+        convert(in[c], out + c);
+      }
+    }
+  }
+
+  // F(int row, int col, const Cell* cells, int n): called for each run of
+  // cells that differ from prev; every row is reported if the shapes differ
+  template <class F>
+  void ForEachChangedSpan(const CellGrid& prev, F&& f) const {
+    const bool same_shape = prev.rows_ == rows_ && prev.cols_ == cols_;
+    for (int row = 0; row < rows_; row++) {
+      const Cell* cur = Row(row);
+      if (!same_shape) {
+        f(row, 0, cur, cols_);
+        continue;
+      }
+      const Cell* old = prev.Row(row);
+      // whole-row compare first: memcmp is vectorized and most rows are
+      // untouched between frames
+      if (memcmp(cur, old, sizeof(Cell) * cols_) == 0) continue;
+      int col = 0;
+      for (;;) {
+        while (col < cols_ && Same(cur[col], old[col])) col++;
+        if (col == cols_) break;
+        const int start = col;
+        int end = col;
+        while (col < cols_) {
+          if (!Same(cur[col], old[col])) {
+            end = ++col;
+          } else if (col - end < kMergeGap) {
+            col++;
+          } else {
+            break;
+          }
+        }
+        f(row, start, cur + start, end - start);
+        col = end;
+      }
+    }
+  }
+
+ private:
+  Cell* MutableRow(int row) {
+    return cells_.data() + static_cast<size_t>(row) * cols_;
+  }
+
+  static bool Same(const Cell& a, const Cell& b) {
+    return memcmp(&a, &b, sizeof(Cell)) == 0;
+  }
+
+  int rows_ = 0;
+  int cols_ = 0;
+  std::vector<Cell> cells_;
+};
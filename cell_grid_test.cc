@@ -0,0 +1,69 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "cell_grid.h"
+#include <tuple>
+#include "gtest/gtest.h"
+
+typedef std::tuple<int, int, int> Span;
+
+static std::vector<Span> Changes(const CellGrid<int>& cur,
+                                 const CellGrid<int>& prev) {
+  std::vector<Span> out;
+  cur.ForEachChangedSpan(prev, [&](int row, int col, const int* cells, int n) {
+    EXPECT_EQ(cur.Row(row) + col, cells);
+    out.emplace_back(row, col, n);
+  });
+  return out;
+}
+
+TEST(CellGrid, IdenticalFramesEmitNothing) {
+  CellGrid<int> a(3, 10, 0);
+  CellGrid<int> b(3, 10, 0);
+  EXPECT_TRUE(Changes(a, b).empty());
+}
+
+TEST(CellGrid, ShapeChangeEmitsEverything) {
+  CellGrid<int> a(2, 10, 0);
+  CellGrid<int> b(3, 10, 0);
+  EXPECT_EQ((std::vector<Span>{Span(0, 0, 10), Span(1, 0, 10)}),
+            Changes(a, b));
+}
+
+TEST(CellGrid, SpansAndGaps) {
+  CellGrid<int> prev(2, 20, 0);
+  CellGrid<int> cur(2, 20, 0);
+  cur.Set(0, 1, 1);
+  cur.Set(0, 3, 1);   // within merge gap of col 1
+  cur.Set(0, 15, 1);  // far enough away to be its own span
+  cur.Set(1, 19, 1);
+  cur.Set(5, 5, 1);  // out of range: ignored
+  EXPECT_EQ(
+      (std::vector<Span>{Span(0, 1, 3), Span(0, 15, 1), Span(1, 19, 1)}),
+      Changes(cur, prev));
+}
+
+TEST(CellGrid, CompositeClipsAndSkipsTransparent) {
+  CellGrid<int> frame(3, 4, 0);
+  CellGrid<int> pane(2, 3, 7);
+  pane.Set(0, 1, -1);  // transparent
+  frame.Composite(pane, 1, 2, [](int in, int* out) {
+    if (in != -1) *out = in;
+  });
+  EXPECT_EQ((std::vector<int>{0, 0, 0, 0}),
+            std::vector<int>(frame.Row(0), frame.Row(0) + 4));
+  EXPECT_EQ((std::vector<int>{0, 0, 7, 0}),
+            std::vector<int>(frame.Row(1), frame.Row(1) + 4));
+  EXPECT_EQ((std::vector<int>{0, 0, 7, 7}),
+            std::vector<int>(frame.Row(2), frame.Row(2) + 4));
+}
@@ -14,11 +14,13 @@
 #include "clang_config.h"
 #include <sys/param.h>
 #include <boost/filesystem.hpp>
+#include <map>
 #include <stdexcept>
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "compilation_database.h"
 #include "config.h"
 #include "log.h"
@@ -95,8 +97,8 @@ boost::filesystem::path ClangLibPath(Project* project,
       absl::StrCat("Clang lib '", lib_name, "' not found"));
 }
 
-static void ExtractIncludePathsFromTool(const boost::filesystem::path& toolname,
-                                        std::vector<std::string>* args) {
+static void ExtractIncludePathsFromToolUncached(
+    const boost::filesystem::path& toolname, std::vector<std::string>* args) {
   /*
 #include <...> search starts here:
  /usr/local/google/home/ctiller/clang+llvm-4.0.0-x86_64-linux-gnu-ubuntu-14.04/bin/../include/c++/v1
@@ -130,6 +132,23 @@ End of search list.
   }
 }
 
+static void ExtractIncludePathsFromTool(const boost::filesystem::path& toolname,
+                                        std::vector<std::string>* args) {
+  // every project (and buffer) using a tool gets the same answer: run it once
+  // per process
+  static absl::Mutex mu;
+  // guarded by mu
+  static std::map<boost::filesystem::path, std::vector<std::string>> extracted;
+  absl::MutexLock lock(&mu);
+  auto it = extracted.find(toolname);
+  if (it == extracted.end()) {
+    std::vector<std::string> found;
+    ExtractIncludePathsFromToolUncached(toolname, &found);
+    it = extracted.emplace(toolname, std::move(found)).first;
+  }
+  args->insert(args->end(), it->second.begin(), it->second.end());
+}
+
 void ClangCompileArgs(Project* project, const boost::filesystem::path& filename,
                       std::vector<std::string>* args) {
   Config<std::string> clang_version(project, "project.clang-version");
@@ -14,65 +14,94 @@
 
 #include "client.h"
 #include <grpc++/create_channel.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <thread>
+#include "absl/strings/str_cat.h"
 #include "absl/time/clock.h"
+#include "command_batcher.h"
 #include "log.h"
 #include "project.h"
 #include "server.h"
+#include "shm_transport.h"
 #include "src_hash.h"
 
 DEFINE_bool(check_server_version, false,
             "Check the version of the server is the same as the client "
             "version, quit it otherwise");
 DEFINE_bool(restart_server, false, "Force the server to restart");
+DEFINE_int32(shm_ring_bytes, 1 << 20,
+             "Size of each direction of a shared memory edit channel");
+DEFINE_string(server, "",
+              "host:port of a ProjectServer started with -listen_tcp, to "
+              "edit its project from this machine (with the same "
+              "-tcp_token_file); files are named by their paths on the "
+              "server's machine");
+
+// round trips timed to size a remote connection's edit batches
+static constexpr int kRttProbes = 3;
 
 Client::Client(const boost::filesystem::path& ced_bin,
-               const boost::filesystem::path& path) {
+               const boost::filesystem::path& path)
+    : edit_options_(CommandBatcher::Options::FromFlags()) {
+  if (!FLAGS_server.empty()) {
+    ConnectRemote(FLAGS_server);
+    return;
+  }
   Project project(path, true);
   auto root = project.aspect<ProjectRoot>();
-  auto port_exists = [&]() {
-    return boost::filesystem::exists(root->LocalAddressPath());
-  };
+  const boost::filesystem::path port =
+      FLAGS_daemon ? DaemonAddressPath() : root->LocalAddressPath();
+  auto port_exists = [&]() { return boost::filesystem::exists(port); };
   auto unlink_port = [&]() {
-    if (!boost::filesystem::remove(root->LocalAddressPath())) {
+    if (!boost::filesystem::remove(port)) {
       throw std::runtime_error(
-          absl::StrCat("Failed to remove ", root->LocalAddressPath().string()));
+          absl::StrCat("Failed to remove ", port.string()));
     }
   };
 
   bool force_restart = FLAGS_restart_server;
+  LogTimer startup("server_connect");
 
   for (int attempt = 1; attempt <= 3; attempt++) {
     if (!port_exists()) {
       force_restart = false;
-      SpawnServer(ced_bin, project);
-      int a = 1, b = 1;
-      while (!port_exists()) {
-        auto timeout = absl::Milliseconds(a);
-        if (timeout > absl::Seconds(2)) {
-          throw std::runtime_error("Failed starting server");
-        }
-        Log() << "Sleeping for " << timeout << " while waiting for server @ "
-              << root->LocalAddress();
-        absl::SleepFor(timeout);
-        int c = a + b;
-        b = a;
-        a = c;
+      int ready_fd = SpawnServer(ced_bin, project);
+      startup.Mark("spawn");
+      bool ready;
+      try {
+        ready = WaitForServer(ready_fd, absl::Seconds(2));
+      } catch (...) {
+        close(ready_fd);
+        throw;
       }
+      close(ready_fd);
+      if (!ready) throw std::runtime_error("Failed starting server");
+      startup.Mark("server_ready");
     }
-    auto channel = grpc::CreateChannel(root->LocalAddress(),
-                                       grpc::InsecureChannelCredentials());
+    grpc::ChannelArguments args;
+    args.SetMaxReceiveMessageSize(kMaxMessageBytes);
+    args.SetMaxSendMessageSize(kMaxMessageBytes);
+    auto channel =
+        grpc::CreateCustomChannel(absl::StrCat("unix:", port.string()),
+                                  grpc::InsecureChannelCredentials(), args);
     project_stub_ = ProjectService::NewStub(channel);
 
     gpr_timespec hello_deadline = gpr_time_add(
         gpr_now(GPR_CLOCK_MONOTONIC), gpr_time_from_seconds(5, GPR_TIMESPAN));
 
     ConnectionHelloRequest hello_request;
+    hello_request.set_project_root(root->Path().string());
     ConnectionHelloResponse hello_response;
     grpc::ClientContext hello_ctx;
     hello_ctx.set_deadline(hello_deadline);
     auto hello_status = project_stub_->ConnectionHello(
         &hello_ctx, hello_request, &hello_response);
+    startup.Mark("connection_hello");
+    if (hello_status.error_code() == grpc::StatusCode::INVALID_ARGUMENT) {
+      // the server is fine, but won't serve this project
+      throw std::runtime_error(hello_status.error_message());
+    }
     if (!hello_status.ok()) {
       Log() << "ConnectionHello failed with status: "
             << hello_status.error_code() << " " << hello_status.error_message();
@@ -92,10 +121,55 @@ Client::Client(const boost::filesystem::path& ced_bin,
     }
 
     // if we get here, everything looks good to go!
+    shm_transport_ = FLAGS_shm_transport && hello_response.shm_transport();
     break;
   }
 }
 
+void Client::ConnectRemote(const std::string& address) {
+  tcp_token_ = ReadTcpToken();
+  grpc::ChannelArguments args;
+  args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, kRemoteKeepalivePingMs);
+  args.SetMaxReceiveMessageSize(kMaxMessageBytes);
+  args.SetMaxSendMessageSize(kMaxMessageBytes);
+  project_stub_ = ProjectService::NewStub(grpc::CreateCustomChannel(
+      address, grpc::InsecureChannelCredentials(), args));
+
+  // the first hello also connects, so only the later ones time the link
+  absl::Duration rtt = absl::InfiniteDuration();
+  for (int probe = 0; probe <= kRttProbes; probe++) {
+    ConnectionHelloRequest hello_request;
+    ConnectionHelloResponse hello_response;
+    grpc::ClientContext hello_ctx;
+    hello_ctx.set_deadline(
+        gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC),
+                     gpr_time_from_seconds(10, GPR_TIMESPAN)));
+    hello_ctx.AddMetadata(kTcpTokenMetadataKey, tcp_token_);
+    const absl::Time start = absl::Now();
+    auto status = project_stub_->ConnectionHello(&hello_ctx, hello_request,
+                                                 &hello_response);
+    if (!status.ok()) {
+      throw std::runtime_error(absl::StrCat("Failed connecting to ", address,
+                                            ": ", status.error_message()));
+    }
+    if (probe == 0) {
+      if (FLAGS_check_server_version &&
+          hello_response.src_hash() != ced_src_hash) {
+        throw std::runtime_error(
+            absl::StrCat("Server at ", address, " runs another version"));
+      }
+    } else {
+      rtt = std::min(rtt, absl::Now() - start);
+    }
+  }
+  // shared memory only reaches a server on this machine
+  shm_transport_ = false;
+  edit_options_ = CommandBatcher::Options::ForRtt(rtt);
+  Log() << "Connected to " << address << " with rtt "
+        << absl::FormatDuration(rtt) << ", batching edits for "
+        << absl::FormatDuration(edit_options_.window);
+}
+
 namespace {
 
 typedef std::unique_ptr<
@@ -104,63 +178,247 @@ typedef std::unique_ptr<
 
 class ClientCollaborator : public AsyncCommandCollaborator {
  public:
-  ClientCollaborator(const Buffer* buffer, EditStreamPtr stream,
-                     std::unique_ptr<grpc::ClientContext> context)
+  ClientCollaborator(const Buffer* buffer, ProjectService::Stub* stub,
+                     EditStreamPtr stream,
+                     std::unique_ptr<grpc::ClientContext> context,
+                     std::unique_ptr<ShmChannel> shm,
+                     CommandBatcher::Options batch_options,
+                     uint64_t server_incarnation, std::string tcp_token)
       : AsyncCommandCollaborator("client", absl::Seconds(0), absl::Seconds(0)),
+        buffer_(buffer),
+        stub_(stub),
+        server_incarnation_(server_incarnation),
+        tcp_token_(std::move(tcp_token)),
         context_(std::move(context)),
-        stream_(std::move(stream)) {}
+        stream_(std::move(stream)),
+        shm_(std::move(shm)),
+        batcher_(batch_options,
+                 [this](const EditMessage& msg) {
+                   absl::MutexLock lock(&mu_);
+                   // while reconnecting commands are dropped here: they're
+                   // resent from the buffer's command log once resumed
+                   if (shm_) {
+                     shm_->Write(msg);
+                   } else if (stream_) {
+                     stream_->Write(msg);
+                   }
+                   return true;
+                 }) {
+    absl::MutexLock lock(&mu_);
+    if (shm_) {
+      // over shared memory the stream is only watched for the server leaving
+      watchdog_ = std::thread([stream = stream_.get(), shm = shm_.get()]() {
+        EditMessage ignored;
+        while (stream->Read(&ignored)) {
+        }
+        shm->Close();
+      });
+    }
+  }
+
+  ~ClientCollaborator() { StopWatchdog(); }
 
   void Push(const CommandSet* commands) {
     if (commands == nullptr) {
+      batcher_.Flush();
+      absl::MutexLock lock(&mu_);
+      shutdown_ = true;
       Log() << "Cancel context";
-      context_->TryCancel();
+      if (shm_) shm_->Close();
+      if (context_) context_->TryCancel();
     } else {
-      EditMessage msg;
-      *msg.mutable_commands() = *commands;
-      stream_->Write(msg);
+      batcher_.Add(*commands);
     }
   }
 
+  void PushViewport(const Viewport& viewport) {
+    absl::MutexLock lock(&mu_);
+    viewport_ = viewport;
+    WriteViewportLocked();
+  }
+
   bool Pull(CommandSet* commands) {
     commands->Clear();
     EditMessage msg;
-    Log() << "Read";
-    if (!stream_->Read(&msg)) {
+    for (;;) {
+      grpc::ClientReaderWriterInterface<EditMessage, EditMessage>* stream;
+      ShmChannel* shm;
+      {
+        absl::MutexLock lock(&mu_);
+        stream = stream_.get();
+        shm = shm_.get();
+      }
+      Log() << "Read";
+      // only this thread replaces stream_ and shm_, so they can be read
+      // unlocked
+      if (shm ? shm->Read(&msg) : stream->Read(&msg)) break;
       Log() << "Read failed";
-      return false;
+      if (!Reconnect()) return false;
     }
-    if (msg.type_case() != EditMessage::kCommands) {
+    if (!ReadCommands(msg, commands)) {
       Log() << "Protocol error";
+      absl::MutexLock lock(&mu_);
       context_->TryCancel();
       return false;
     }
-    *commands = msg.commands();
     return true;
   }
 
  private:
-  std::unique_ptr<grpc::ClientContext> context_;
-  EditStreamPtr stream_;
+  static constexpr int kMaxReconnectAttempts = 8;
+
+  // Replaces a dropped stream with one resuming the session, so that only
+  // the commands each side missed are exchanged. False if shutting down or
+  // the session can't be resumed.
+  bool Reconnect() {
+    StopWatchdog();
+    {
+      absl::MutexLock lock(&mu_);
+      if (shutdown_) return false;
+      // a resumed session stays on gRPC
+      shm_.reset();
+      context_->TryCancel();
+      stream_.reset();
+      context_.reset();
+    }
+    absl::Duration backoff = absl::Milliseconds(50);
+    for (int attempt = 1; attempt <= kMaxReconnectAttempts; attempt++) {
+      absl::SleepFor(backoff);
+      backoff *= 2;
+      {
+        absl::MutexLock lock(&mu_);
+        if (shutdown_) return false;
+      }
+      Log() << "Resuming edit session, attempt " << attempt;
+      std::unique_ptr<grpc::ClientContext> ctx(new grpc::ClientContext());
+      if (!tcp_token_.empty()) {
+        ctx->AddMetadata(kTcpTokenMetadataKey, tcp_token_);
+      }
+      EditStreamPtr stream = stub_->Edit(ctx.get());
+      EditMessage hello;
+      auto body = hello.mutable_client_hello();
+      body->set_buffer_name(buffer_->filename().string());
+      body->set_resume_site_id(buffer_->site()->site_id());
+      body->set_resume_incarnation(server_incarnation_);
+      VersionVectorToProto(buffer_->CommandsSeen(), body->mutable_seen());
+      if (!stream->Write(hello) || !stream->Read(&hello)) continue;
+      if (hello.type_case() != EditMessage::kServerHello ||
+          !hello.server_hello().resumed()) {
+        Log() << "Server could not resume the edit session";
+        return false;
+      }
+      // nothing is published while this runs, so nothing can fall between
+      // the resent commands and the new stream
+      bool resumed = buffer_->WithCommandsSince(
+          VersionVectorFromProto(hello.server_hello().seen()),
+          [&](const CommandSet& missing) {
+            // anything still queued was for the old stream and is in missing
+            batcher_.Flush();
+            {
+              absl::MutexLock lock(&mu_);
+              context_ = std::move(ctx);
+              stream_ = std::move(stream);
+              // the new session starts out sending every annotation
+              WriteViewportLocked();
+            }
+            Log() << "Resending " << missing.commands_size()
+                  << " commands the server missed";
+            if (missing.commands_size() != 0) batcher_.Add(missing);
+          });
+      if (!resumed) {
+        Log() << "Server missed commands no longer in the command log";
+        return false;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void WriteViewportLocked() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+    if (!viewport_) return;
+    EditMessage msg;
+    auto body = msg.mutable_viewport();
+    body->set_first_line(viewport_->first_line.id);
+    body->set_lines(viewport_->lines);
+    if (shm_) {
+      shm_->Write(msg);
+    } else if (stream_) {
+      stream_->Write(msg);
+    }
+  }
+
+  void StopWatchdog() {
+    if (!watchdog_.joinable()) return;
+    {
+      absl::MutexLock lock(&mu_);
+      shm_->Close();
+      context_->TryCancel();
+    }
+    watchdog_.join();
+  }
+
+  const Buffer* const buffer_;
+  ProjectService::Stub* const stub_;
+  // of the server that issued this buffer's site, the only one that can
+  // resume its session
+  const uint64_t server_incarnation_;
+  // for a server reached over TCP
+  const std::string tcp_token_;
+  absl::Mutex mu_;
+  std::unique_ptr<grpc::ClientContext> context_ GUARDED_BY(mu_);
+  EditStreamPtr stream_ GUARDED_BY(mu_);
+  std::unique_ptr<ShmChannel> shm_ GUARDED_BY(mu_);
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  // last published, resent on reconnecting
+  absl::optional<Viewport> viewport_ GUARDED_BY(mu_);
+  std::thread watchdog_;
+  CommandBatcher batcher_;
 };
 
 }  // namespace
 
-std::unique_ptr<Buffer> Client::MakeBuffer(
-    const boost::filesystem::path& path) {
+std::unique_ptr<Buffer> Client::MakeBuffer(const boost::filesystem::path& path,
+                                           bool headless) {
+  LogTimer timer("open_buffer");
   std::unique_ptr<grpc::ClientContext> ctx(new grpc::ClientContext());
+  if (!tcp_token_.empty()) ctx->AddMetadata(kTcpTokenMetadataKey, tcp_token_);
   EditStreamPtr stream = project_stub_->Edit(ctx.get());
   EditMessage hello;
   hello.mutable_client_hello()->set_buffer_name(path.string());
+  // editors open at the top of the buffer
+  hello.mutable_client_hello()->mutable_viewport()->set_first_line(
+      AnnotatedString::Begin().id);
+  std::unique_ptr<ShmChannel> shm;
+  if (shm_transport_) {
+    try {
+      shm = ShmChannel::Create(FLAGS_shm_ring_bytes);
+      auto offer = hello.mutable_client_hello()->mutable_shm();
+      offer->set_pid(getpid());
+      offer->set_fd(shm->fd());
+      offer->set_key(shm->key());
+    } catch (std::exception& e) {
+      Log() << "Shared memory transport unavailable: " << e.what();
+    }
+  }
   stream->Write(hello);
   if (!stream->Read(&hello)) return nullptr;
   if (hello.type_case() != EditMessage::kServerHello) return nullptr;
+  timer.Mark("server_hello");
+  if (!hello.server_hello().shm_accepted()) shm.reset();
+  AnnotatedStringMsg state;
+  if (!state.ParseFromString(hello.server_hello().encoded_state())) {
+    return nullptr;
+  }
+  state.MergeFrom(hello.server_hello().current_state());
   auto buffer = Buffer::Builder()
                     .SetFilename(path)
-                    .SetInitialString(AnnotatedString::FromProto(
-                        hello.server_hello().current_state()))
+                    .SetInitialString(AnnotatedString::FromProto(state))
                     .SetSiteID(hello.server_hello().site_id())
+                    .SetHeadless(headless)
                     .Make();
-  buffer->MakeCollaborator<ClientCollaborator>(std::move(stream),
-                                               std::move(ctx));
+  timer.Mark("integrate_snapshot");
+  buffer->MakeCollaborator<ClientCollaborator>(
+      project_stub_.get(), std::move(stream), std::move(ctx), std::move(shm),
+      edit_options_, hello.server_hello().incarnation(), tcp_token_);
   return buffer;
 }
@@ -13,17 +13,33 @@
 // limitations under the License.
 #pragma once
 
+#include <gflags/gflags.h>
 #include <boost/filesystem/path.hpp>
 #include "buffer.h"
+#include "command_batcher.h"
 #include "proto/project_service.grpc.pb.h"
 
+// a remote ProjectServer to connect to in place of the project's own
+DECLARE_string(server);
+
 class Client {
  public:
   Client(const boost::filesystem::path& ced_bin,
          const boost::filesystem::path& project_root_hint);
 
-  std::unique_ptr<Buffer> MakeBuffer(const boost::filesystem::path& path);
+  // nullptr if the server refuses the buffer
+  std::unique_ptr<Buffer> MakeBuffer(const boost::filesystem::path& path,
+                                     bool headless = false);
 
  private:
+  // to a server reached over TCP, rather than the project's own
+  void ConnectRemote(const std::string& address);
+
   std::unique_ptr<ProjectService::Stub> project_stub_;
+  // the server accepts shared memory channels for edit sessions
+  bool shm_transport_ = false;
+  // for each buffer's edit stream
+  CommandBatcher::Options edit_options_;
+  // presented to a server reached over TCP
+  std::string tcp_token_;
 };
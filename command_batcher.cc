@@ -0,0 +1,206 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "command_batcher.h"
+#include <gflags/gflags.h>
+#include <zlib.h>
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "log.h"
+
+DEFINE_int32(edit_batch_window_us, 1000,
+             "CommandSets sent on an idle Edit stream are written at once; "
+             "those sent within this many microseconds of the last write "
+             "wait out the window and are coalesced into one message (0 "
+             "writes each on the sender's thread)");
+DEFINE_int32(edit_compress_threshold, 16384,
+             "Edit stream messages with a payload of at least this many "
+             "bytes are zlib compressed (0 disables compression)");
+
+// widest window ForRtt picks, however slow the link
+static constexpr absl::Duration kMaxRttWindow = absl::Milliseconds(25);
+
+// largest CommandSet we're willing to inflate
+static constexpr uint32_t kMaxUncompressedSize = 1 << 30;
+
+static absl::Mutex stats_mu;
+static CommandBatcher::Stats stats GUARDED_BY(stats_mu);
+
+CommandBatcher::Options CommandBatcher::Options::FromFlags() {
+  Options options;
+  options.window = absl::Microseconds(std::max(0, FLAGS_edit_batch_window_us));
+  options.compress_threshold =
+      static_cast<size_t>(std::max(0, FLAGS_edit_compress_threshold));
+  return options;
+}
+
+CommandBatcher::Options CommandBatcher::Options::ForRtt(absl::Duration rtt) {
+  Options options = FromFlags();
+  options.window = std::max(options.window, std::min(rtt / 8, kMaxRttWindow));
+  return options;
+}
+
+CommandBatcher::CommandBatcher(Options options, WriteFn write)
+    : options_(options), write_(std::move(write)) {
+  if (options_.window > absl::ZeroDuration()) {
+    writer_ = std::thread([this]() { WriterLoop(); });
+  }
+}
+
+CommandBatcher::~CommandBatcher() {
+  {
+    absl::MutexLock lock(&mu_);
+    shutdown_ = true;
+  }
+  if (writer_.joinable()) writer_.join();
+  Flush();
+}
+
+void CommandBatcher::Add(const CommandSet& commands) {
+  absl::MutexLock lock(&mu_);
+  if (broken_) return;
+  if (pending_sets_ == 0) first_pending_ = absl::Now();
+  pending_.MergeFrom(commands);
+  pending_sets_++;
+  if (!writer_.joinable()) WritePendingLocked();
+}
+
+void CommandBatcher::Flush() {
+  absl::MutexLock lock(&mu_);
+  WritePendingLocked();
+  auto idle = [this]() {
+    mu_.AssertHeld();
+    return !writing_;
+  };
+  mu_.Await(absl::Condition(&idle));
+}
+
+void CommandBatcher::WriterLoop() {
+  absl::MutexLock lock(&mu_);
+  auto has_work = [this]() {
+    mu_.AssertHeld();
+    return pending_sets_ > 0 || shutdown_;
+  };
+  for (;;) {
+    mu_.Await(absl::Condition(&has_work));
+    if (pending_sets_ == 0) return;  // shutdown_
+    // an idle stream writes now; one written to within the window lets it
+    // fill up first (shutdown cuts it short)
+    mu_.AwaitWithDeadline(absl::Condition(&shutdown_),
+                          last_write_ + options_.window);
+    WritePendingLocked();
+  }
+}
+
+EditMessage EncodeCommands(CommandSet* commands, size_t compress_threshold) {
+  EditMessage msg;
+  if (compress_threshold != 0 &&
+      commands->ByteSizeLong() >= compress_threshold) {
+    std::string raw;
+    commands->SerializeToString(&raw);
+    uLongf len = compressBound(raw.size());
+    std::string out(len, '\0');
+    if (compress2(reinterpret_cast<Bytef*>(&out[0]), &len,
+                  reinterpret_cast<const Bytef*>(raw.data()), raw.size(),
+                  Z_BEST_SPEED) == Z_OK &&
+        len < raw.size()) {
+      out.resize(len);
+      auto* compressed = msg.mutable_compressed_commands();
+      compressed->set_uncompressed_size(raw.size());
+      compressed->set_data(std::move(out));
+      return msg;
+    }
+  }
+  msg.mutable_commands()->Swap(commands);
+  return msg;
+}
+
+void CommandBatcher::WritePendingLocked() {
+  // one write at a time, in the order pending_ was filled
+  auto idle = [this]() {
+    mu_.AssertHeld();
+    return !writing_;
+  };
+  mu_.Await(absl::Condition(&idle));
+  if (pending_sets_ == 0 || broken_) return;
+
+  CommandSet commands;
+  commands.Swap(&pending_);
+  const int sets = pending_sets_;
+  const absl::Time first = first_pending_;
+  pending_sets_ = 0;
+  writing_ = true;
+  last_write_ = absl::Now();
+  mu_.Unlock();
+
+  const size_t raw_bytes = commands.ByteSizeLong();
+  EditMessage msg = EncodeCommands(&commands, options_.compress_threshold);
+  const size_t wire_bytes = msg.ByteSizeLong();
+  const bool ok = write_(msg);
+  const absl::Duration latency = absl::Now() - first;
+  {
+    absl::MutexLock lock(&stats_mu);
+    stats.command_sets += sets;
+    stats.messages++;
+    stats.raw_bytes += raw_bytes;
+    stats.wire_bytes += wire_bytes;
+    stats.total_latency += latency;
+    stats.max_latency = std::max(stats.max_latency, latency);
+  }
+
+  mu_.Lock();
+  writing_ = false;
+  if (!ok) {
+    Log() << "Edit stream write failed; dropping further commands";
+    broken_ = true;
+    pending_.Clear();
+    pending_sets_ = 0;
+  }
+}
+
+CommandBatcher::Stats CommandBatcher::GlobalStats() {
+  absl::MutexLock lock(&stats_mu);
+  return stats;
+}
+
+std::string CommandBatcher::FormatStats(const Stats& s) {
+  return absl::StrCat(
+      s.command_sets, " command sets in ", s.messages, " messages; ",
+      s.raw_bytes, " bytes as ", s.wire_bytes, " on the wire; latency avg ",
+      absl::FormatDuration(s.messages ? s.total_latency / s.messages
+                                      : absl::ZeroDuration()),
+      " max ", absl::FormatDuration(s.max_latency));
+}
+
+bool ReadCommands(const EditMessage& msg, CommandSet* commands) {
+  switch (msg.type_case()) {
+    case EditMessage::kCommands:
+      *commands = msg.commands();
+      return true;
+    case EditMessage::kCompressedCommands: {
+      const auto& compressed = msg.compressed_commands();
+      if (compressed.uncompressed_size() > kMaxUncompressedSize) return false;
+      std::string raw(compressed.uncompressed_size(), '\0');
+      uLongf len = raw.size();
+      if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &len,
+                     reinterpret_cast<const Bytef*>(compressed.data().data()),
+                     compressed.data().size()) != Z_OK ||
+          len != raw.size()) {
+        return false;
+      }
+      return commands->ParseFromString(raw);
+    }
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,99 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "proto/project_service.pb.h"
+
+// Coalesces the CommandSets sent down one side of an Edit stream. A
+// CommandSet added to an idle stream is written straight away; those added
+// while a write is in flight, or within a window of its start, go out
+// together as a single EditMessage once it's done, zlib compressed if its
+// serialized size reaches a threshold.
+class CommandBatcher {
+ public:
+  struct Options {
+    // least time between the starts of two writes; zero: write each
+    // CommandSet from Add, on the caller's thread
+    absl::Duration window;
+    // serialized size from which to compress; zero disables compression
+    size_t compress_threshold;
+
+    // from --edit_batch_window_us and --edit_compress_threshold
+    static Options FromFlags();
+    // FromFlags, with the window widened for a stream whose round trip takes
+    // rtt: peers see edits rtt/2 late regardless, so a small fraction more
+    // goes unnoticed and coalesces key repeats and cursor moves
+    static Options ForRtt(absl::Duration rtt);
+  };
+
+  // write returns false once the stream is broken; nothing more is written
+  // after that
+  typedef std::function<bool(const EditMessage&)> WriteFn;
+
+  CommandBatcher(Options options, WriteFn write);
+  // flushes anything still pending
+  ~CommandBatcher();
+
+  CommandBatcher(const CommandBatcher&) = delete;
+  CommandBatcher& operator=(const CommandBatcher&) = delete;
+
+  void Add(const CommandSet& commands) LOCKS_EXCLUDED(mu_);
+  // writes anything pending now, returning once it's written
+  void Flush() LOCKS_EXCLUDED(mu_);
+
+  // Sum over every batcher in the process, for tuning the flags above
+  struct Stats {
+    uint64_t command_sets = 0;
+    uint64_t messages = 0;
+    uint64_t raw_bytes = 0;
+    uint64_t wire_bytes = 0;
+    // time from a CommandSet being added to its message being written
+    absl::Duration total_latency;
+    absl::Duration max_latency;
+  };
+  static Stats GlobalStats();
+  static std::string FormatStats(const Stats& stats);
+
+ private:
+  void WriterLoop() LOCKS_EXCLUDED(mu_);
+  // writes pending_ and clears it, releasing mu_ for the write itself
+  void WritePendingLocked() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  const Options options_;
+  const WriteFn write_;
+
+  absl::Mutex mu_;
+  CommandSet pending_ GUARDED_BY(mu_);
+  int pending_sets_ GUARDED_BY(mu_) = 0;
+  absl::Time first_pending_ GUARDED_BY(mu_);
+  absl::Time last_write_ GUARDED_BY(mu_) = absl::InfinitePast();
+  // a write is in progress with mu_ released
+  bool writing_ GUARDED_BY(mu_) = false;
+  bool broken_ GUARDED_BY(mu_) = false;
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  std::thread writer_;
+};
+
+// The message carrying commands (which it consumes), zlib compressed if
+// their serialized size reaches compress_threshold (zero: never)
+EditMessage EncodeCommands(CommandSet* commands, size_t compress_threshold);
+
+// Extracts the commands of a commands or compressed_commands message;
+// false if msg carries neither or doesn't decompress
+bool ReadCommands(const EditMessage& msg, CommandSet* commands);
@@ -0,0 +1,138 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "command_batcher.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+class Recorder {
+ public:
+  CommandBatcher::WriteFn Write() {
+    return [this](const EditMessage& msg) {
+      absl::MutexLock lock(&mu_);
+      messages_.push_back(msg);
+      return true;
+    };
+  }
+
+  std::vector<EditMessage> messages() {
+    absl::MutexLock lock(&mu_);
+    return messages_;
+  }
+
+ private:
+  absl::Mutex mu_;
+  std::vector<EditMessage> messages_;
+};
+
+CommandSet Inserts(int n, const std::string& text) {
+  CommandSet commands;
+  for (int i = 0; i < n; i++) {
+    auto* cmd = commands.add_commands();
+    cmd->set_id(i + 1);
+    cmd->mutable_insert()->set_characters(text);
+  }
+  return commands;
+}
+
+// waits for the writer thread to have written n messages
+std::vector<EditMessage> WaitForMessages(Recorder* recorder, size_t n) {
+  const absl::Time deadline = absl::Now() + absl::Seconds(10);
+  std::vector<EditMessage> messages = recorder->messages();
+  while (messages.size() < n && absl::Now() < deadline) {
+    absl::SleepFor(absl::Milliseconds(1));
+    messages = recorder->messages();
+  }
+  return messages;
+}
+
+CommandBatcher::Options MakeOptions(absl::Duration window, size_t threshold) {
+  CommandBatcher::Options options;
+  options.window = window;
+  options.compress_threshold = threshold;
+  return options;
+}
+
+}  // namespace
+
+TEST(CommandBatcherTest, ZeroWindowWritesImmediately) {
+  Recorder recorder;
+  CommandBatcher batcher(MakeOptions(absl::ZeroDuration(), 0),
+                         recorder.Write());
+  batcher.Add(Inserts(1, "a"));
+  ASSERT_EQ(1, recorder.messages().size());
+  batcher.Add(Inserts(2, "b"));
+  auto messages = recorder.messages();
+  ASSERT_EQ(2, messages.size());
+  EXPECT_EQ(EditMessage::kCommands, messages[1].type_case());
+  EXPECT_EQ(2, messages[1].commands().commands_size());
+}
+
+TEST(CommandBatcherTest, CoalescesWithinWindow) {
+  Recorder recorder;
+  {
+    CommandBatcher batcher(MakeOptions(absl::Hours(1), 0), recorder.Write());
+    // the stream is idle: written without waiting for the window
+    batcher.Add(Inserts(1, "a"));
+    ASSERT_EQ(1, WaitForMessages(&recorder, 1).size());
+    batcher.Add(Inserts(2, "b"));
+    batcher.Add(Inserts(3, "c"));
+    EXPECT_EQ(1, recorder.messages().size());
+    batcher.Flush();
+  }
+  auto messages = recorder.messages();
+  ASSERT_EQ(2, messages.size());
+  CommandSet commands;
+  ASSERT_TRUE(ReadCommands(messages[1], &commands));
+  ASSERT_EQ(5, commands.commands_size());
+  EXPECT_EQ("b", commands.commands(0).insert().characters());
+  EXPECT_EQ("c", commands.commands(4).insert().characters());
+}
+
+TEST(CommandBatcherTest, CompressesLargeMessages) {
+  Recorder recorder;
+  const CommandSet big = Inserts(100, std::string(100, 'x'));
+  CommandBatcher batcher(MakeOptions(absl::ZeroDuration(), 1024),
+                         recorder.Write());
+  batcher.Add(Inserts(1, "small"));
+  batcher.Add(big);
+  auto messages = recorder.messages();
+  ASSERT_EQ(2, messages.size());
+  EXPECT_EQ(EditMessage::kCommands, messages[0].type_case());
+  ASSERT_EQ(EditMessage::kCompressedCommands, messages[1].type_case());
+  EXPECT_LT(messages[1].ByteSizeLong(), big.ByteSizeLong());
+  CommandSet commands;
+  ASSERT_TRUE(ReadCommands(messages[1], &commands));
+  EXPECT_EQ(big.SerializeAsString(), commands.SerializeAsString());
+}
+
+TEST(CommandBatcherTest, RejectsOtherMessages) {
+  EditMessage msg;
+  msg.mutable_client_hello()->set_buffer_name("foo");
+  CommandSet commands;
+  EXPECT_FALSE(ReadCommands(msg, &commands));
+  msg.mutable_compressed_commands()->set_uncompressed_size(10);
+  msg.mutable_compressed_commands()->set_data("garbage");
+  EXPECT_FALSE(ReadCommands(msg, &commands));
+}
+
+TEST(CommandBatcherTest, WindowFollowsRtt) {
+  const absl::Duration local = CommandBatcher::Options::FromFlags().window;
+  EXPECT_EQ(local,
+            CommandBatcher::Options::ForRtt(absl::ZeroDuration()).window);
+  EXPECT_EQ(std::max(local, absl::Microseconds(12500)),
+            CommandBatcher::Options::ForRtt(absl::Milliseconds(100)).window);
+  EXPECT_EQ(std::max(local, absl::Milliseconds(25)),
+            CommandBatcher::Options::ForRtt(absl::Seconds(10)).window);
+}
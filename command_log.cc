@@ -0,0 +1,112 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "command_log.h"
+#include <gflags/gflags.h>
+#include "annotated_string.h"
+
+DEFINE_int32(command_log_size, 65536,
+             "Commands each buffer remembers for resuming dropped Edit "
+             "sessions without resending the whole buffer");
+
+void VersionVectorToProto(const VersionVector& vv, VersionVectorMsg* msg) {
+  auto* by_site = msg->mutable_commands_by_site();
+  for (const auto& site : vv) {
+    (*by_site)[site.first] = site.second;
+  }
+}
+
+VersionVector VersionVectorFromProto(const VersionVectorMsg& msg) {
+  VersionVector vv;
+  for (const auto& site : msg.commands_by_site()) {
+    if (site.first > UINT16_MAX) continue;
+    vv[site.first] = site.second;
+  }
+  return vv;
+}
+
+CommandLog::CommandLog() : CommandLog(std::max(0, FLAGS_command_log_size)) {}
+
+CommandLog::CommandLog(size_t max_commands) : max_commands_(max_commands) {}
+
+bool CommandLog::IsDeletion(const Command& command) {
+  switch (command.command_case()) {
+    case Command::kDelete:
+    case Command::kDelDecl:
+    case Command::kDelMark:
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::unordered_set<uint64_t>* CommandLog::IdsFor(const Command& command) {
+  return IsDeletion(command) ? &deleted_ids_ : &ids_;
+}
+
+void CommandLog::Append(const CommandSet& commands) {
+  for (const auto& cmd : commands.commands()) {
+    if (!IdsFor(cmd)->insert(cmd.id()).second) continue;
+    const uint64_t index = IsDeletion(cmd) ? 0 : seen_[ID(cmd.id()).site]++;
+    entries_.push_back(Entry{next_seq_++, index, cmd});
+  }
+  while (entries_.size() > max_commands_) {
+    const Entry& front = entries_.front();
+    if (IsDeletion(front.command)) {
+      deletions_dropped_ = front.seq + 1;
+    } else {
+      dropped_[ID(front.command.id()).site] = front.index + 1;
+    }
+    IdsFor(front.command)->erase(front.command.id());
+    entries_.pop_front();
+  }
+}
+
+bool CommandLog::Since(const VersionVector& have,
+                       const std::function<bool(uint16_t site)>& relayed,
+                       CommandSet* out) const {
+  auto have_from = [&have](uint16_t site) -> uint64_t {
+    auto it = have.find(site);
+    return it == have.end() ? 0 : it->second;
+  };
+  for (const auto& site : dropped_) {
+    if (have_from(site.first) < site.second) return false;
+  }
+  // how far through the log the peer is known to have heard it
+  uint64_t heard = 0;
+  for (const auto& entry : entries_) {
+    const uint16_t site = ID(entry.command.id()).site;
+    if (!IsDeletion(entry.command) && relayed(site) &&
+        entry.index < have_from(site)) {
+      heard = entry.seq + 1;
+    }
+  }
+  if (heard < deletions_dropped_) return false;
+  for (const auto& entry : entries_) {
+    if (IsDeletion(entry.command)
+            ? entry.seq >= heard
+            : entry.index >= have_from(ID(entry.command.id()).site)) {
+      *out->add_commands() = entry.command;
+    }
+  }
+  return true;
+}
+
+bool CommandLog::SawAllBut(uint16_t site, const VersionVector& have) const {
+  for (const auto& other : have) {
+    if (other.first == site) continue;
+    auto it = seen_.find(other.first);
+    if (other.second > (it == seen_.end() ? 0 : it->second)) return false;
+  }
+  return true;
+}
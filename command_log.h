@@ -0,0 +1,87 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <unordered_set>
+#include "proto/annotation.pb.h"
+
+// Number of creations (inserts, decls and marks) seen from each site, by the
+// site of their ids. Each site's creations reach every peer in the order it
+// made them; deletions, which carry the id of what they delete, don't, so
+// aren't counted.
+typedef std::map<uint16_t, uint64_t> VersionVector;
+
+void VersionVectorToProto(const VersionVector& vv, VersionVectorMsg* msg);
+VersionVector VersionVectorFromProto(const VersionVectorMsg& msg);
+
+// The most recent commands integrated into a buffer, in integration order,
+// so that a peer that already holds most of the buffer can be sent only
+// what it lacks. Commands are logged once per id (and once more for the
+// deletion of that id), however many times they are echoed back.
+class CommandLog {
+ public:
+  // holds --command_log_size commands
+  CommandLog();
+  explicit CommandLog(size_t max_commands);
+
+  void Append(const CommandSet& commands);
+
+  const VersionVector& seen() const { return seen_; }
+  // commands currently held
+  size_t size() const { return entries_.size(); }
+
+  // Appends to out the logged commands a peer that has seen `have` is
+  // missing, in the order they were logged. Returns false if some of them
+  // have already been dropped from the log.
+  // Deletions aren't counted in have: the peer is taken to have heard this
+  // log in order up to the last creation it counts from a relayed site (one
+  // whose commands reach it only through this log), and every deletion
+  // logged since is sent again; they're idempotent.
+  bool Since(const VersionVector& have,
+             const std::function<bool(uint16_t site)>& relayed,
+             CommandSet* out) const;
+
+  // Whether every command counted in have, besides those from site (which
+  // may not all have arrived), was logged here. A peer that only hears of
+  // other sites' commands through this log can't be ahead of it for them,
+  // unless its history is some other log's.
+  bool SawAllBut(uint16_t site, const VersionVector& have) const;
+
+ private:
+  static bool IsDeletion(const Command& command);
+  std::unordered_set<uint64_t>* IdsFor(const Command& command);
+
+  struct Entry {
+    // this is the seq'th command logged
+    uint64_t seq;
+    // for creations: this is the index'th seen from the site
+    uint64_t index;
+    Command command;
+  };
+
+  const size_t max_commands_;
+  std::deque<Entry> entries_;
+  std::unordered_set<uint64_t> ids_;
+  // deletions carry the id of what they delete, so are tracked apart
+  std::unordered_set<uint64_t> deleted_ids_;
+  VersionVector seen_;
+  // per site, how many of its creations have been dropped from the log
+  VersionVector dropped_;
+  uint64_t next_seq_ = 0;
+  // seq past the last deletion dropped from the log
+  uint64_t deletions_dropped_ = 0;
+};
@@ -0,0 +1,147 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "command_log.h"
+#include "annotated_string.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+Command Cmd(uint16_t site, uint64_t clock) {
+  Command cmd;
+  cmd.set_id(ID(site, clock).id);
+  cmd.mutable_insert()->set_characters("x");
+  return cmd;
+}
+
+Command Del(uint16_t site, uint64_t clock) {
+  Command cmd;
+  cmd.set_id(ID(site, clock).id);
+  cmd.mutable_delete_();
+  return cmd;
+}
+
+bool AnySite(uint16_t site) { return true; }
+
+CommandSet Cmds(std::initializer_list<Command> cmds) {
+  CommandSet set;
+  for (const auto& c : cmds) *set.add_commands() = c;
+  return set;
+}
+
+std::vector<uint64_t> Ids(const CommandSet& set) {
+  std::vector<uint64_t> ids;
+  for (const auto& c : set.commands()) ids.push_back(c.id());
+  return ids;
+}
+
+}  // namespace
+
+TEST(CommandLogTest, CountsPerSiteIgnoringEchoes) {
+  CommandLog log(100);
+  log.Append(Cmds({Cmd(1, 5), Cmd(2, 1)}));
+  log.Append(Cmds({Cmd(1, 3), Cmd(1, 5)}));
+  EXPECT_EQ((VersionVector{{1, 2}, {2, 1}}), log.seen());
+}
+
+TEST(CommandLogTest, SinceSendsOnlyMissingInLogOrder) {
+  CommandLog log(100);
+  log.Append(Cmds({Cmd(1, 1), Cmd(2, 1), Cmd(1, 2), Cmd(3, 1), Cmd(2, 2)}));
+  CommandSet missing;
+  ASSERT_TRUE(log.Since(VersionVector{{1, 1}, {2, 2}}, AnySite, &missing));
+  EXPECT_EQ((std::vector<uint64_t>{ID(1, 2).id, ID(3, 1).id}), Ids(missing));
+}
+
+TEST(CommandLogTest, SinceFailsOnceNeededCommandsAreDropped) {
+  CommandLog log(2);
+  log.Append(Cmds({Cmd(1, 1), Cmd(2, 1), Cmd(1, 2)}));
+  CommandSet missing;
+  EXPECT_FALSE(log.Since(VersionVector{{2, 1}}, AnySite, &missing));
+  ASSERT_TRUE(log.Since(VersionVector{{1, 1}}, AnySite, &missing));
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 1).id, ID(1, 2).id}), Ids(missing));
+}
+
+TEST(CommandLogTest, DeletionsAreNotCounted) {
+  CommandLog log(100);
+  log.Append(Cmds({Cmd(1, 1), Del(1, 1), Del(2, 7)}));
+  EXPECT_EQ((VersionVector{{1, 1}}), log.seen());
+}
+
+TEST(CommandLogTest, SinceResendsDeletionsOfOtherSitesIds) {
+  // the peer deleted (2,2) and dropped before hearing site 3 delete (2,1);
+  // neither deletion is counted under site 2, so both go again
+  CommandLog log(100);
+  log.Append(Cmds({Cmd(2, 1), Cmd(2, 2), Del(2, 1), Del(2, 2)}));
+  CommandSet missing;
+  ASSERT_TRUE(log.Since(VersionVector{{2, 2}}, AnySite, &missing));
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 1).id, ID(2, 2).id}), Ids(missing));
+}
+
+TEST(CommandLogTest, SinceResendsDeletionsFromWhatThePeerHeardHere) {
+  CommandLog log(100);
+  log.Append(Cmds({Cmd(1, 1), Del(1, 1), Cmd(2, 1), Del(2, 1), Cmd(1, 2)}));
+  // the peer's own site 1 says nothing of how far it heard this log
+  auto relayed = [](uint16_t site) { return site != 1; };
+  CommandSet missing;
+  ASSERT_TRUE(log.Since(VersionVector{{1, 2}, {2, 1}}, relayed, &missing));
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 1).id}), Ids(missing));
+  missing.Clear();
+  ASSERT_TRUE(log.Since(VersionVector{{1, 2}}, relayed, &missing));
+  EXPECT_EQ((std::vector<uint64_t>{ID(1, 1).id, ID(2, 1).id, ID(2, 1).id}),
+            Ids(missing));
+}
+
+TEST(CommandLogTest, SinceFailsOnceNeededDeletionsAreDropped) {
+  CommandLog log(2);
+  log.Append(Cmds({Cmd(1, 1), Del(1, 1), Cmd(2, 1), Cmd(2, 2)}));
+  CommandSet missing;
+  // the peer may not have heard the dropped deletion
+  EXPECT_FALSE(log.Since(VersionVector{{1, 1}}, AnySite, &missing));
+  ASSERT_TRUE(log.Since(VersionVector{{1, 1}, {2, 1}}, AnySite, &missing));
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 2).id}), Ids(missing));
+}
+
+TEST(CommandLogTest, SawAllButTheResumingSite) {
+  // as after a server restart: the peer is ahead of an empty log
+  CommandLog log(100);
+  EXPECT_FALSE(log.SawAllBut(1, VersionVector{{2, 3}}));
+  log.Append(Cmds({Cmd(1, 1), Cmd(2, 1)}));
+  EXPECT_FALSE(log.SawAllBut(1, VersionVector{{1, 1}, {2, 2}}));
+  EXPECT_TRUE(log.SawAllBut(1, VersionVector{{1, 1}, {2, 1}}));
+  // its own commands may not all have arrived
+  EXPECT_TRUE(log.SawAllBut(1, VersionVector{{1, 5}, {2, 1}}));
+}
+
+TEST(CommandLogTest, VersionVectorProtoRoundTrip) {
+  VersionVector vv{{1, 10}, {7, 3}};
+  VersionVectorMsg msg;
+  VersionVectorToProto(vv, &msg);
+  EXPECT_EQ(vv, VersionVectorFromProto(msg));
+}
+
+TEST(CommandLogTest, LogsDeletionsOfLoggedIds) {
+  CommandLog log(100);
+  Command mark;
+  mark.set_id(ID(1, 1).id);
+  mark.mutable_mark();
+  Command del_mark;
+  del_mark.set_id(ID(1, 1).id);
+  del_mark.mutable_del_mark();
+  log.Append(Cmds({mark}));
+  log.Append(Cmds({del_mark, mark}));
+  CommandSet missing;
+  ASSERT_TRUE(log.Since(VersionVector{}, AnySite, &missing));
+  ASSERT_EQ(2, missing.commands_size());
+  EXPECT_EQ(Command::kMark, missing.commands(0).command_case());
+  EXPECT_EQ(Command::kDelMark, missing.commands(1).command_case());
+}
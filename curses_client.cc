@@ -12,29 +12,46 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <signal.h>
+#include <gflags/gflags.h>
+#include <unistd.h>
 #include <atomic>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
 #include "application.h"
 #include "buffer.h"
 #include "client.h"
+#include "editor.h"
 #include "render.h"
 #include "terminal_collaborator.h"
 #include "terminal_color.h"
+#include "ui_event_loop.h"
+#include "worker_pool.h"
 
 // include last: curses.h obnoxiously #define's OK
 #include <curses.h>
 
-static std::atomic<bool> invalidated;
+DEFINE_int32(frame_interval_ms, 10,
+             "Minimum time between rendered frames: redraw requests arriving "
+             "faster than this are coalesced into one frame");
+DEFINE_int32(render_threads, 0,
+             "Threads used to draw panes each frame (0: one per core)");
+
+static std::atomic<UIEventLoop*> ui_event_loop{nullptr};
 void InvalidateTerminal() {
-  Log() << "InvalidatedTerminal";
-  invalidated = true;
-  kill(getpid(), SIGWINCH);
+  UIEventLoop* loop = ui_event_loop.load(std::memory_order_acquire);
+  if (loop != nullptr) loop->Signal();
 }
 
 class CursesClient : public Application {
  public:
   CursesClient(int argc, char** argv)
-      : client_(argv[0], FileFromCmdLine(argc, argv)) {
+      : path_(FileFromCmdLine(argc, argv)),
+        cold_start_(new LogTimer("cold_start")) {
     Log::SetCerrLog(false);
     auto theme = std::unique_ptr<Theme>(new Theme(Theme::DEFAULT));
     initscr();
@@ -43,71 +60,102 @@ class CursesClient : public Application {
     set_escdelay(25);
     start_color();
     color_.reset(new TerminalColor{std::move(theme)});
-    bkgd(color_->Theme({}, 0));
+    bkgd(color_->Resolve(color_->Theme({}, 0)));
     keypad(stdscr, true);
-    buffer_ = client_.MakeBuffer(FileFromCmdLine(argc, argv));
+    nodelay(stdscr, true);
+    ui_event_loop.store(&event_loop_, std::memory_order_release);
+    // the server may take a while to come up: connect in the background,
+    // showing the file from disk (read only) meanwhile
+    connect_thread_ = std::thread([this, ced_bin = std::string(argv[0])]() {
+      Connect(ced_bin);
+    });
+    preview_ = MakePreview(path_, &preview_site_);
+    cold_start_->Mark("preview_loaded");
   }
 
   ~CursesClient() {
+    connect_thread_.join();
+    {
+      absl::MutexLock lock(&connect_mu_);
+      buffer_.reset();
+    }
+    ui_event_loop.store(nullptr, std::memory_order_release);
     endwin();
     Log::SetCerrLog(true);
   }
 
   int Run() {
-    bool was_invalidated = false;
-    absl::Time last_key_press = absl::Now();
-    std::unique_ptr<LogTimer> log_timer(new LogTimer("main_loop"));
+    const absl::Duration frame_interval =
+        absl::Milliseconds(FLAGS_frame_interval_ms);
+    bool dirty = true;
+    bool animating = false;
+    absl::Time last_frame = absl::InfinitePast();
+    // earliest input not yet reflected on screen
+    absl::optional<absl::Time> first_unrendered_input;
     for (;;) {
-      bool animating = false;
-      if (was_invalidated) {
-        animating = true;
-        log_timer->Mark("animating_due_to_invalidated");
-      } else {
-        erase();
-        animating = Render(log_timer.get(), last_key_press);
-        log_timer->Mark("rendered");
+      {
+        absl::MutexLock lock(&connect_mu_);
+        if (connect_error_) std::rethrow_exception(connect_error_);
       }
-      timeout(animating ? 10 : -1);
-      if (!was_invalidated) log_timer.reset();
-      int c = invalidated ? -1 : getch();
-      if (!was_invalidated) log_timer.reset(new LogTimer("main_loop"));
-      Log() << "GOTKEY: " << c;
-      if (!was_invalidated) last_key_press = absl::Now();
-
-      log_timer->Mark("XXX");
-
-      was_invalidated = false;
-      switch (c) {
-        case ERR:
-        case KEY_RESIZE:
-          was_invalidated = true;
-          break;
-        case 27:
-          return 0;
-        default:
-          TerminalCollaborator::All_ProcessKey(&app_env_, c);
+      absl::Time now = absl::Now();
+      if (dirty && now - last_frame >= frame_interval) {
+        LogTimer log_timer("frame");
+        animating = Render(&log_timer);
+        last_frame = absl::Now();
+        if (first_unrendered_input) {
+          input_latency_ = last_frame - *first_unrendered_input;
+          Log() << "input_to_frame: " << input_latency_;
+          first_unrendered_input.reset();
+        }
+        dirty = false;
+        now = last_frame;
       }
 
-      log_timer->Mark("input_processed");
-
-      bool expected = true;
-      if (!invalidated.compare_exchange_strong(expected, false,
-                                               std::memory_order_relaxed,
-                                               std::memory_order_relaxed)) {
-        was_invalidated = false;
+      absl::Duration wait = absl::InfiniteDuration();
+      if (dirty) {
+        wait = last_frame + frame_interval - now;
+      } else if (animating) {
+        wait = frame_interval;
       }
+      UIEventLoop::Result woke = event_loop_.Wait(wait);
+      if (woke.signalled || (animating && !woke.input)) dirty = true;
+      if (!woke.input) continue;
 
-      if (was_invalidated) {
-        log_timer->Mark("signalled");
-      } else {
-        log_timer->Mark("next_loop");
+      for (int c; (c = getch()) != ERR;) {
+        Log() << "GOTKEY: " << c;
+        if (!first_unrendered_input) first_unrendered_input = absl::Now();
+        dirty = true;
+        switch (c) {
+          case KEY_RESIZE:
+            break;
+          case 27:
+            return 0;
+          default:
+            if (preview_) {
+              // the preview is read only: keys wait for the live buffer
+              pending_keys_.push_back(c);
+            } else {
+              TerminalCollaborator::All_ProcessKey(&app_env_, c);
+            }
+        }
       }
     }
   }
 
  private:
-  bool Render(LogTimer* log_timer, absl::Time last_key_press) {
-    TerminalRenderer renderer;
+  // started once, for every frame: the render thread draws too, so it has
+  // one thread fewer than --render_threads
+  static std::unique_ptr<WorkerPool> NewDrawPool() {
+    int threads = FLAGS_render_threads > 0
+                      ? FLAGS_render_threads
+                      : std::thread::hardware_concurrency();
+    if (threads <= 1) return nullptr;
+    return std::unique_ptr<WorkerPool>(new WorkerPool(threads - 1));
+  }
+
+  bool Render(LogTimer* log_timer) {
+    TerminalRenderer& renderer = renderer_;
+    renderer.BeginFrame();
     int fb_rows, fb_cols;
     getmaxyx(stdscr, fb_rows, fb_cols);
     auto top = renderer.AddContainer(LAY_COLUMN).FixSize(fb_cols, fb_rows);
@@ -118,30 +166,127 @@ class CursesClient : public Application {
         top.AddContainer(LAY_BOTTOM | LAY_HFILL, LAY_COLUMN),
         top.AddContainer(LAY_HFILL, LAY_ROW).FixSize(0, 1),
     };
-    TerminalCollaborator::All_Render(containers);
+    if (TerminalCollaborator::All_Render(containers)) {
+      if (preview_) DropPreview();
+    } else if (preview_) {
+      containers.main
+          .AddItem(LAY_LEFT | LAY_VFILL,
+                   preview_->PrepareRender<TerminalRenderContext>(true))
+          .FixSize(80, 0);
+    }
     log_timer->Mark("collected_layout");
-    renderer.Layout();
-    log_timer->Mark("layout");
-    TerminalRenderContext ctx{color_.get(), nullptr, -1, -1, false};
-    renderer.Draw(&ctx);
+    log_timer->Mark(renderer.Layout() ? "layout" : "layout_unchanged");
+    frame_.Reset(fb_rows, fb_cols,
+                 ' ' | color_->Resolve(
+                           color_->Theme(Theme::kDefaultStyle, 0)));
+
+    // each item draws into its own offscreen pane on a worker; the panes
+    // are composited here, where attributes are resolved against curses
+    int crow = -1;
+    int ccol = -1;
+    bool animating = false;
+    renderer.DrawParallel(
+        draw_pool_.get(),
+        [this](size_t index, const TerminalRenderer::Rect& rect) {
+          if (panes_.size() <= index) panes_.resize(index + 1);
+          TerminalPane* pane = &panes_[index];
+          pane->Reset(rect.height(), rect.width(), TerminalCell{0, 0});
+          return TerminalRenderContext{color_.get(), pane, nullptr,
+                                       -1, -1, false};
+        },
+        [&](const TerminalRenderer::Rect& rect, TerminalRenderContext* ctx) {
+          frame_.Composite(*ctx->pane, rect.row(), rect.column(),
+                           [this](const TerminalCell& cell, chtype* out) {
+                             if (cell.chr == 0) return;
+                             *out = cell.chr | color_->Resolve(cell.attr);
+                           });
+          if (ctx->crow != -1) {
+            crow = ctx->crow;
+            ccol = ctx->ccol;
+          }
+          animating |= ctx->animating;
+        });
     log_timer->Mark("draw");
 
-    auto frame_time = absl::Now() - last_key_press;
-    std::ostringstream out;
-    out << frame_time;
-    std::string ftstr = out.str();
-    chtype attr = frame_time > absl::Milliseconds(10)
-                      ? color_->Theme({"invalid"}, 0)
-                      : color_->Theme({}, 0);
+    // latency from the first key of the previous burst to its frame
+    std::string ftstr = absl::FormatDuration(input_latency_);
+    chtype attr = color_->Resolve(input_latency_ > absl::Milliseconds(10)
+                                      ? color_->Theme({"invalid"}, 0)
+                                      : color_->Theme({}, 0));
     for (size_t i = 0; i < ftstr.length(); i++) {
-      mvaddch(fb_rows - 1, fb_cols - ftstr.length() + i, ftstr[i] | attr);
+      frame_.Set(fb_rows - 1, fb_cols - ftstr.length() + i, ftstr[i] | attr);
     }
 
-    if (ctx.crow != -1) {
-      move(ctx.crow, ctx.ccol);
+    // only hand curses what changed since the last frame
+    int changed_cells = 0;
+    frame_.ForEachChangedSpan(
+        last_frame_, [&](int row, int col, const chtype* cells, int n) {
+          mvaddchnstr(row, col, cells, n);
+          changed_cells += n;
+        });
+    std::swap(frame_, last_frame_);
+    log_timer->Mark("emit");
+    Log() << "emitted " << changed_cells << " changed cells";
+
+    if (crow != -1) {
+      move(crow, ccol);
     }
+    refresh();
+    log_timer->Mark("refresh");
 
-    return ctx.animating;
+    if (cold_start_) {
+      if (preview_) {
+        if (!preview_drawn_) cold_start_->Mark("preview_frame");
+        preview_drawn_ = true;
+      } else {
+        cold_start_->Mark("live_frame");
+        // logs the breakdown
+        cold_start_.reset();
+      }
+    }
+
+    return animating;
+  }
+
+  void Connect(const std::string& ced_bin) {
+    try {
+      std::unique_ptr<Client> client(new Client(ced_bin, path_));
+      std::unique_ptr<Buffer> buffer = client->MakeBuffer(path_);
+      if (!buffer) {
+        throw std::runtime_error(
+            absl::StrCat("Server failed to open ", path_.string()));
+      }
+      absl::MutexLock lock(&connect_mu_);
+      client_ = std::move(client);
+      buffer_ = std::move(buffer);
+    } catch (...) {
+      absl::MutexLock lock(&connect_mu_);
+      connect_error_ = std::current_exception();
+    }
+    InvalidateTerminal();
+  }
+
+  static std::shared_ptr<Editor> MakePreview(
+      const boost::filesystem::path& path, Site* site) {
+    std::ifstream in(path.string(), std::ios::binary);
+    std::string contents{std::istreambuf_iterator<char>(in),
+                         std::istreambuf_iterator<char>()};
+    EditNotification state;
+    state.content.Insert(site, contents, AnnotatedString::Begin());
+    std::shared_ptr<Editor> editor = Editor::Make(site);
+    LogTimer timer("preview");
+    editor->UpdateState(&timer, state);
+    return editor;
+  }
+
+  // the live buffer is on screen: hand it the keys typed meanwhile
+  void DropPreview() {
+    preview_.reset();
+    for (int c : pending_keys_) {
+      TerminalCollaborator::All_ProcessKey(&app_env_, c);
+    }
+    pending_keys_.clear();
+    InvalidateTerminal();
   }
 
   static boost::filesystem::path FileFromCmdLine(int argc, char** argv) {
@@ -151,10 +296,31 @@ class CursesClient : public Application {
     return argv[1];
   }
 
-  Client client_;
-  std::unique_ptr<Buffer> buffer_;
+  const boost::filesystem::path path_;
+  // startup timings, logged once the live buffer is first on screen
+  std::unique_ptr<LogTimer> cold_start_;
+  // declared before buffer_: collaborators signal it until buffer_ is gone
+  UIEventLoop event_loop_{STDIN_FILENO};
+  absl::Mutex connect_mu_;
+  std::unique_ptr<Client> client_ GUARDED_BY(connect_mu_);
+  std::unique_ptr<Buffer> buffer_ GUARDED_BY(connect_mu_);
+  std::exception_ptr connect_error_ GUARDED_BY(connect_mu_);
+  std::thread connect_thread_;
+  // shows the file from disk until the live buffer has been drawn
+  Site preview_site_;
+  std::shared_ptr<Editor> preview_;
+  bool preview_drawn_ = false;
+  std::vector<int> pending_keys_;
   std::unique_ptr<TerminalColor> color_;
   AppEnv app_env_;
+  TerminalRenderer renderer_;
+  // offscreen panes, indexed by draw order; kept to reuse their storage
+  // helps the render thread draw panes; null to draw them all on it
+  std::unique_ptr<WorkerPool> draw_pool_ = NewDrawPool();
+  std::vector<TerminalPane> panes_;
+  TerminalFrame frame_;
+  TerminalFrame last_frame_;
+  absl::Duration input_latency_;
 };
 
 REGISTER_APPLICATION(CursesClient);
@@ -24,9 +24,25 @@ EditResponse Editor::MakeResponse() {
   unacknowledged_commands_.MergeFrom(unpublished_commands_);
   unpublished_commands_.Clear();
   assert(unpublished_commands_.commands().empty());
+  Viewport viewport = CurrentViewport();
+  if (viewport != viewport_reported_) {
+    r.viewport = viewport;
+    viewport_reported_ = viewport;
+  }
   return r;
 }
 
+// the lines PrepareRender draws: as many either side of the cursor's line
+// as the window is high
+Viewport Editor::CurrentViewport() const {
+  int rows = view_rows_.load(std::memory_order_relaxed);
+  AnnotatedString::LineIterator line(state_.content, cursor_);
+  for (int i = 0; i < rows; i++) {
+    line.MovePrev();
+  }
+  return Viewport{line.id(), 2 * rows + 1};
+}
+
 void Editor::PublishCursor() {
   AnnotationEditor::ScopedEdit edit(&ed_, &unpublished_commands_);
   Attribute curs;
@@ -43,68 +59,106 @@ void Editor::PublishCursor() {
       ed_.Mark(selection_anchor_, cursor_, sel);
     }
   }
+  // link lines in side buffers through presence rather than marks: no
+  // commands to integrate, and the line index avoids walking their content
+  std::map<ID, std::vector<ID>> linked;
   AnnotatedString::Iterator(state_.content, cursor_)
-      .ForEachAttrValue([this, curs](const Attribute& attr) {
+      .ForEachAttrValue([this, &linked](const Attribute& attr) {
         if (attr.data_case() != Attribute::kBufferRef) return;
         auto it = buffers_.find(attr.buffer_ref().buffer());
         if (it == buffers_.end()) return;
-        CommandSet cmds;
-        auto cur_content = it->second.buffer->ContentSnapshot();
-        {
-          AnnotationEditor::ScopedEdit edit_child(&it->second.ed, &cmds);
-          for (auto line : attr.buffer_ref().lines()) {
-            Log() << "Mark child frame line " << line;
-            AnnotatedString::LineIterator li =
-                AnnotatedString::LineIterator::FromLineNumber(cur_content,
-                                                              line);
-            it->second.ed.Mark(li.id(), li.Next().id(), curs);
-          }
-        }
-        Log() << "Push changes " << cmds.DebugString();
-        it->second.buffer->PushChanges(&cmds, true);
-        Log() << "Result: "
-              << it->second.buffer->ContentSnapshot().AsProto().DebugString();
+        std::vector<ID> lines =
+            it->second.lines->LineStarts(attr.buffer_ref().lines());
+        auto& all = linked[it->first];
+        all.insert(all.end(), lines.begin(), lines.end());
       });
+  for (auto& b : buffers_) {
+    auto it = linked.find(b.first);
+    std::vector<ID> lines;
+    if (it != linked.end()) lines.swap(it->second);
+    if (lines == b.second.linked_lines) continue;
+    b.second.linked_lines = lines;
+    b.second.buffer->PublishPresence(Presence{std::move(lines)});
+  }
   cursor_reported_ = cursor_;
 }
 
 void Editor::UpdateState(LogTimer* tmr, const EditNotification& state) {
-  state_ = state;
+  StateUpdate update = BeginUpdate(state);
+  update.Prepare(tmr);
+  FinishUpdate(std::move(update));
+}
+
+Editor::StateUpdate Editor::BeginUpdate(const EditNotification& state) {
+  StateUpdate update;
+  update.site_ = site_;
+  update.state_ = state;
+  update.sent_ = unacknowledged_commands_;
+  for (const auto& b : buffers_) update.known_buffers_.insert(b.first);
+  return update;
+}
+
+void Editor::StateUpdate::Prepare(LogTimer* tmr) {
   auto s2 = state_.content;
-  CommandSet unacked;
-  for (const auto& cmd : unacknowledged_commands_.commands()) {
+  for (const auto& cmd : sent_.commands()) {
     auto s3 = s2;
     s2.Integrate(cmd);
     if (!s3.SameTotalIdentity(s2)) {
-      *unacked.add_commands() = cmd;
+      *unacked_.add_commands() = cmd;
       tmr->Mark("unacked");
     } else {
       tmr->Mark("acked");
     }
   }
+
+  state_.content.ForEachAttribute(
+      Attribute::kBuffer, [this](ID id, const Attribute& attr) {
+        if (known_buffers_.count(id) != 0) return;
+        AnnotatedString s;
+        s.Insert(site_, attr.buffer().contents(), AnnotatedString::Begin());
+        auto buffer = Buffer::Builder()
+                          .SetFilename(attr.buffer().name())
+                          .SetInitialString(s)
+                          .SetSynthetic()
+                          .Make();
+        std::unique_ptr<LineIndex> lines(new LineIndex(buffer.get()));
+        new_buffers_.emplace(
+            id, BufferInfo{std::move(buffer), std::move(lines), {}});
+      });
+}
+
+void Editor::FinishUpdate(StateUpdate update) {
+  state_ = std::move(update.state_);
+  cursor_ = AnnotatedString::Iterator(state_.content, cursor_).id();
+  // commands sent since BeginUpdate follow the ones it looked at, and can't
+  // have been acknowledged by state_
+  CommandSet unacked;
+  unacked.Swap(&update.unacked_);
+  for (int i = update.sent_.commands_size();
+       i < unacknowledged_commands_.commands_size(); i++) {
+    *unacked.add_commands() = unacknowledged_commands_.commands(i);
+  }
   unacknowledged_commands_.Swap(&unacked);
 
   std::map<ID, BufferInfo> new_buffers;
   state_.content.ForEachAttribute(
-      Attribute::kBuffer, [this, &new_buffers](ID id, const Attribute& attr) {
+      Attribute::kBuffer,
+      [this, &new_buffers, &update](ID id, const Attribute& attr) {
         auto it = buffers_.find(id);
         if (it != buffers_.end()) {
           new_buffers.emplace(it->first, std::move(it->second));
           buffers_.erase(it);
-        } else {
-          AnnotatedString s;
-          s.Insert(site_, attr.buffer().contents(), AnnotatedString::Begin());
-          new_buffers.emplace(id,
-                              BufferInfo{Buffer::Builder()
-                                             .SetFilename(attr.buffer().name())
-                                             .SetInitialString(s)
-                                             .SetSynthetic()
-                                             .Make(),
-                                         AnnotationEditor(site_)});
+          return;
+        }
+        it = update.new_buffers_.find(id);
+        if (it != update.new_buffers_.end()) {
+          new_buffers.emplace(it->first, std::move(it->second));
+          update.new_buffers_.erase(it);
         }
       });
   buffers_.swap(new_buffers);
   for (auto& b : new_buffers) {
+    b.second.lines.reset();
     auto* p = b.second.buffer.release();
     // buffer destruction can be slow and mutex-grabby... just do it in its own
     // thread
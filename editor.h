@@ -13,10 +13,16 @@
 // limitations under the License.
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <numeric>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include "absl/strings/str_join.h"
 #include "buffer.h"
+#include "line_index.h"
 #include "log.h"
 #include "render.h"
 #include "theme.h"
@@ -34,9 +40,38 @@ class Editor : public std::enable_shared_from_this<Editor> {
  private:
   Editor(Site* site) : site_(site), ed_(site) {}
 
+ private:
+  struct BufferInfo {
+    std::unique_ptr<Buffer> buffer;
+    // must be reset before buffer
+    std::unique_ptr<LineIndex> lines;
+    // last presence published into buffer
+    std::vector<ID> linked_lines;
+  };
+
  public:
   // state management
   void UpdateState(LogTimer* tmr, const EditNotification& state);
+
+  // UpdateState in three steps, so an owner can run the costly middle one
+  // without the lock it guards the editor with: BeginUpdate and
+  // FinishUpdate are quick, and Prepare touches nothing of the editor's
+  class StateUpdate {
+   public:
+    void Prepare(LogTimer* tmr);
+
+   private:
+    friend class Editor;
+    Site* site_ = nullptr;
+    EditNotification state_;
+    // unacknowledged at BeginUpdate, and of those, the ones state_ lacks
+    CommandSet sent_;
+    CommandSet unacked_;
+    std::set<ID> known_buffers_;
+    std::map<ID, BufferInfo> new_buffers_;
+  };
+  StateUpdate BeginUpdate(const EditNotification& state);
+  void FinishUpdate(StateUpdate update);
   const EditNotification& CurrentState() { return state_; }
   bool HasCommands() {
     return state_.shutdown || !unpublished_commands_.commands().empty() ||
@@ -66,19 +101,34 @@ class Editor : public std::enable_shared_from_this<Editor> {
   void InsNewLine() { InsChar('\n'); }
   void InsChar(char c);
 
+  // Captures everything drawing needs by value, so the returned function can
+  // run on the render thread without holding the owner's lock
   template <class RC>
   std::function<void(RC* ctx)> PrepareRender(bool has_focus) {
     auto content = state_.content;
+    ID cursor = AnnotatedString::Iterator(content, cursor_).id();
+    int cursor_row = cursor_row_.load(std::memory_order_relaxed);
+    std::vector<ID> linked_lines = state_.presence.linked_lines;
+    std::sort(linked_lines.begin(), linked_lines.end());
     std::shared_ptr<Editor> self = shared_from_this();
-    return [self, content, has_focus](RC* ctx) {
-      if (self->cursor_row_ < 0) {
-        self->cursor_row_ = 0;
-      } else if (self->cursor_row_ >= ctx->window->height()) {
-        self->cursor_row_ = ctx->window->height() - 1;
+    return [self, content, cursor, cursor_row, linked_lines,
+            has_focus](RC* ctx) {
+      int clamped_row = cursor_row;
+      if (clamped_row < 0) {
+        clamped_row = 0;
+      } else if (clamped_row >= ctx->window->height()) {
+        clamped_row = ctx->window->height() - 1;
+      }
+      self->view_rows_.store(ctx->window->height(),
+                             std::memory_order_relaxed);
+      if (clamped_row != cursor_row) {
+        // only write back if no edit moved the cursor since the snapshot
+        int expected = cursor_row;
+        self->cursor_row_.compare_exchange_strong(expected, clamped_row,
+                                                  std::memory_order_relaxed);
       }
 
-      self->cursor_ = AnnotatedString::Iterator(content, self->cursor_).id();
-      AnnotatedString::LineIterator line_cr(content, self->cursor_);
+      AnnotatedString::LineIterator line_cr(content, cursor);
       AnnotatedString::LineIterator line_bk = line_cr;
       AnnotatedString::LineIterator line_fw = line_cr;
       for (int i = 0; i < ctx->window->height(); i++) {
@@ -88,8 +138,18 @@ class Editor : public std::enable_shared_from_this<Editor> {
       AnnotatedString::AllIterator it = line_bk.AsAllIterator();
       int nrow = 0;
       int ncol = 0;
-      uint32_t base_flags = 0;
+      // lines linked to another buffer's cursor start out highlighted
+      auto line_flags = [&linked_lines](ID line_start) -> uint32_t {
+        return std::binary_search(linked_lines.begin(), linked_lines.end(),
+                                  line_start)
+                   ? Theme::HIGHLIGHT_LINE
+                   : 0;
+      };
       AnnotatedString::AllIterator start_of_line = it;
+      uint32_t base_flags = line_flags(start_of_line.id());
+      const Theme::StyleID invalid_style = ctx->color->Style({"invalid"});
+      const Theme::StyleID gutter_style =
+          ctx->color->Style({"comment.gutter"});
       std::vector<std::string> gutter_annotations;
       auto add_gutter = [&gutter_annotations](const std::string& s) {
         for (const auto& g : gutter_annotations) {
@@ -100,10 +160,10 @@ class Editor : public std::enable_shared_from_this<Editor> {
       while (it.id() != line_fw.id()) {
         if (it.is_visible()) {
           uint32_t chr_flags = base_flags;
-          std::vector<std::string> tags;
+          Theme::StyleID style = Theme::kDefaultStyle;
           bool move_cursor = false;
           bool has_diagnostic = false;
-          it.ForEachAttrValue([&](const Attribute& attr) {
+          it.ForEachAttrIDAndValue([&](ID attr_id, const Attribute& attr) {
             switch (attr.data_case()) {
               case Attribute::kCursor:
                 Log() << "found cursor " << nrow << " " << ncol;
@@ -116,9 +176,8 @@ class Editor : public std::enable_shared_from_this<Editor> {
                 has_diagnostic = true;
                 break;
               case Attribute::kTags:
-                for (auto t : attr.tags().tags()) {
-                  tags.push_back(t);
-                }
+                style = ctx->color->CombineStyles(
+                    style, self->TagStyle(ctx, attr_id, attr.tags()));
                 break;
               case Attribute::kSize:
                 switch (attr.size().type()) {
@@ -147,18 +206,18 @@ class Editor : public std::enable_shared_from_this<Editor> {
             }
           });
           if (has_diagnostic) {
-            tags.push_back("invalid");
+            style = ctx->color->CombineStyles(style, invalid_style);
           }
           if (it.value() == '\n') {
-            auto fill_attr = ctx->color->Theme(::Theme::Tag(), base_flags);
+            auto fill_attr =
+                ctx->color->Theme(Theme::kDefaultStyle, base_flags);
             while (ncol < ctx->window->width()) {
               ctx->Put(nrow, ncol, ' ', fill_attr);
               ncol++;
             }
             std::string gutter = absl::StrJoin(gutter_annotations, ",");
             ncol = ctx->window->width() - gutter.length();
-            fill_attr =
-                ctx->color->Theme(::Theme::Tag{"comment.gutter"}, base_flags);
+            fill_attr = ctx->color->Theme(gutter_style, base_flags);
             for (auto c : gutter) {
               ctx->Put(nrow, ncol, c, fill_attr);
               ncol++;
@@ -167,10 +226,10 @@ class Editor : public std::enable_shared_from_this<Editor> {
             nrow++;
             ncol = 0;
             start_of_line = it;
-            base_flags = 0;
+            base_flags = line_flags(start_of_line.id());
           } else {
             ctx->Put(nrow, ncol, it.value(),
-                     ctx->color->Theme(tags, chr_flags));
+                     ctx->color->Theme(style, chr_flags));
             ncol++;
           }
           if (move_cursor) {
@@ -188,6 +247,20 @@ class Editor : public std::enable_shared_from_this<Editor> {
   }
 
  private:
+  // tag attributes are immutable once declared, so their resolved style can
+  // be remembered by attribute id across frames (only touched by the one
+  // thread drawing this editor's pane in a given frame)
+  template <class RC>
+  Theme::StyleID TagStyle(RC* ctx, ID attr_id, const TagSet& tags) {
+    auto it = tag_styles_.find(attr_id.id);
+    if (it != tag_styles_.end()) return it->second;
+    if (tag_styles_.size() > kMaxCachedTagStyles) tag_styles_.clear();
+    Theme::StyleID style = ctx->color->Style(
+        ::Theme::Tag(tags.tags().begin(), tags.tags().end()));
+    tag_styles_.emplace(attr_id.id, style);
+    return style;
+  }
+
   void CursorLeft();
   void CursorRight();
   void CursorDown();
@@ -195,23 +268,26 @@ class Editor : public std::enable_shared_from_this<Editor> {
   void CursorStartOfLine();
   void CursorEndOfLine();
   void PublishCursor();
+  Viewport CurrentViewport() const;
 
   void SetSelectMode(bool sel);
   bool SelectMode() const { return selection_anchor_ != ID(); }
   void DeleteSelection();
 
   Site* const site_;
-  int cursor_row_ = 0;  // cursor row as an offset into the view buffer
+  // cursor row as an offset into the view buffer
+  std::atomic<int> cursor_row_{0};
+  // window height at the last render
+  std::atomic<int> view_rows_{0};
   ID cursor_ = AnnotatedString::Begin();
   ID cursor_reported_ = AnnotatedString::End();
+  Viewport viewport_reported_;
   ID selection_anchor_ = ID();
   EditNotification state_;
   CommandSet unpublished_commands_;
   CommandSet unacknowledged_commands_;
   AnnotationEditor ed_;
-  struct BufferInfo {
-    std::unique_ptr<Buffer> buffer;
-    AnnotationEditor ed;
-  };
   std::map<ID, BufferInfo> buffers_;
+  static constexpr size_t kMaxCachedTagStyles = 65536;
+  std::unordered_map<uint64_t, Theme::StyleID> tag_styles_;
 };
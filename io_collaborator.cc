@@ -12,52 +12,183 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
 #include "temp_file.h"
 #include "wrap_syscall.h"
 
 #include "buffer.h"
 
+// identifies a block of file contents, to tell a save that would change
+// nothing
+class ContentHash {
+ public:
+  void Update(const char* data, size_t size) {
+    const Bytef* bytes = reinterpret_cast<const Bytef*>(data);
+    crc_ = crc32(crc_, bytes, size);
+    adler_ = adler32(adler_, bytes, size);
+    size_ += size;
+  }
+
+  bool operator==(const ContentHash& other) const {
+    return size_ == other.size_ && crc_ == other.crc_ &&
+           adler_ == other.adler_;
+  }
+
+ private:
+  uint64_t size_ = 0;
+  uLong crc_ = crc32(0, nullptr, 0);
+  uLong adler_ = adler32(0, nullptr, 0);
+};
+
 class IOCollaborator final : public AsyncCollaborator {
  public:
   IOCollaborator(const Buffer* buffer);
   void Push(const EditNotification& notification) override;
   EditResponse Pull() override;
 
+  // each save walks and writes the whole file: back off as it grows, rather
+  // than rewriting a large file at every pause in typing
+  absl::Duration push_delay_from_idle() const override {
+    return std::min(AsyncCollaborator::push_delay_from_idle() * SizeFactor(),
+                    absl::Seconds(2));
+  }
+  absl::Duration push_delay_from_start() const override {
+    return std::min(AsyncCollaborator::push_delay_from_start() * SizeFactor(),
+                    absl::Seconds(10));
+  }
+
  private:
+  // a save writes this much text per writev, in blocks of kSaveBlockSize
+  static constexpr size_t kSaveBlockSize = 64 * 1024;
+  static constexpr int kSaveBlocks = 16;
+  // a load inserts at most this much text per command
+  static constexpr size_t kLoadInsertBytes = 1024 * 1024;
+  // delays scale linearly with size past this
+  static constexpr uint64_t kSaveDelayScaleBytes = 1024 * 1024;
+
+  double SizeFactor() const {
+    return std::max(1.0, static_cast<double>(size_.load()) /
+                             kSaveDelayScaleBytes);
+  }
+
+  static void WriteFully(int fd, iovec* iov, int iovcnt);
+  // true if content renders to exactly the blocks hashed in blocks; stops at
+  // the first that differs
+  static bool Matches(const AnnotatedString& content,
+                      const std::vector<ContentHash>& blocks);
+
   absl::Mutex mu_;
   const Buffer* const buffer_;
   int attributes_;
   int fd_;
-  ID last_char_id_ GUARDED_BY(mu_);
   AnnotatedString last_saved_ GUARDED_BY(mu_);
+  // of each kSaveBlockSize block of the file as last loaded or saved, if
+  // known
+  absl::optional<std::vector<ContentHash>> saved_blocks_ GUARDED_BY(mu_);
+  std::atomic<uint64_t> size_{0};
 };
 
 IOCollaborator::IOCollaborator(const Buffer* buffer)
     : AsyncCollaborator("io", absl::Milliseconds(100), absl::Milliseconds(500)),
-      buffer_(buffer),
-      last_char_id_(AnnotatedString::Begin()) {
-  fd_ = WrapSyscall("open", [this]() {
-    return open(buffer_->filename().string().c_str(), O_RDONLY);
-  });
+      buffer_(buffer) {
   struct stat st;
-  WrapSyscall("fstat", [&]() { return fstat(fd_, &st); });
+  if (!buffer_->restored_sites().empty()) {
+    // restored from a snapshot of the file as it is now: nothing to read
+    fd_ = -1;
+    last_saved_ = buffer_->ContentSnapshot();
+    WrapSyscall("stat", [&]() {
+      return stat(buffer_->filename().string().c_str(), &st);
+    });
+  } else {
+    fd_ = WrapSyscall("open", [this]() {
+      return open(buffer_->filename().string().c_str(), O_RDONLY);
+    });
+    WrapSyscall("fstat", [&]() { return fstat(fd_, &st); });
+  }
   attributes_ = st.st_mode;
+  size_ = st.st_size;
+}
+
+void IOCollaborator::WriteFully(int fd, iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    size_t n = WrapSyscall("writev", [&]() {
+      return static_cast<int>(writev(fd, iov, iovcnt));
+    });
+    while (iovcnt > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+bool IOCollaborator::Matches(const AnnotatedString& content,
+                             const std::vector<ContentHash>& blocks) {
+  std::unique_ptr<char[]> block(new char[kSaveBlockSize]);
+  ID loc = AnnotatedString::Begin();
+  for (const ContentHash& expect : blocks) {
+    ContentHash hash;
+    hash.Update(block.get(),
+                content.RenderChunk(&loc, block.get(), kSaveBlockSize));
+    if (!(hash == expect)) return false;
+  }
+  // and nothing past them
+  return content.RenderChunk(&loc, block.get(), 1) == 0;
 }
 
 void IOCollaborator::Push(const EditNotification& notification) {
   if (!notification.fully_loaded) return;
   absl::MutexLock lock(&mu_);
   if (last_saved_.SameContentIdentity(notification.content)) return;
+  // edits that came back round to what's on disk: leave the file (and its
+  // mtime, and anything watching it) alone, without writing a byte
+  if (saved_blocks_ && Matches(notification.content, *saved_blocks_)) {
+    last_saved_ = notification.content;
+    return;
+  }
   NamedTempFile tmp;
   int fd = WrapSyscall("open", [&]() {
     return open(tmp.filename().c_str(), O_WRONLY | O_CREAT, attributes_);
   });
+  // stream the text out a batch of blocks at a time, rather than rendering
+  // the whole file into one string first
+  std::vector<ContentHash> hashes;
+  uint64_t size = 0;
   try {
-    auto str = notification.content.Render();
-    WrapSyscall("write", [&]() { return write(fd, str.data(), str.length()); });
+    std::unique_ptr<char[]> blocks(new char[kSaveBlocks * kSaveBlockSize]);
+    ID loc = AnnotatedString::Begin();
+    while (loc != AnnotatedString::End()) {
+      iovec iov[kSaveBlocks];
+      int iovcnt = 0;
+      while (iovcnt < kSaveBlocks && loc != AnnotatedString::End()) {
+        char* block = blocks.get() + iovcnt * kSaveBlockSize;
+        size_t n =
+            notification.content.RenderChunk(&loc, block, kSaveBlockSize);
+        if (n == 0) break;
+        hashes.emplace_back();
+        hashes.back().Update(block, n);
+        size += n;
+        iov[iovcnt].iov_base = block;
+        iov[iovcnt].iov_len = n;
+        iovcnt++;
+      }
+      WriteFully(fd, iov, iovcnt);
+    }
   } catch (...) {
     close(fd);
     throw;
@@ -66,29 +197,64 @@ void IOCollaborator::Push(const EditNotification& notification) {
   WrapSyscall("rename", [&]() {
     return rename(tmp.filename().c_str(), buffer_->filename().string().c_str());
   });
+  last_saved_ = notification.content;
+  saved_blocks_ = std::move(hashes);
+  size_ = size;
 }
 
 EditResponse IOCollaborator::Pull() {
-  static constexpr const int kChunkSize = 4096;
-  char buf[kChunkSize];
-  const int n = WrapSyscall(
-      "read", [this, &buf]() { return read(fd_, buf, sizeof(buf)); });
-
   EditResponse r;
+  r.done = true;
+  r.become_loaded = true;
+  if (fd_ == -1) return r;
 
-  if (n != sizeof(buf)) {
-    r.done = true;
-    r.become_loaded = true;
-    close(fd_);
-    fd_ = 0;
+  // the whole file goes in as one response, so the buffer publishes one
+  // loaded version rather than one per chunk read
+  struct stat st;
+  WrapSyscall("fstat", [&]() { return fstat(fd_, &st); });
+  void* map = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ,
+                                    MAP_PRIVATE, fd_, 0)
+                             : MAP_FAILED;
+  std::string read_contents;
+  absl::string_view contents;
+  if (map != MAP_FAILED) {
+    contents = absl::string_view(static_cast<const char*>(map), st.st_size);
+  } else {
+    // empty, or not mappable (a pipe, say): size is no guide, read to eof
+    static constexpr const int kChunkSize = 65536;
+    char buf[kChunkSize];
+    for (;;) {
+      const int n = WrapSyscall(
+          "read", [this, &buf]() { return read(fd_, buf, sizeof(buf)); });
+      if (n == 0) break;
+      read_contents.append(buf, n);
+    }
+    contents = read_contents;
   }
 
-  absl::MutexLock lock(&mu_);
-
-  last_char_id_ = AnnotatedString::MakeRawInsert(
-      &r.content_updates, buffer_->site(), std::string(buf, n), last_char_id_,
-      AnnotatedString::End());
-
+  std::vector<ContentHash> blocks;
+  for (size_t pos = 0; pos < contents.size(); pos += kSaveBlockSize) {
+    absl::string_view block = contents.substr(pos, kSaveBlockSize);
+    blocks.emplace_back();
+    blocks.back().Update(block.data(), block.size());
+  }
+  {
+    absl::MutexLock lock(&mu_);
+    saved_blocks_ = std::move(blocks);
+  }
+  size_ = contents.size();
+  // bounded inserts, each chained after the last, keep any one command (and
+  // its copy in the command log) a sane size; they all land in this one
+  // response, so still make a single version
+  ID after = AnnotatedString::Begin();
+  for (size_t pos = 0; pos < contents.size(); pos += kLoadInsertBytes) {
+    after = AnnotatedString::MakeRawInsert(
+        &r.content_updates, buffer_->site(),
+        contents.substr(pos, kLoadInsertBytes), after, AnnotatedString::End());
+  }
+  if (map != MAP_FAILED) munmap(map, st.st_size);
+  close(fd_);
+  fd_ = -1;
   return r;
 }
 
@@ -11,6 +11,7 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <map>
 #include <memory>
 #include <unordered_map>
 #include "absl/strings/str_join.h"
@@ -38,15 +39,40 @@ class LibClangCollaborator final : public SyncCollaborator {
 
 namespace {
 
-class ClangEnv : public LibClang, public ProjectAspect {
+// One per libclang in the process, shared by the projects served together
+// that use it: only the loaded library, as indexes and translation units
+// are each used by one thread at a time
+class ClangLib : public LibClang {
  public:
-  ClangEnv(Project* project)
-      : LibClang(ClangLibPath(project, "clang").c_str()) {
+  explicit ClangLib(const boost::filesystem::path& lib)
+      : LibClang(lib.c_str()) {
     if (!dlhdl) throw std::runtime_error("Failed opening libclang");
-    index_ = this->clang_createIndex(1, 0);
   }
 
-  ~ClangEnv() { clang_disposeIndex(index_); }
+  static std::shared_ptr<ClangLib> ForPath(const boost::filesystem::path& lib) {
+    static absl::Mutex mu;
+    // guarded by mu
+    static std::map<boost::filesystem::path, std::weak_ptr<ClangLib>> libs;
+    absl::MutexLock lock(&mu);
+    std::shared_ptr<ClangLib> loaded = libs[lib].lock();
+    if (!loaded) {
+      loaded = std::make_shared<ClangLib>(lib);
+      libs[lib] = loaded;
+    }
+    return loaded;
+  }
+};
+
+// Per project: its own index and unsaved files, so parses in one project
+// never wait on (or see the files of) another
+class ClangEnv : public ProjectAspect {
+ public:
+  explicit ClangEnv(std::shared_ptr<ClangLib> lib)
+      : lib_(std::move(lib)), index_(lib_->clang_createIndex(1, 0)) {}
+
+  ~ClangEnv() { lib_->clang_disposeIndex(index_); }
+
+  LibClang* lib() const { return lib_.get(); }
 
   absl::Mutex* mu() LOCK_RETURNED(mu_) { return &mu_; }
 
@@ -76,6 +102,7 @@ class ClangEnv : public LibClang, public ProjectAspect {
   CXIndex index() const EXCLUSIVE_LOCKS_REQUIRED(mu_) { return index_; }
 
  private:
+  const std::shared_ptr<ClangLib> lib_;
   absl::Mutex mu_;
   CXIndex index_ GUARDED_BY(mu_);
   std::unordered_map<std::string, std::string> unsaved_files_ GUARDED_BY(mu_);
@@ -83,7 +110,12 @@ class ClangEnv : public LibClang, public ProjectAspect {
 
 IMPL_PROJECT_GLOBAL_ASPECT(ClangEnv, project, 0) {
   if (project->client_peek()) return nullptr;
-  return std::unique_ptr<ProjectAspect>(new ClangEnv(project));
+  return std::unique_ptr<ProjectAspect>(
+      new ClangEnv(ClangLib::ForPath(ClangLibPath(project, "clang"))));
+}
+
+ClangEnv* EnvFor(const Buffer* buffer) {
+  return buffer->project()->aspect<ClangEnv>();
 }
 
 }  // namespace
@@ -95,12 +127,13 @@ LibClangCollaborator::LibClangCollaborator(const Buffer* buffer)
       ed_(buffer->site()) {}
 
 LibClangCollaborator::~LibClangCollaborator() {
-  ClangEnv* env = buffer_->project()->aspect<ClangEnv>();
+  ClangEnv* env = EnvFor(buffer_);
+  LibClang* lib = env->lib();
   absl::MutexLock lock(env->mu());
   env->ClearUnsavedFile(buffer_->filename());
 
   if (tu_) {
-    env->clang_disposeTranslationUnit(static_cast<CXTranslationUnit>(tu_));
+    lib->clang_disposeTranslationUnit(static_cast<CXTranslationUnit>(tu_));
   }
 }
 
@@ -184,7 +217,8 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
 
   auto filename = buffer_->filename();
 
-  ClangEnv* env = buffer_->project()->aspect<ClangEnv>();
+  ClangEnv* env = EnvFor(buffer_);
+  LibClang* lib = env->lib();
 
   std::string str;
   std::vector<ID> ids;
@@ -218,11 +252,11 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
   std::vector<CXUnsavedFile> unsaved_files = env->GetUnsavedFiles();
   CXTranslationUnit tu = static_cast<CXTranslationUnit>(tu_);
   if (tu == nullptr) {
-    const int options = env->clang_defaultEditingTranslationUnitOptions() |
+    const int options = lib->clang_defaultEditingTranslationUnitOptions() |
                         CXTranslationUnit_KeepGoing |
                         CXTranslationUnit_DetailedPreprocessingRecord |
                         CXTranslationUnit_PrecompiledPreamble;
-    tu = env->clang_parseTranslationUnit(
+    tu = lib->clang_parseTranslationUnit(
         env->index(), filename.c_str(), cmd_args.data(), cmd_args.size(),
         unsaved_files.data(), unsaved_files.size(), options);
     if (tu == NULL) {
@@ -237,9 +271,9 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
     content_changed = true;
   }
 
-  if (0 != env->clang_reparseTranslationUnit(
+  if (0 != lib->clang_reparseTranslationUnit(
                tu, unsaved_files.size(), unsaved_files.data(),
-               env->clang_defaultReparseOptions(tu))) {
+               lib->clang_defaultReparseOptions(tu))) {
     Log() << "failed reparse";
     return response;
   }
@@ -249,24 +283,24 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
   {
     AnnotationEditor::ScopedEdit edit(&ed_, &response.content_updates);
 
-    CXFile file = env->clang_getFile(tu, filename.c_str());
+    CXFile file = lib->clang_getFile(tu, filename.c_str());
 
     // get top/last location of the file
-    CXSourceLocation topLoc = env->clang_getLocationForOffset(tu, file, 0);
+    CXSourceLocation topLoc = lib->clang_getLocationForOffset(tu, file, 0);
     CXSourceLocation lastLoc =
-        env->clang_getLocationForOffset(tu, file, str.length());
-    if (env->clang_equalLocations(topLoc, env->clang_getNullLocation()) ||
-        env->clang_equalLocations(lastLoc, env->clang_getNullLocation())) {
+        lib->clang_getLocationForOffset(tu, file, str.length());
+    if (lib->clang_equalLocations(topLoc, lib->clang_getNullLocation()) ||
+        lib->clang_equalLocations(lastLoc, lib->clang_getNullLocation())) {
       Log() << "cannot retrieve location";
-      env->clang_disposeTranslationUnit(tu);
+      lib->clang_disposeTranslationUnit(tu);
       return response;
     }
 
     // make a range from locations
-    CXSourceRange range = env->clang_getRange(topLoc, lastLoc);
-    if (env->clang_Range_isNull(range)) {
+    CXSourceRange range = lib->clang_getRange(topLoc, lastLoc);
+    if (lib->clang_Range_isNull(range)) {
       Log() << "cannot retrieve range";
-      env->clang_disposeTranslationUnit(tu);
+      lib->clang_disposeTranslationUnit(tu);
       return response;
     }
 
@@ -276,27 +310,27 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
 
     CXToken* tokens;
     unsigned numTokens;
-    env->clang_tokenize(tu, range, &tokens, &numTokens);
+    lib->clang_tokenize(tu, range, &tokens, &numTokens);
     std::unique_ptr<CXCursor[]> tok_cursors(new CXCursor[numTokens]);
-    env->clang_annotateTokens(tu, tokens, numTokens, tok_cursors.get());
+    lib->clang_annotateTokens(tu, tokens, numTokens, tok_cursors.get());
 
     std::function<void(TagSet*, CXCursor)> f_add =
-        [&f_add, env](TagSet* t, CXCursor cursor) {
-          if (!env->clang_Cursor_isNull(cursor)) {
-            f_add(t, env->clang_getCursorLexicalParent(cursor));
+        [&f_add, lib](TagSet* t, CXCursor cursor) {
+          if (!lib->clang_Cursor_isNull(cursor)) {
+            f_add(t, lib->clang_getCursorLexicalParent(cursor));
           }
-          CXCursorKind kind = env->clang_getCursorKind(cursor);
+          CXCursorKind kind = lib->clang_getCursorKind(cursor);
           auto it = tok_cursor_rules.find(kind);
           if (it != tok_cursor_rules.end()) {
             t->add_tags(it->second);
           }
           t->add_tags(absl::StrCat(
               "LIBCLANG-",
-              env->clang_getCString(env->clang_getCursorKindSpelling(kind))));
+              lib->clang_getCString(lib->clang_getCursorKindSpelling(kind))));
         };
-    std::function<void(TagSet*, CXToken)> f_tidy = [env](TagSet* t,
+    std::function<void(TagSet*, CXToken)> f_tidy = [lib](TagSet* t,
                                                          CXToken token) {
-      switch (env->clang_getTokenKind(token)) {
+      switch (lib->clang_getTokenKind(token)) {
         case CXToken_Keyword:
           t->add_tags("keyword.c++");
           break;
@@ -313,17 +347,17 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
     for (unsigned i = 0; i < numTokens; i++) {
       CXToken token = tokens[i];
       CXCursor cursor = tok_cursors[i];
-      CXSourceRange extent = env->clang_getTokenExtent(tu, token);
-      CXSourceLocation start = env->clang_getRangeStart(extent);
-      CXSourceLocation end = env->clang_getRangeEnd(extent);
+      CXSourceRange extent = lib->clang_getTokenExtent(tu, token);
+      CXSourceLocation start = lib->clang_getRangeStart(extent);
+      CXSourceLocation end = lib->clang_getRangeEnd(extent);
 
       CXFile file;
       unsigned line, col, offset_start, offset_end;
-      env->clang_getFileLocation(start, &file, &line, &col, &offset_start);
-      env->clang_getFileLocation(end, &file, &line, &col, &offset_end);
+      lib->clang_getFileLocation(start, &file, &line, &col, &offset_start);
+      lib->clang_getFileLocation(end, &file, &line, &col, &offset_end);
 
       if (ofs_annotation.find(line) == ofs_annotation.end()) {
-        long long ofs = env->clang_Cursor_getOffsetOfField(cursor);
+        long long ofs = lib->clang_Cursor_getOffsetOfField(cursor);
         if (ofs >= 0) {
           ofs_annotation[line] = ofs;
           Attribute attr;
@@ -343,7 +377,7 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
       ed_.Mark(ids[offset_start], ids[offset_end], attr);
     }
 
-    env->clang_disposeTokens(tu, tokens, numTokens);
+    lib->clang_disposeTokens(tu, tokens, numTokens);
 
     tmr.Mark("syntax-highlighting");
 
@@ -351,21 +385,21 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
      * REFERENCED FILE DISCOVERY
      */
 
-    env->clang_visitChildren(
-        env->clang_getTranslationUnitCursor(tu),
+    lib->clang_visitChildren(
+        lib->clang_getTranslationUnitCursor(tu),
         +[](CXCursor cursor, CXCursor parent, CXClientData client_data) {
           LibClangCollaborator* self =
               static_cast<LibClangCollaborator*>(client_data);
-          ClangEnv* env = self->buffer_->project()->aspect<ClangEnv>();
-          if (env->clang_getCursorKind(cursor) == CXCursor_InclusionDirective) {
-            CXFile file = env->clang_getIncludedFile(cursor);
+          LibClang* lib = EnvFor(self->buffer_)->lib();
+          if (lib->clang_getCursorKind(cursor) == CXCursor_InclusionDirective) {
+            CXFile file = lib->clang_getIncludedFile(cursor);
             if (file) {
-              CXString filename = env->clang_getFileName(file);
-              const char* fn = env->clang_getCString(filename);
+              CXString filename = lib->clang_getFileName(file);
+              const char* fn = lib->clang_getCString(filename);
               Attribute attr;
               attr.mutable_dependency()->set_filename(fn);
               self->ed_.AttrID(attr);
-              env->clang_disposeString(filename);
+              lib->clang_disposeString(filename);
             }
           }
           return CXChildVisit_Recurse;
@@ -379,69 +413,69 @@ EditResponse LibClangCollaborator::Edit(const EditNotification& notification) {
      */
 
     if (notification.fully_loaded) {
-      unsigned num_diagnostics = env->clang_getNumDiagnostics(tu);
+      unsigned num_diagnostics = lib->clang_getNumDiagnostics(tu);
       Log() << num_diagnostics << " diagnostics";
       for (unsigned i = 0; i < num_diagnostics; i++) {
-        CXDiagnostic cxdiag = env->clang_getDiagnostic(tu, i);
-        CXString message = env->clang_formatDiagnostic(cxdiag, 0);
+        CXDiagnostic cxdiag = lib->clang_getDiagnostic(tu, i);
+        CXString message = lib->clang_formatDiagnostic(cxdiag, 0);
         Attribute diag_attr;
         Diagnostic* diag = diag_attr.mutable_diagnostic();
         diag->set_severity(
-            DiagnosticSeverity(env->clang_getDiagnosticSeverity(cxdiag)));
-        diag->set_message(env->clang_getCString(message));
+            DiagnosticSeverity(lib->clang_getDiagnosticSeverity(cxdiag)));
+        diag->set_message(lib->clang_getCString(message));
         ID diag_id = ed_.AttrID(diag_attr);
-        unsigned num_ranges = env->clang_getDiagnosticNumRanges(cxdiag);
+        unsigned num_ranges = lib->clang_getDiagnosticNumRanges(cxdiag);
         for (size_t j = 0; j < num_ranges; j++) {
-          CXSourceRange extent = env->clang_getDiagnosticRange(cxdiag, j);
-          CXSourceLocation start = env->clang_getRangeStart(extent);
-          CXSourceLocation end = env->clang_getRangeEnd(extent);
+          CXSourceRange extent = lib->clang_getDiagnosticRange(cxdiag, j);
+          CXSourceLocation start = lib->clang_getRangeStart(extent);
+          CXSourceLocation end = lib->clang_getRangeEnd(extent);
           CXFile file;
           unsigned line, col, offset_start, offset_end;
-          env->clang_getFileLocation(start, &file, &line, &col, &offset_start);
-          env->clang_getFileLocation(end, &file, &line, &col, &offset_end);
+          lib->clang_getFileLocation(start, &file, &line, &col, &offset_start);
+          lib->clang_getFileLocation(end, &file, &line, &col, &offset_end);
           if (file && boost::filesystem::equivalent(
-                          filename, env->clang_getCString(
-                                        env->clang_getFileName(file)))) {
+                          filename, lib->clang_getCString(
+                                        lib->clang_getFileName(file)))) {
             ed_.Mark(ids[offset_start], ids[offset_end], diag_id);
           }
         }
         CXFile file;
         unsigned line, col, offset;
-        CXSourceLocation loc = env->clang_getDiagnosticLocation(cxdiag);
-        env->clang_getFileLocation(loc, &file, &line, &col, &offset);
+        CXSourceLocation loc = lib->clang_getDiagnosticLocation(cxdiag);
+        lib->clang_getFileLocation(loc, &file, &line, &col, &offset);
         if (file &&
-            filename == env->clang_getCString(env->clang_getFileName(file))) {
+            filename == lib->clang_getCString(lib->clang_getFileName(file))) {
           // diagnostic_editor_.AddPoint(ids[offset]);
         }
-        unsigned num_fixits = env->clang_getDiagnosticNumFixIts(cxdiag);
+        unsigned num_fixits = lib->clang_getDiagnosticNumFixIts(cxdiag);
         Log() << "num_fixits:" << num_fixits;
         for (unsigned j = 0; j < num_fixits; j++) {
           CXSourceRange extent;
-          CXString repl = env->clang_getDiagnosticFixIt(cxdiag, j, &extent);
-          CXSourceLocation start = env->clang_getRangeStart(extent);
-          CXSourceLocation end = env->clang_getRangeEnd(extent);
+          CXString repl = lib->clang_getDiagnosticFixIt(cxdiag, j, &extent);
+          CXSourceLocation start = lib->clang_getRangeStart(extent);
+          CXSourceLocation end = lib->clang_getRangeEnd(extent);
           CXFile file;
           unsigned line, col, offset_start, offset_end;
-          env->clang_getFileLocation(start, &file, &line, &col, &offset_start);
-          env->clang_getFileLocation(end, &file, &line, &col, &offset_end);
+          lib->clang_getFileLocation(start, &file, &line, &col, &offset_start);
+          lib->clang_getFileLocation(end, &file, &line, &col, &offset_end);
           Log() << file;
           if (file)
             Log() << filename << " "
-                  << env->clang_getCString(env->clang_getFileName(file));
+                  << lib->clang_getCString(lib->clang_getFileName(file));
           if (file && boost::filesystem::equivalent(
-                          filename, env->clang_getCString(
-                                        env->clang_getFileName(file)))) {
+                          filename, lib->clang_getCString(
+                                        lib->clang_getFileName(file)))) {
             Attribute fix_attr;
             Fixit* fix = fix_attr.mutable_fixit();
             fix->set_type(Fixit::COMPILE_FIX);
             fix->set_diagnostic(diag_id.id);
-            fix->set_replacement(env->clang_getCString(repl));
+            fix->set_replacement(lib->clang_getCString(repl));
             ed_.Mark(ids[offset_start], ids[offset_end], fix_attr);
           }
         }
 
-        env->clang_disposeString(message);
-        env->clang_disposeDiagnostic(cxdiag);
+        lib->clang_disposeString(message);
+        lib->clang_disposeDiagnostic(cxdiag);
       }
     }
 
@@ -0,0 +1,127 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "line_index.h"
+#include <algorithm>
+#include <iterator>
+
+LineIndex::LineIndex(Buffer* buffer)
+    : listener_(buffer->Listen(
+          [this](const AnnotatedString& initial) {
+            absl::MutexLock lock(&mu_);
+            content_ = initial;
+            stale_ = true;
+          },
+          [this](const CommandSet* commands) { Update(commands); })) {}
+
+void LineIndex::Update(const CommandSet* commands) {
+  absl::MutexLock lock(&mu_);
+  if (stale_) {
+    content_ = content_.Integrate(*commands);
+    return;
+  }
+  for (const auto& cmd : commands->commands()) {
+    content_.Integrate(cmd);
+    switch (cmd.command_case()) {
+      case Command::kInsert: {
+        // each inserted newline starts a line after the one before it,
+        // which an earlier newline of the same insert may have started
+        const ID first(cmd.id());
+        const std::string& chars = cmd.insert().characters();
+        for (size_t i = 0; i < chars.size(); i++) {
+          if (chars[i] != '\n') continue;
+          const ID id(first.site, first.clock + i);
+          if (run_of_.count(id.id) != 0) continue;
+          AnnotatedString::LineIterator line(content_, id);
+          if (line.id() != id) continue;
+          line.MovePrev();
+          AddLineStart(line.id(), id);
+        }
+        break;
+      }
+      case Command::kDelete:
+        // a deleted newline no longer breaks its line
+        if (run_of_.count(cmd.id()) != 0) RemoveLineStart(ID(cmd.id()));
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+absl::optional<int> LineIndex::LineOf(ID id) {
+  absl::MutexLock lock(&mu_);
+  if (!content_.HasChar(id)) return absl::optional<int>();
+  MaybeRebuild();
+  const ID start = AnnotatedString::LineIterator(content_, id).id();
+  auto it = run_of_.find(start.id);
+  if (it == run_of_.end()) return absl::optional<int>();
+  int line = 0;
+  for (auto run = runs_.begin(); run != it->second; ++run) {
+    line += run->size();
+  }
+  const std::vector<ID>& run = *it->second;
+  return line + (std::find(run.begin(), run.end(), start) - run.begin());
+}
+
+void LineIndex::MaybeRebuild() {
+  if (!stale_) return;
+  stale_ = false;
+  runs_.clear();
+  run_of_.clear();
+  AnnotatedString::LineIterator it(content_, AnnotatedString::Begin());
+  while (!it.is_end()) {
+    if (runs_.empty() || runs_.back().size() == kRunLength) {
+      runs_.emplace_back();
+      runs_.back().reserve(2 * kRunLength);
+    }
+    runs_.back().push_back(it.id());
+    run_of_.emplace(it.id().id, std::prev(runs_.end()));
+    it.MoveNext();
+  }
+}
+
+void LineIndex::AddLineStart(ID prev, ID id) {
+  auto prev_run = run_of_.find(prev.id);
+  if (prev_run == run_of_.end()) {
+    // not a line the index knows: start over from the content
+    stale_ = true;
+    return;
+  }
+  const Runs::iterator run = prev_run->second;
+  run->insert(std::find(run->begin(), run->end(), prev) + 1, id);
+  run_of_.emplace(id.id, run);
+  if (run->size() < 2 * kRunLength) return;
+  // split the run in two, moving its back half into a run of its own
+  const Runs::iterator back = runs_.emplace(std::next(run));
+  back->reserve(2 * kRunLength);
+  back->assign(run->begin() + kRunLength, run->end());
+  run->resize(kRunLength);
+  for (ID moved : *back) run_of_[moved.id] = back;
+}
+
+void LineIndex::RemoveLineStart(ID id) {
+  auto it = run_of_.find(id.id);
+  const Runs::iterator run = it->second;
+  run_of_.erase(it);
+  run->erase(std::find(run->begin(), run->end(), id));
+  if (run->empty()) runs_.erase(run);
+}
+
+absl::optional<ID> LineIndex::LineStart(int line) {
+  for (const auto& run : runs_) {
+    if (static_cast<size_t>(line) < run.size()) return run[line];
+    line -= run.size();
+  }
+  return absl::optional<ID>();
+}
@@ -0,0 +1,78 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+#include "absl/types/optional.h"
+#include "annotated_string.h"
+#include "buffer.h"
+
+// Maps line numbers of a buffer to the ids that start those lines (as
+// AnnotatedString::LineIterator::id() reports them), and back. The index is
+// built by the first lookup after the buffer's initial content arrives, then
+// follows its command stream line break by line break, so neither edits nor
+// lookups walk the content. Listeners to the buffer that start after the
+// index hear each update only once the index has applied it.
+class LineIndex {
+ public:
+  // buffer must outlive the index
+  explicit LineIndex(Buffer* buffer);
+
+  LineIndex(const LineIndex&) = delete;
+  LineIndex& operator=(const LineIndex&) = delete;
+
+  // line start ids for each of lines; out of range lines are skipped
+  template <class Lines>
+  std::vector<ID> LineStarts(const Lines& lines) LOCKS_EXCLUDED(mu_) {
+    std::vector<ID> out;
+    absl::MutexLock lock(&mu_);
+    MaybeRebuild();
+    for (auto line : lines) {
+      if (line < 0) continue;
+      absl::optional<ID> start = LineStart(line);
+      if (start) out.push_back(*start);
+    }
+    return out;
+  }
+
+  // line number of the line holding id (deleted characters included);
+  // nullopt if the index hasn't seen id yet
+  absl::optional<int> LineOf(ID id) LOCKS_EXCLUDED(mu_);
+
+ private:
+  // line starts in order, split into runs so that adding or removing one
+  // only shifts its neighbours
+  typedef std::list<std::vector<ID>> Runs;
+  static constexpr size_t kRunLength = 256;
+
+  void Update(const CommandSet* commands) LOCKS_EXCLUDED(mu_);
+  void MaybeRebuild() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // indexes line start id, which follows line start prev
+  void AddLineStart(ID prev, ID id) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void RemoveLineStart(ID id) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  absl::optional<ID> LineStart(int line) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  absl::Mutex mu_;
+  AnnotatedString content_ GUARDED_BY(mu_);
+  bool stale_ GUARDED_BY(mu_) = true;
+  Runs runs_ GUARDED_BY(mu_);
+  // line start id -> the run holding it
+  std::unordered_map<uint64_t, Runs::iterator> run_of_ GUARDED_BY(mu_);
+  // declared last: stops updates before the rest of the index goes away
+  std::unique_ptr<BufferListener> listener_;
+};
@@ -0,0 +1,112 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "line_index.h"
+#include <gtest/gtest.h>
+#include <random>
+
+static ID LineStart(const AnnotatedString& s, int line) {
+  return AnnotatedString::LineIterator::FromLineNumber(s, line).id();
+}
+
+TEST(LineIndex, FollowsBufferEdits) {
+  Site site;
+  AnnotatedString initial;
+  initial.Insert(&site, "a\nb\nc\n", AnnotatedString::Begin());
+  auto buffer = Buffer::Builder()
+                    .SetFilename("test.s")
+                    .SetInitialString(initial)
+                    .SetSynthetic()
+                    .Make();
+  LineIndex index(buffer.get());
+
+  AnnotatedString content = buffer->ContentSnapshot();
+  EXPECT_EQ((std::vector<ID>{LineStart(content, 0), LineStart(content, 2)}),
+            index.LineStarts(std::vector<int>{0, 2, 100}));
+
+  CommandSet cmds;
+  content.Insert(&cmds, &site, "x\n", AnnotatedString::Begin());
+  buffer->PushChanges(&cmds, false);
+  content = buffer->ContentSnapshot();
+  EXPECT_EQ((std::vector<ID>{LineStart(content, 1), LineStart(content, 3)}),
+            index.LineStarts(std::vector<int>{1, 3}));
+}
+
+TEST(LineIndex, LineOf) {
+  Site site;
+  AnnotatedString initial;
+  initial.Insert(&site, "ab\ncd\n", AnnotatedString::Begin());
+  auto buffer = Buffer::Builder()
+                    .SetFilename("test.s")
+                    .SetInitialString(initial)
+                    .SetSynthetic()
+                    .Make();
+  LineIndex index(buffer.get());
+
+  AnnotatedString content = buffer->ContentSnapshot();
+  ID c = AnnotatedString::LineIterator::FromLineNumber(content, 1)
+             .AsIterator()
+             .Next()
+             .id();
+  EXPECT_EQ(absl::optional<int>(1), index.LineOf(c));
+  EXPECT_EQ(absl::optional<int>(0), index.LineOf(LineStart(content, 0)));
+  EXPECT_EQ(absl::optional<int>(), index.LineOf(ID(site.site_id(), 1000)));
+
+  CommandSet cmds;
+  content.Insert(&cmds, &site, "x\n", AnnotatedString::Begin());
+  buffer->PushChanges(&cmds, false);
+  EXPECT_EQ(absl::optional<int>(2), index.LineOf(c));
+}
+
+TEST(LineIndex, MatchesContentThroughRandomEdits) {
+  Site site;
+  AnnotatedString initial;
+  initial.Insert(&site, "a\nb\n", AnnotatedString::Begin());
+  auto buffer = Buffer::Builder()
+                    .SetFilename("test.s")
+                    .SetInitialString(initial)
+                    .SetSynthetic()
+                    .Make();
+  LineIndex index(buffer.get());
+  index.LineOf(AnnotatedString::Begin());
+
+  std::mt19937 rng(42);
+  for (int step = 0; step < 2000; step++) {
+    AnnotatedString content = buffer->ContentSnapshot();
+    std::vector<ID> chars;
+    for (AnnotatedString::Iterator it(content, AnnotatedString::Begin());
+         !it.is_end(); it.MoveNext()) {
+      chars.push_back(it.id());
+    }
+    CommandSet cmds;
+    ID where = chars[rng() % chars.size()];
+    if (chars.size() > 1 && rng() % 3 == 0) {
+      if (where == AnnotatedString::Begin()) where = chars[1];
+      content.MakeDelete(&cmds, where);
+    } else {
+      content.Insert(&cmds, &site, rng() % 2 ? "x\ny\n" : "\n", where);
+    }
+    buffer->PushChanges(&cmds, false);
+  }
+
+  AnnotatedString content = buffer->ContentSnapshot();
+  std::vector<int> lines;
+  int line = 0;
+  for (AnnotatedString::LineIterator it(content, AnnotatedString::Begin());
+       !it.is_end(); it.MoveNext(), line++) {
+    EXPECT_EQ(absl::optional<int>(line), index.LineOf(it.id()));
+    lines.push_back(line);
+  }
+  EXPECT_EQ(lines.size(), index.LineStarts(lines).size());
+  EXPECT_LT(2 * 256, line);
+}
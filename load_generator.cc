@@ -0,0 +1,437 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <gflags/gflags.h>
+#include <grpc++/create_channel.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "application.h"
+#include "buffer.h"
+#include "client.h"
+#include "log.h"
+#include "project.h"
+#include "proto/project_service.grpc.pb.h"
+#include "server.h"
+#include "wrap_syscall.h"
+
+DEFINE_int32(load_clients, 8, "Synthetic clients LoadGenerator connects");
+DEFINE_int32(load_buffers, 1,
+             "Buffers LoadGenerator spreads its clients over");
+DEFINE_int32(load_initial_lines, 1000, "Lines each LoadGenerator buffer has");
+DEFINE_double(load_seconds, 10, "How long LoadGenerator's workload runs");
+DEFINE_double(load_typing_rate, 8,
+              "Characters each synthetic client types per second");
+DEFINE_double(load_cursor_rate, 4,
+              "Cursor moves each synthetic client makes per second");
+DEFINE_double(load_paste_interval, 5,
+              "Seconds between each synthetic client's pastes (0: none)");
+DEFINE_int32(load_paste_bytes, 2048, "Size of each synthetic paste");
+
+namespace {
+
+class Latencies {
+ public:
+  void Add(absl::Duration d) { samples_.push_back(d); }
+  size_t size() const { return samples_.size(); }
+
+  std::string Summary() {
+    if (samples_.empty()) return "no samples";
+    std::sort(samples_.begin(), samples_.end());
+    return absl::StrCat("p50 ", absl::FormatDuration(At(0.5)), " p99 ",
+                        absl::FormatDuration(At(0.99)), " p999 ",
+                        absl::FormatDuration(At(0.999)), " max ",
+                        absl::FormatDuration(samples_.back()), " (",
+                        samples_.size(), " samples)");
+  }
+
+ private:
+  absl::Duration At(double q) const {
+    return samples_[std::min(samples_.size() - 1,
+                             static_cast<size_t>(q * samples_.size()))];
+  }
+
+  std::vector<absl::Duration> samples_;
+};
+
+// Follows each insert a synthetic client sends: back to that client (its
+// echo from the server) and on to every other client of the buffer
+// (convergence)
+class Tracker {
+ public:
+  explicit Tracker(int clients) : echo_(clients) {}
+
+  // before the insert is pushed, so that no sighting can precede it
+  void Sent(ID id, int client, int peers) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    edits_[id.id] = Edit{absl::Now(), client, false, peers};
+    sent_++;
+  }
+
+  void Saw(ID id, int client, absl::Time now) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    received_++;
+    auto it = edits_.find(id.id);
+    if (it == edits_.end()) return;
+    Edit& edit = it->second;
+    if (edit.client == client) {
+      if (edit.echoed) return;
+      edit.echoed = true;
+      echo_[client].Add(now - edit.sent);
+    } else {
+      if (--edit.unseen == 0) convergence_.Add(now - edit.sent);
+    }
+    if (edit.echoed && edit.unseen <= 0) edits_.erase(it);
+  }
+
+  size_t outstanding() LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    return edits_.size();
+  }
+
+  void Report(absl::Duration elapsed, std::ostream& out) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    const double secs = absl::ToDoubleSeconds(elapsed);
+    out << "  sent " << sent_ << " inserts (" << sent_ / secs
+        << "/s), received " << received_ << " (" << received_ / secs
+        << "/s)\n";
+    out << "  convergence: " << convergence_.Summary() << ", "
+        << edits_.size() << " inserts never converged\n";
+    for (size_t i = 0; i < echo_.size(); i++) {
+      out << "  client " << i << " echo: " << echo_[i].Summary() << "\n";
+    }
+  }
+
+ private:
+  struct Edit {
+    absl::Time sent;
+    int client;
+    bool echoed;
+    int unseen;  // clients yet to see it
+  };
+
+  absl::Mutex mu_;
+  std::unordered_map<uint64_t, Edit> edits_ GUARDED_BY(mu_);
+  std::vector<Latencies> echo_ GUARDED_BY(mu_);
+  Latencies convergence_ GUARDED_BY(mu_);
+  uint64_t sent_ GUARDED_BY(mu_) = 0;
+  uint64_t received_ GUARDED_BY(mu_) = 0;
+};
+
+// set while a synthetic client pushes its own edits: their local publication
+// isn't a sighting
+thread_local bool pushing = false;
+
+// One editor's worth of typing, cursor movement and pasting against its own
+// buffer, connected through the real Client and Edit stream
+class SyntheticClient {
+ public:
+  SyntheticClient(int index, int peers, std::unique_ptr<Buffer> buffer,
+                  Tracker* tracker)
+      : index_(index),
+        peers_(peers),
+        buffer_(std::move(buffer)),
+        tracker_(tracker),
+        rng_(index) {
+    listener_ = buffer_->Listen([](const AnnotatedString&) {},
+                                [this](const CommandSet* commands) {
+                                  Update(*commands);
+                                });
+  }
+
+  ~SyntheticClient() {
+    if (thread_.joinable()) thread_.join();
+    listener_.reset();
+  }
+
+  // true once the client holds at least size bytes of text
+  bool WaitForText(size_t size, absl::Duration timeout) {
+    const absl::Time deadline = absl::Now() + timeout;
+    while (buffer_->ContentSnapshot().Render().size() < size) {
+      if (absl::Now() > deadline) return false;
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+    return true;
+  }
+
+  void Start(absl::Time deadline) {
+    thread_ = std::thread([this, deadline]() { Run(deadline); });
+  }
+
+  void Join() { thread_.join(); }
+
+ private:
+  void Update(const CommandSet& commands) {
+    if (pushing) return;
+    const absl::Time now = absl::Now();
+    for (const auto& cmd : commands.commands()) {
+      if (cmd.command_case() == Command::kInsert) {
+        tracker_->Saw(cmd.id(), index_, now);
+      }
+    }
+  }
+
+  // next event of a Poisson process of rate per second
+  absl::Time Next(absl::Time from, double rate) {
+    if (rate <= 0) return absl::InfiniteFuture();
+    return from + absl::Seconds(std::exponential_distribution<>(rate)(rng_));
+  }
+
+  void Run(absl::Time deadline) {
+    AnnotatedString content = buffer_->ContentSnapshot();
+    // start on a line of our own choosing
+    int line = std::uniform_int_distribution<>(
+        0, std::max(0, FLAGS_load_initial_lines - 1))(rng_);
+    auto start_line =
+        AnnotatedString::LineIterator::FromLineNumber(content, line);
+    cursor_ = start_line.is_end() ? AnnotatedString::Begin() : start_line.id();
+
+    const absl::Time start = absl::Now();
+    absl::Time next_type = Next(start, FLAGS_load_typing_rate);
+    absl::Time next_move = Next(start, FLAGS_load_cursor_rate);
+    absl::Time next_paste =
+        Next(start, FLAGS_load_paste_interval > 0
+                        ? 1.0 / FLAGS_load_paste_interval
+                        : 0.0);
+    for (;;) {
+      const absl::Time next = std::min({next_type, next_move, next_paste});
+      if (next > deadline) break;
+      absl::SleepFor(next - absl::Now());
+      if (next == next_type) {
+        Type();
+        next_type = Next(next, FLAGS_load_typing_rate);
+      } else if (next == next_move) {
+        MoveCursor();
+        next_move = Next(next, FLAGS_load_cursor_rate);
+      } else {
+        Paste();
+        next_paste = Next(next, 1.0 / FLAGS_load_paste_interval);
+      }
+    }
+  }
+
+  void Insert(absl::string_view text) {
+    CommandSet commands;
+    cursor_ = buffer_->ContentSnapshot().MakeInsert(&commands, buffer_->site(),
+                                                    text, cursor_);
+    for (const auto& cmd : commands.commands()) {
+      tracker_->Sent(cmd.id(), index_, peers_);
+    }
+    Push(&commands);
+  }
+
+  void Type() {
+    static const absl::string_view kText =
+        "the quick brown fox jumps over the lazy dog\n";
+    Insert(kText.substr(typed_++ % kText.size(), 1));
+  }
+
+  void Paste() {
+    std::string text;
+    while (text.size() < static_cast<size_t>(FLAGS_load_paste_bytes)) {
+      absl::StrAppend(&text, "pasted by client ", index_, "\n");
+    }
+    text.resize(FLAGS_load_paste_bytes);
+    Insert(text);
+  }
+
+  // as an arrow key held for a few characters, then the cursor is published
+  void MoveCursor() {
+    AnnotatedString content = buffer_->ContentSnapshot();
+    AnnotatedString::Iterator it(content, cursor_);
+    int steps = std::uniform_int_distribution<>(-40, 40)(rng_);
+    for (; steps < 0; steps++) it.MovePrev();
+    for (; steps > 0; steps--) it.MoveNext();
+    if (it.is_end()) it.MovePrev();
+    cursor_ = it.id();
+
+    CommandSet commands;
+    if (cursor_decl_ == ID()) {
+      Attribute cursor;
+      cursor.mutable_cursor();
+      cursor_decl_ =
+          AnnotatedString::MakeDecl(&commands, buffer_->site(), cursor);
+    }
+    if (cursor_mark_ != ID()) {
+      AnnotatedString::MakeDelMark(&commands, cursor_mark_);
+    }
+    Annotation mark;
+    mark.set_begin(cursor_.id);
+    mark.set_end(it.Next().id().id);
+    mark.set_attribute(cursor_decl_.id);
+    cursor_mark_ = AnnotatedString::MakeMark(&commands, buffer_->site(), mark);
+    Push(&commands);
+  }
+
+  void Push(CommandSet* commands) {
+    pushing = true;
+    buffer_->PushChanges(commands, true);
+    pushing = false;
+  }
+
+  const int index_;
+  const int peers_;
+  const std::unique_ptr<Buffer> buffer_;
+  Tracker* const tracker_;
+  std::unique_ptr<BufferListener> listener_;
+  std::thread thread_;
+
+  // only touched by thread_
+  std::mt19937 rng_;
+  ID cursor_;
+  ID cursor_decl_;
+  ID cursor_mark_;
+  size_t typed_ = 0;
+};
+
+}  // namespace
+
+// Runs a ProjectServer in process and drives it with synthetic clients, to
+// see how it copes with many editors on one buffer or many buffers. Usage:
+//   ced -mode LoadGenerator -load_clients 32 -load_buffers 4
+class LoadGenerator : public Application {
+ public:
+  LoadGenerator(int argc, char** argv) : ced_bin_(argv[0]) {}
+
+  int Run() override {
+    Log::SetCerrLog(false);
+    const boost::filesystem::path root = MakeProject();
+    int status = 1;
+    try {
+      status = RunIn(root);
+    } catch (std::exception& e) {
+      std::cerr << "LoadGenerator failed: " << e.what() << "\n";
+    }
+    boost::system::error_code ignored;
+    boost::filesystem::remove_all(root, ignored);
+    return status;
+  }
+
+ private:
+  static std::string BufferName(int i) { return absl::StrCat("buffer", i); }
+
+  // a scratch project holding the buffers
+  static boost::filesystem::path MakeProject() {
+    const char* temp = getenv("TEMP");
+    std::string tpl = absl::StrCat(temp ? temp : "/tmp", "/ced-load.XXXXXX");
+    WrapSyscall("mkdtemp", [&]() { return mkdtemp(&tpl[0]) ? 0 : -1; });
+    const boost::filesystem::path root(tpl);
+    std::ofstream(root / ".ced");
+    for (int b = 0; b < std::max(1, FLAGS_load_buffers); b++) {
+      std::ofstream out((root / BufferName(b)).string());
+      for (int i = 0; i < FLAGS_load_initial_lines; i++) {
+        out << "line " << i << " of " << BufferName(b) << "\n";
+      }
+    }
+    return root;
+  }
+
+  int RunIn(const boost::filesystem::path& root) {
+    Project project(root, false);
+    const std::string address =
+        project.aspect<ProjectRoot>()->LocalAddressPath().string();
+    int ready[2];
+    WrapSyscall("pipe", [&]() { return pipe(ready); });
+    FLAGS_ready_fd = ready[1];
+    std::thread server([&]() {
+      char* argv[] = {const_cast<char*>(ced_bin_.c_str()),
+                      const_cast<char*>(address.c_str()), nullptr};
+      try {
+        Application::RunMode("ProjectServer", 2, argv);
+      } catch (std::exception& e) {
+        // the server failed before signalling readiness
+        Log() << "LoadGenerator server failed: " << e.what();
+        close(ready[1]);
+      }
+    });
+    const bool started = WaitForServer(ready[0], absl::Seconds(10));
+    close(ready[0]);
+
+    int status = started ? Drive(root) : 1;
+    if (!started) std::cerr << "LoadGenerator: server failed to start\n";
+
+    if (started) {
+      auto stub = ProjectService::NewStub(
+          grpc::CreateChannel(project.aspect<ProjectRoot>()->LocalAddress(),
+                              grpc::InsecureChannelCredentials()));
+      grpc::ClientContext ctx;
+      Empty req, rsp;
+      stub->Quit(&ctx, req, &rsp);
+    }
+    server.join();
+    return status;
+  }
+
+  int Drive(const boost::filesystem::path& root) {
+    const int num_clients = std::max(1, FLAGS_load_clients);
+    const int num_buffers = std::max(1, FLAGS_load_buffers);
+    Client client(ced_bin_, root);
+    Tracker tracker(num_clients);
+
+    LogTimer timer("load_generator");
+    std::vector<std::unique_ptr<SyntheticClient>> clients;
+    for (int i = 0; i < num_clients; i++) {
+      const int b = i % num_buffers;
+      const int on_buffer =
+          num_clients / num_buffers + (b < num_clients % num_buffers ? 1 : 0);
+      std::unique_ptr<Buffer> buffer =
+          client.MakeBuffer(root / BufferName(b), true);
+      if (!buffer) throw std::runtime_error("Server refused a buffer");
+      clients.emplace_back(new SyntheticClient(i, on_buffer - 1,
+                                               std::move(buffer), &tracker));
+    }
+    timer.Mark("connect");
+    for (int i = 0; i < num_clients; i++) {
+      const size_t size = boost::filesystem::file_size(
+          root / BufferName(i % num_buffers));
+      if (!clients[i]->WaitForText(size, absl::Seconds(30))) {
+        throw std::runtime_error("Buffers failed to load");
+      }
+    }
+    timer.Mark("load");
+
+    const absl::Time start = absl::Now();
+    const absl::Time deadline = start + absl::Seconds(FLAGS_load_seconds);
+    for (auto& c : clients) c->Start(deadline);
+    for (auto& c : clients) c->Join();
+    timer.Mark("workload");
+    // let what's in flight land, so the tail isn't cut off
+    const absl::Time drain_deadline = absl::Now() + absl::Seconds(5);
+    while (tracker.outstanding() != 0 && absl::Now() < drain_deadline) {
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+    timer.Mark("drain");
+    const absl::Duration elapsed = absl::Now() - start;
+
+    std::cout << "LoadGenerator: " << num_clients << " clients on "
+              << num_buffers << " buffers for "
+              << absl::FormatDuration(elapsed) << "\n";
+    tracker.Report(elapsed, std::cout);
+    clients.clear();
+    return 0;
+  }
+
+  const std::string ced_bin_;
+};
+
+REGISTER_APPLICATION(LoadGenerator);
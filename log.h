@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <unistd.h>
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <vector>
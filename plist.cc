@@ -12,82 +12,430 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "plist.h"
+#include <stdlib.h>
 #include <string.h>
-#include "src/pugixml.hpp"
+#include <algorithm>
+
 namespace plist {
 
 namespace {
 
-NodePtr ParseNode(pugi::xml_node n);
-
-NodePtr ParseDict(pugi::xml_node n) {
-  enum State { KEY, VALUE };
-  State state = KEY;
-  std::unique_ptr<Dict> d(new Dict());
-  std::string key;
-  NodePtr node;
-  for (auto c : n.children()) {
-    switch (state) {
-      case KEY:
-        if (strcmp(c.name(), "key") != 0) return nullptr;
-        key = c.child_value();
-        state = VALUE;
-        break;
-      case VALUE:
-        node = ParseNode(c);
-        if (!node) return nullptr;
-        d->AddNode(key, std::move(node));
-        state = KEY;
-        break;
+// Recursive descent over the subset of XML that plists use: a prolog
+// (declaration, doctype, comments), then elements, character data,
+// entity references, CDATA and comments. Attributes are skipped.
+class Reader {
+ public:
+  Reader(absl::string_view src, Handler* handler)
+      : src_(src), handler_(handler) {}
+
+  bool ReadDocument() {
+    if (!SkipMisc()) return false;
+    Tag plist;
+    if (!ReadStartTag(&plist) || plist.name != "plist") return false;
+    if (plist.empty) return false;
+    if (!ReadValue()) return false;
+    if (!SkipMisc() || !ReadEndTag("plist")) return false;
+    return SkipMisc() && pos_ == src_.length();
+  }
+
+ private:
+  struct Tag {
+    absl::string_view name;
+    bool empty;  // <foo/>
+  };
+
+  bool AtEnd() const { return pos_ >= src_.length(); }
+  bool LookingAt(absl::string_view s) const {
+    return src_.substr(pos_, s.length()) == s;
+  }
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+
+  void SkipSpace() {
+    while (!AtEnd() && IsSpace(src_[pos_])) pos_++;
+  }
+
+  bool SkipPast(absl::string_view terminator) {
+    size_t end = src_.find(terminator, pos_);
+    if (end == absl::string_view::npos) {
+      pos_ = src_.length();
+      return false;
     }
+    pos_ = end + terminator.length();
+    return true;
   }
-  return NodePtr(d.release());
+
+  // whitespace, comments, processing instructions and doctypes; false if
+  // one of them is left unterminated
+  bool SkipMisc() {
+    for (;;) {
+      SkipSpace();
+      if (LookingAt("<?")) {
+        if (!SkipPast("?>")) return false;
+      } else if (LookingAt("<!--")) {
+        if (!SkipPast("-->")) return false;
+      } else if (LookingAt("<!DOCTYPE")) {
+        // may carry an internal subset in [...]
+        int depth = 0;
+        for (; !AtEnd(); pos_++) {
+          char c = src_[pos_];
+          if (c == '[') depth++;
+          if (c == ']') depth--;
+          if (c == '>' && depth == 0) break;
+        }
+        if (AtEnd()) return false;
+        pos_++;
+      } else {
+        return true;
+      }
+    }
+  }
+
+  bool ReadStartTag(Tag* tag) {
+    if (!LookingAt("<")) return false;
+    pos_++;
+    tag->empty = false;
+    size_t start = pos_;
+    while (!AtEnd() && !IsSpace(src_[pos_]) && src_[pos_] != '>' &&
+           src_[pos_] != '/') {
+      pos_++;
+    }
+    tag->name = src_.substr(start, pos_ - start);
+    if (tag->name.empty()) return false;
+    // skip attributes, respecting quotes
+    char quote = 0;
+    for (; !AtEnd(); pos_++) {
+      char c = src_[pos_];
+      if (quote) {
+        if (c == quote) quote = 0;
+      } else if (c == '"' || c == '\'') {
+        quote = c;
+      } else if (c == '>') {
+        tag->empty = src_[pos_ - 1] == '/';
+        pos_++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ReadEndTag(absl::string_view name) {
+    if (!LookingAt("</")) return false;
+    pos_ += 2;
+    if (!LookingAt(name)) return false;
+    pos_ += name.length();
+    SkipSpace();
+    if (!LookingAt(">")) return false;
+    pos_++;
+    return true;
+  }
+
+  static absl::string_view Trim(absl::string_view s) {
+    while (!s.empty() && IsSpace(s.front())) s.remove_prefix(1);
+    while (!s.empty() && IsSpace(s.back())) s.remove_suffix(1);
+    return s;
+  }
+
+  static void AppendUTF8(uint32_t cp, std::string* out) {
+    if (cp < 0x80) {
+      out->push_back(cp);
+    } else if (cp < 0x800) {
+      out->push_back(0xc0 | (cp >> 6));
+      out->push_back(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+      out->push_back(0xe0 | (cp >> 12));
+      out->push_back(0x80 | ((cp >> 6) & 0x3f));
+      out->push_back(0x80 | (cp & 0x3f));
+    } else {
+      out->push_back(0xf0 | (cp >> 18));
+      out->push_back(0x80 | ((cp >> 12) & 0x3f));
+      out->push_back(0x80 | ((cp >> 6) & 0x3f));
+      out->push_back(0x80 | (cp & 0x3f));
+    }
+  }
+
+  static void Unescape(absl::string_view s, std::string* out) {
+    static const struct {
+      absl::string_view name;
+      char c;
+    } kEntities[] = {
+        {"lt", '<'}, {"gt", '>'}, {"amp", '&'}, {"quot", '"'}, {"apos", '\''},
+    };
+    while (!s.empty()) {
+      size_t amp = s.find('&');
+      out->append(s.data(), std::min(amp, s.length()));
+      if (amp == absl::string_view::npos) return;
+      s.remove_prefix(amp);
+      size_t semi = s.find(';');
+      if (semi == absl::string_view::npos) {
+        out->append(s.data(), s.length());
+        return;
+      }
+      absl::string_view ent = s.substr(1, semi - 1);
+      bool known = false;
+      if (ent.size() > 1 && ent[0] == '#') {
+        std::string num(ent.substr(1));
+        bool hex = num[0] == 'x' || num[0] == 'X';
+        char* end;
+        unsigned long cp =
+            strtoul(num.c_str() + (hex ? 1 : 0), &end, hex ? 16 : 10);
+        if (*end == 0 && cp <= 0x10ffff) {
+          AppendUTF8(cp, out);
+          known = true;
+        }
+      } else {
+        for (const auto& e : kEntities) {
+          if (e.name == ent) {
+            out->push_back(e.c);
+            known = true;
+            break;
+          }
+        }
+      }
+      // unknown references are kept verbatim
+      if (!known) out->append(s.data(), semi + 1);
+      s.remove_prefix(semi + 1);
+    }
+  }
+
+  // character data up to </name>; a view into src_ unless it needed
+  // unescaping or contained CDATA, in which case it's built in scratch_
+  bool ReadText(absl::string_view name, absl::string_view* text) {
+    const size_t start = pos_;
+    bool simple = true;
+    for (;;) {
+      size_t lt = src_.find('<', pos_);
+      if (lt == absl::string_view::npos) return false;
+      absl::string_view run = src_.substr(pos_, lt - pos_);
+      const bool cdata = src_.substr(lt, 9) == "<![CDATA[";
+      const bool comment = src_.substr(lt, 4) == "<!--";
+      if (simple &&
+          (cdata || comment || run.find('&') != absl::string_view::npos)) {
+        // everything before this run was plain text
+        simple = false;
+        scratch_.assign(src_.data() + start, pos_ - start);
+      }
+      if (!simple) Unescape(run, &scratch_);
+      pos_ = lt;
+      if (cdata) {
+        const size_t body = pos_ + 9;
+        if (!SkipPast("]]>")) return false;
+        scratch_.append(src_.data() + body, pos_ - 3 - body);
+      } else if (comment) {
+        if (!SkipPast("-->")) return false;
+      } else {
+        *text = simple ? Trim(src_.substr(start, lt - start)) : Trim(scratch_);
+        return ReadEndTag(name);
+      }
+    }
+  }
+
+  bool ReadValue() {
+    if (!SkipMisc()) return false;
+    Tag tag;
+    if (!ReadStartTag(&tag)) return false;
+    if (tag.name == "string") {
+      absl::string_view text;
+      if (!tag.empty && !ReadText("string", &text)) return false;
+      handler_->String(text);
+      return true;
+    } else if (tag.name == "array") {
+      handler_->BeginArray();
+      if (!tag.empty) {
+        for (;;) {
+          if (!SkipMisc()) return false;
+          if (LookingAt("</")) break;
+          if (!ReadValue()) return false;
+        }
+        if (!ReadEndTag("array")) return false;
+      }
+      handler_->EndArray();
+      return true;
+    } else if (tag.name == "dict") {
+      handler_->BeginDict();
+      if (!tag.empty) {
+        for (;;) {
+          if (!SkipMisc()) return false;
+          if (LookingAt("</")) break;
+          Tag key;
+          if (!ReadStartTag(&key) || key.name != "key") return false;
+          absl::string_view text;
+          if (!key.empty && !ReadText("key", &text)) return false;
+          handler_->Key(text);
+          if (!ReadValue()) return false;
+        }
+        if (!ReadEndTag("dict")) return false;
+      }
+      handler_->EndDict();
+      return true;
+    }
+    return false;
+  }
+
+  const absl::string_view src_;
+  Handler* const handler_;
+  size_t pos_ = 0;
+  std::string scratch_;
+};
+
+}  // namespace
+
+bool Read(absl::string_view src, Handler* handler) {
+  return Reader(src, handler).ReadDocument();
 }
 
-std::unique_ptr<Array> ParseArrayAsArray(pugi::xml_node n) {
-  std::unique_ptr<Array> a(new Array());
-  for (auto c : n.children()) {
-    NodePtr node = ParseNode(c);
-    if (!node) return nullptr;
-    a->AddNode(std::move(node));
+class Document::Builder final : public Handler {
+ public:
+  Builder(Document* doc, absl::string_view src) : doc_(doc), src_(src) {}
+
+  void BeginDict() override { Begin(Ref::Type::DICT); }
+  void EndDict() override { End(); }
+  void BeginArray() override { Begin(Ref::Type::ARRAY); }
+  void EndArray() override { End(); }
+  void Key(absl::string_view key) override { key_ = Keep(key); }
+  void String(absl::string_view value) override {
+    Add(Value{Ref::Type::STRING, Keep(value), 0, 0});
+  }
+
+  // index of the top level value, if there was one
+  bool root(uint32_t* idx) const {
+    if (!has_root_) return false;
+    *idx = root_;
+    return true;
+  }
+
+ private:
+  struct Pending {
+    uint32_t idx;
+    absl::string_view key;
+  };
+
+  // views outside of src_ are scratch space: copy them
+  absl::string_view Keep(absl::string_view s) {
+    if (s.empty() || (s.data() >= src_.data() &&
+                      s.data() + s.size() <= src_.data() + src_.size())) {
+      return s;
+    }
+    doc_->owned_.emplace_back(s.data(), s.size());
+    return doc_->owned_.back();
+  }
+
+  uint32_t Add(Value value) {
+    uint32_t idx = doc_->values_.size();
+    doc_->values_.push_back(value);
+    if (open_.empty()) {
+      has_root_ = true;
+      root_ = idx;
+    } else {
+      pending_.push_back(Pending{idx, key_});
+    }
+    key_ = absl::string_view();
+    return idx;
+  }
+
+  void Begin(Ref::Type type) {
+    uint32_t idx = Add(Value{type, absl::string_view(), 0, 0});
+    open_.push_back(Open{idx, pending_.size()});
+  }
+
+  // children of the closed container are the tail of pending_: move them
+  // to the document contiguously
+  void End() {
+    Open open = open_.back();
+    open_.pop_back();
+    Value& v = doc_->values_[open.idx];
+    v.first = doc_->children_.size();
+    v.count = pending_.size() - open.first_pending;
+    for (size_t i = open.first_pending; i < pending_.size(); i++) {
+      doc_->children_.push_back(pending_[i].idx);
+      doc_->keys_.push_back(pending_[i].key);
+    }
+    pending_.resize(open.first_pending);
+  }
+
+  struct Open {
+    uint32_t idx;
+    size_t first_pending;
+  };
+
+  Document* const doc_;
+  const absl::string_view src_;
+  std::vector<Open> open_;
+  std::vector<Pending> pending_;
+  absl::string_view key_;
+  bool has_root_ = false;
+  uint32_t root_ = 0;
+};
+
+Document::Document(absl::string_view src) {
+  Builder builder(this, src);
+  uint32_t root;
+  if (Read(src, &builder) && builder.root(&root)) {
+    root_ = Ref(this, root);
   }
-  return a;
 }
 
-NodePtr ParseArray(pugi::xml_node n) {
-  return NodePtr(ParseArrayAsArray(n).release());
+Document::Ref::Type Document::Ref::type() const {
+  if (!doc_) return Type::NONE;
+  return doc_->values_[idx_].type;
 }
 
-NodePtr ParseString(pugi::xml_node n) {
-  return NodePtr(new String(n.child_value()));
+absl::string_view Document::Ref::AsString() const {
+  if (!IsString()) return absl::string_view();
+  return doc_->values_[idx_].str;
 }
 
-NodePtr ParseNode(pugi::xml_node n) {
-  if (0 == strcmp(n.name(), "dict")) {
-    return ParseDict(n);
-  } else if (0 == strcmp(n.name(), "array")) {
-    return ParseArray(n);
-  } else if (0 == strcmp(n.name(), "string")) {
-    return ParseString(n);
-  } else {
-    return nullptr;
-  }
+size_t Document::Ref::size() const {
+  if (!IsArray() && !IsDict()) return 0;
+  return doc_->values_[idx_].count;
 }
 
-}  // namespace
+Document::Ref Document::Ref::operator[](size_t i) const {
+  return Ref(doc_, doc_->children_[doc_->values_[idx_].first + i]);
+}
 
-NodePtr Parse(const std::string& src) {
-  pugi::xml_document doc;
-  auto parse_result = doc.load_buffer(
-      src.data(), src.length(), pugi::parse_default | pugi::parse_trim_pcdata);
+absl::string_view Document::Ref::key(size_t i) const {
+  return doc_->keys_[doc_->values_[idx_].first + i];
+}
+
+Document::Ref Document::Ref::Get(absl::string_view key) const {
+  if (!IsDict()) return Ref();
+  const Value& v = doc_->values_[idx_];
+  for (uint32_t i = 0; i < v.count; i++) {
+    if (doc_->keys_[v.first + i] == key) {
+      return Ref(doc_, doc_->children_[v.first + i]);
+    }
+  }
+  return Ref();
+}
 
-  if (!parse_result) {
-    return nullptr;
+namespace {
+
+NodePtr ToNode(Document::Ref ref) {
+  if (ref.IsString()) {
+    return NodePtr(new String(std::string(ref.AsString())));
+  } else if (ref.IsArray()) {
+    std::unique_ptr<Array> a(new Array());
+    for (size_t i = 0; i < ref.size(); i++) a->AddNode(ToNode(ref[i]));
+    return NodePtr(a.release());
+  } else if (ref.IsDict()) {
+    std::unique_ptr<Dict> d(new Dict());
+    for (size_t i = 0; i < ref.size(); i++) {
+      d->AddNode(std::string(ref.key(i)), ToNode(ref[i]));
+    }
+    return NodePtr(d.release());
   }
+  return nullptr;
+}
+
+}  // namespace
 
-  auto top = ParseArrayAsArray(doc.child("plist"));
-  if (top->mutable_nodes()->size() != 1) return nullptr;
-  return std::move(top->mutable_nodes()->at(0));
+NodePtr Parse(const std::string& src) {
+  Document doc(src);
+  if (!doc.root()) return nullptr;
+  return ToNode(doc.root());
 }
 
 }  // namespace plist
@@ -13,10 +13,12 @@
 // limitations under the License.
 #pragma once
 
+#include <deque>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include "absl/strings/string_view.h"
 
 namespace plist {
 
@@ -113,4 +115,89 @@ class Dict final : public Node {
 NodePtr Parse(const std::string& buffer);
 NodePtr Load(const std::string& filename);
 
+// Streaming (SAX style) interface: events are delivered in document order.
+// Strings are views into the source buffer when they contain no entity
+// references or CDATA; otherwise they point at a scratch buffer that is
+// only valid until the callback returns. Character data is trimmed of
+// leading and trailing whitespace.
+class Handler {
+ public:
+  virtual ~Handler() {}
+  virtual void BeginDict() = 0;
+  virtual void EndDict() = 0;
+  virtual void BeginArray() = 0;
+  virtual void EndArray() = 0;
+  // precedes each value in a dict
+  virtual void Key(absl::string_view key) = 0;
+  virtual void String(absl::string_view value) = 0;
+};
+
+// Reads an XML plist holding exactly one dict, array or string value.
+// Returns false (having possibly delivered some events) if src is malformed.
+bool Read(absl::string_view src, Handler* handler);
+
+// Read-only tree over a parsed plist. Nodes live in flat arrays owned by
+// the Document and strings are views into the source buffer, which must
+// outlive the Document (except strings that needed unescaping, which the
+// Document owns).
+class Document {
+ public:
+  class Ref {
+   public:
+    Ref() : doc_(nullptr), idx_(0) {}
+
+    explicit operator bool() const { return doc_ != nullptr; }
+    bool IsString() const { return type() == Type::STRING; }
+    bool IsArray() const { return type() == Type::ARRAY; }
+    bool IsDict() const { return type() == Type::DICT; }
+
+    // empty for non-strings
+    absl::string_view AsString() const;
+    // number of elements (arrays) or entries (dicts)
+    size_t size() const;
+    Ref operator[](size_t i) const;
+    // key of the i'th entry of a dict
+    absl::string_view key(size_t i) const;
+    // linear scan: plist dicts are small; missing ==> null Ref
+    Ref Get(absl::string_view key) const;
+
+   private:
+    friend class Document;
+    enum class Type : uint8_t { NONE, STRING, ARRAY, DICT };
+    Ref(const Document* doc, uint32_t idx) : doc_(doc), idx_(idx) {}
+    Type type() const;
+
+    const Document* doc_;
+    uint32_t idx_;
+  };
+
+  // null root if src is malformed
+  explicit Document(absl::string_view src);
+
+  Document(const Document&) = delete;
+  Document& operator=(const Document&) = delete;
+
+  Ref root() const { return root_; }
+
+ private:
+  class Builder;
+
+  struct Value {
+    Ref::Type type;
+    // strings: the value; arrays and dicts: unused
+    absl::string_view str;
+    // arrays and dicts: [first, first + count) in children_ (and keys_)
+    uint32_t first;
+    uint32_t count;
+  };
+
+  std::vector<Value> values_;
+  std::vector<uint32_t> children_;
+  // parallel to children_; empty for array elements
+  std::vector<absl::string_view> keys_;
+  // strings that had to be unescaped (deque: stable addresses)
+  std::deque<std::string> owned_;
+  Ref root_;
+};
+
 }  // namespace plist
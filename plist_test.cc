@@ -45,3 +45,89 @@ TEST(PList, ArrayOfStrings) {
     ++expect_it;
   }
 }
+
+namespace {
+class Recorder final : public plist::Handler {
+ public:
+  void BeginDict() override { events.push_back("{"); }
+  void EndDict() override { events.push_back("}"); }
+  void BeginArray() override { events.push_back("["); }
+  void EndArray() override { events.push_back("]"); }
+  void Key(absl::string_view key) override {
+    events.push_back("k:" + std::string(key));
+  }
+  void String(absl::string_view value) override {
+    events.push_back("s:" + std::string(value));
+    views.push_back(value);
+  }
+
+  std::vector<std::string> events;
+  std::vector<absl::string_view> views;
+};
+}  // namespace
+
+TEST(PList, StreamingEvents) {
+  std::string src =
+      R"(<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple Computer//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<!-- comment -->
+<dict>
+  <key>name</key>
+  <string> plain </string>
+  <key>list</key>
+  <array>
+    <string>a &amp; b &#x41;</string>
+    <string><![CDATA[<raw>]]></string>
+    <string/>
+    <dict/>
+  </array>
+</dict>
+</plist>
+)";
+  Recorder r;
+  EXPECT_TRUE(plist::Read(src, &r));
+  EXPECT_EQ((std::vector<std::string>{"{", "k:name", "s:plain", "k:list", "[",
+                                      "s:a & b A", "s:<raw>", "s:", "{", "}",
+                                      "]", "}"}),
+            r.events);
+  // plain text is not copied
+  EXPECT_GE(r.views[0].data(), src.data());
+  EXPECT_LT(r.views[0].data(), src.data() + src.size());
+}
+
+TEST(PList, Malformed) {
+  Recorder r;
+  EXPECT_FALSE(plist::Read("<plist><dict><string>x</string></dict></plist>",
+                           &r));
+  EXPECT_FALSE(plist::Read("<plist><array><string>x</array></plist>", &r));
+  EXPECT_FALSE(plist::Read("<plist><integer>1</integer></plist>", &r));
+  EXPECT_EQ(nullptr, plist::Parse("<plist><dict></plist>"));
+}
+
+TEST(PList, Truncated) {
+  EXPECT_EQ(nullptr, plist::Parse("<?xml version=\"1.0\"?><!DOCTYPE plist"));
+  EXPECT_EQ(nullptr, plist::Parse("<!DOCTYPE plist [<!ENTITY x \"y\">"));
+  EXPECT_EQ(nullptr, plist::Parse("<plist><array><!-- x"));
+  EXPECT_EQ(nullptr, plist::Parse("<plist><string>x</string></plist><?"));
+}
+
+TEST(PList, Document) {
+  std::string src =
+      "<plist><dict>"
+      "<key>settings</key><array><string>x</string><string>y</string></array>"
+      "<key>escaped</key><string>&lt;&gt;</string>"
+      "</dict></plist>";
+  plist::Document doc(src);
+  ASSERT_TRUE(doc.root());
+  ASSERT_TRUE(doc.root().IsDict());
+  EXPECT_EQ(2, doc.root().size());
+  EXPECT_EQ("settings", doc.root().key(0));
+  auto settings = doc.root().Get("settings");
+  ASSERT_TRUE(settings.IsArray());
+  ASSERT_EQ(2, settings.size());
+  EXPECT_EQ("y", settings[1].AsString());
+  EXPECT_EQ("<>", doc.root().Get("escaped").AsString());
+  EXPECT_FALSE(doc.root().Get("missing"));
+  EXPECT_FALSE(plist::Document("<plist>").root());
+}
@@ -103,3 +103,8 @@ Project::Project(const boost::filesystem::path& root_hint, bool client_peek)
   }
   aspects_.emplace_back(new SafeBackupAspect(bottom));
 }
+
+bool Project::marked_root() const {
+  return dynamic_cast<const SafeBackupAspect*>(aspect<ProjectRoot>()) ==
+         nullptr;
+}
@@ -56,6 +56,9 @@ class Project {
       std::function<ProjectAspectPtr(Project* project)>, int priority);
 
   bool client_peek() const { return client_peek_; }
+  // whether the root was found by a project marker (a .ced file, say), not
+  // just taken to be the directory the project was opened from
+  bool marked_root() const;
 
   template <class T>
   T* aspect() {
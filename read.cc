@@ -25,9 +25,15 @@ std::string Read(const boost::filesystem::path& filename) {
       "open", [&]() { return open(filename.string().c_str(), O_RDONLY); });
   char buf[16384];
   int n;
-  do {
-    n = WrapSyscall("read", [&]() { return read(fd, buf, sizeof(buf)); });
-    out.append(buf, n);
-  } while (n == sizeof(buf));
+  try {
+    do {
+      n = WrapSyscall("read", [&]() { return read(fd, buf, sizeof(buf)); });
+      out.append(buf, n);
+    } while (n == sizeof(buf));
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
   return out;
 }
@@ -13,13 +13,25 @@
 // limitations under the License.
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <ostream>
+#include <type_traits>
 #include <vector>
 #include "layout.h"
+#include "worker_pool.h"
 
 // deferred text renderer: pass layout constraints, draw function
 // it figures out how to satisfy constraints and calls draw functions
+//
+// The renderer is retained across frames: each frame re-declares its
+// containers and items (between BeginFrame and Layout), and the position of
+// a declaration in that sequence is its stable id. The layout is only
+// re-solved when the declared tree (structure, behaviour or sizes) differs
+// from the previous frame.
 template <class Context>
 class Renderer {
  public:
@@ -42,13 +54,35 @@ class Renderer {
     lay_vec4 rect_;
   };
 
+  // Something that can be drawn into a laid out item; held by shared_ptr so
+  // that producers can hand the same object to many frames
+  class Drawable {
+   public:
+    virtual ~Drawable() {}
+    virtual void Draw(Context* context) const = 0;
+  };
+  typedef std::shared_ptr<const Drawable> DrawablePtr;
+
+  template <class F>
+  static DrawablePtr MakeDrawable(F&& f) {
+    class FnDrawable final : public Drawable {
+     public:
+      explicit FnDrawable(F&& f) : f_(std::forward<F>(f)) {}
+      void Draw(Context* context) const override { f_(context); }
+
+     private:
+      typename std::decay<F>::type f_;
+    };
+    return std::make_shared<FnDrawable>(std::forward<F>(f));
+  }
+
   class ItemRef {
    public:
     ItemRef() : renderer_(nullptr), id_(0) {}
     ItemRef(Renderer* renderer, lay_id id) : renderer_(renderer), id_(id) {}
 
     ItemRef& FixSize(lay_scalar width, lay_scalar height) {
-      lay_set_size_xy(&renderer_->ctx_, id_, width, height);
+      renderer_->FixSize(id_, width, height);
       return *this;
     }
 
@@ -68,25 +102,23 @@ class Renderer {
         : renderer_(renderer), id_(id) {}
 
     ContainerRef& FixSize(lay_scalar width, lay_scalar height) {
-      lay_set_size_xy(&renderer_->ctx_, id_, width, height);
+      renderer_->FixSize(id_, width, height);
       return *this;
     }
 
-    template <class F>
-    ItemRef AddItem(uint32_t behave, F&& draw) {
-      lay_id id = lay_item(&renderer_->ctx_);
-      lay_set_behave(&renderer_->ctx_, id, behave);
-      lay_insert(&renderer_->ctx_, id_, id);
+    ItemRef AddItem(uint32_t behave, DrawablePtr draw) {
+      lay_id id = renderer_->Declare(id_, behave, 0);
       renderer_->draw_.emplace_back(DrawCall{id, std::move(draw)});
       return ItemRef{renderer_, id};
     }
 
+    template <class F>
+    ItemRef AddItem(uint32_t behave, F&& draw) {
+      return AddItem(behave, MakeDrawable(std::forward<F>(draw)));
+    }
+
     ContainerRef AddContainer(uint32_t behave, uint32_t flags) {
-      lay_id id = lay_item(&renderer_->ctx_);
-      lay_set_behave(&renderer_->ctx_, id, behave);
-      lay_set_contain(&renderer_->ctx_, id, flags);
-      lay_insert(&renderer_->ctx_, id_, id);
-      return ContainerRef{renderer_, id};
+      return ContainerRef{renderer_, renderer_->Declare(id_, behave, flags)};
     }
 
    private:
@@ -97,28 +129,124 @@ class Renderer {
   Renderer() { lay_init_context(&ctx_); }
   ~Renderer() { lay_destroy_context(&ctx_); }
 
+  Renderer(const Renderer&) = delete;
+  Renderer& operator=(const Renderer&) = delete;
+
+  void BeginFrame() {
+    decl_.clear();
+    draw_.clear();
+  }
+
   ContainerRef AddContainer(uint32_t flags) {
-    lay_id id = lay_item(&ctx_);
-    lay_set_contain(&ctx_, id, flags);
-    return ContainerRef{this, id};
+    return ContainerRef{this, Declare(LAY_INVALID_ID, 0, flags)};
   }
 
-  void Layout() { lay_run_context(&ctx_); }
+  // returns true if the layout had to be re-solved this frame
+  bool Layout() {
+    if (solved_ && decl_ == solved_decl_) return false;
+    lay_reset_context(&ctx_);
+    for (const auto& d : decl_) {
+      lay_id id = lay_item(&ctx_);
+      lay_set_behave(&ctx_, id, d.behave);
+      lay_set_contain(&ctx_, id, d.contain);
+      lay_set_size_xy(&ctx_, id, d.width, d.height);
+      if (d.parent != LAY_INVALID_ID) lay_insert(&ctx_, d.parent, id);
+    }
+    lay_run_context(&ctx_);
+    solved_decl_.swap(decl_);
+    solved_ = true;
+    return true;
+  }
 
   void Draw(Context* ctx) {
     for (const auto& draw : draw_) {
       Rect rect(lay_get_rect(&ctx_, draw.id));
       ctx->window = &rect;
-      draw.cb(ctx);
+      draw.drawable->Draw(ctx);
+    }
+  }
+
+  // Draws items concurrently on the caller and pool's threads (just the
+  // caller if pool is null), each into its own context. Contexts are
+  // created up front on the calling thread by make_context(index, const
+  // Rect&), and once all draws finish composite(const Rect&, Context*) is
+  // called on the calling thread in declaration order, so later items still
+  // land on top. Drawables must therefore be safe to run concurrently with
+  // each other.
+  template <class MakeContext, class Composite>
+  void DrawParallel(WorkerPool* pool, MakeContext&& make_context,
+                    Composite&& composite) {
+    const size_t n = draw_.size();
+    std::vector<Rect> rects;
+    std::vector<Context> contexts;
+    rects.reserve(n);
+    contexts.reserve(n);
+    for (const auto& draw : draw_) {
+      rects.emplace_back(lay_get_rect(&ctx_, draw.id));
+    }
+    for (size_t i = 0; i < n; i++) {
+      contexts.emplace_back(make_context(i, rects[i]));
+      contexts.back().window = &rects[i];
+    }
+
+    std::atomic<size_t> next{0};
+    std::vector<std::exception_ptr> errors(n);
+    auto worker = [&]() {
+      for (size_t i; (i = next.fetch_add(1)) < n;) {
+        try {
+          draw_[i].drawable->Draw(&contexts[i]);
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      }
+    };
+    if (pool) {
+      pool->Fork(n, worker);
+    } else {
+      worker();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+      if (errors[i]) std::rethrow_exception(errors[i]);
+      composite(rects[i], &contexts[i]);
     }
   }
 
  private:
+  struct Decl {
+    lay_id parent;
+    uint32_t behave;
+    uint32_t contain;
+    lay_scalar width;
+    lay_scalar height;
+
+    bool operator==(const Decl& other) const {
+      return parent == other.parent && behave == other.behave &&
+             contain == other.contain && width == other.width &&
+             height == other.height;
+    }
+  };
+
   struct DrawCall {
     lay_id id;
-    std::function<void(Context* context)> cb;
+    DrawablePtr drawable;
   };
 
+  // items are created in declaration order after a reset, so the index of a
+  // declaration is also its lay_id
+  lay_id Declare(lay_id parent, uint32_t behave, uint32_t contain) {
+    decl_.push_back(Decl{parent, behave, contain, 0, 0});
+    return decl_.size() - 1;
+  }
+
+  void FixSize(lay_id id, lay_scalar width, lay_scalar height) {
+    decl_[id].width = width;
+    decl_[id].height = height;
+  }
+
   lay_context ctx_;
+  bool solved_ = false;
+  std::vector<Decl> decl_;
+  std::vector<Decl> solved_decl_;
   std::vector<DrawCall> draw_;
 };
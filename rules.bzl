@@ -32,3 +32,19 @@ def file2lib(name, src):
     srcs = ['%s.cc' % name],
     hdrs = ['%s.h' % name]
   )
+
+def theme2lib(name, src):
+  native.genrule(
+    name = "%s_gen" % name,
+    srcs = [src],
+    outs = ['%s.cc' % name, '%s.h' % name],
+    tools = ['//:theme2c'],
+    cmd = './$(location :theme2c) $(location %s.cc) $(location %s.h) %s $(locations %s)' % (name, name, name, src)
+  )
+
+  native.cc_library(
+    name = name,
+    srcs = ['%s.cc' % name],
+    hdrs = ['%s.h' % name],
+    deps = ['//:theme_source'],
+  )
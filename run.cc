@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "run.h"
+#include <fcntl.h>
 #include <string.h>
 #include <sys/dir.h>
 #include <sys/types.h>
@@ -142,7 +143,7 @@ RunResult run(const boost::filesystem::path& command,
 }
 
 void run_daemon(const boost::filesystem::path& command,
-                const std::vector<std::string>& args) {
+                const std::vector<std::string>& args, int inherit_fd) {
   Log() << "RUN DAEMON: "
         << absl::StrCat(command.string(), " ", absl::StrJoin(args, " "));
 
@@ -159,7 +160,14 @@ void run_daemon(const boost::filesystem::path& command,
     WrapSyscall("dup2", [&]() { return dup2(wrf, STDOUT_FILENO); });
     WrapSyscall("dup2", [&]() { return dup2(wrf, STDERR_FILENO); });
 #endif
-    CloseFDsAfter(STDERR_FILENO);
+    if (inherit_fd == kDaemonInheritedFd) {
+      // dup2 onto itself would leave close-on-exec set
+      WrapSyscall("fcntl", [&]() { return fcntl(inherit_fd, F_SETFD, 0); });
+    } else if (inherit_fd >= 0) {
+      WrapSyscall("dup2",
+                  [&]() { return dup2(inherit_fd, kDaemonInheritedFd); });
+    }
+    CloseFDsAfter(inherit_fd >= 0 ? kDaemonInheritedFd : STDERR_FILENO);
     execvp(cargs[0], cargs.data());
     abort();
   }
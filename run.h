@@ -26,5 +26,10 @@ struct RunResult {
 RunResult run(const boost::filesystem::path& command,
               const std::vector<std::string>& args, const std::string& input);
 
+// the descriptor a daemon's inherited fd is handed to it as
+constexpr int kDaemonInheritedFd = 3;
+
+// If inherit_fd is set, the daemon gets it as kDaemonInheritedFd (and no
+// other descriptors besides stdio)
 void run_daemon(const boost::filesystem::path& command,
-                const std::vector<std::string>& args);
+                const std::vector<std::string>& args, int inherit_fd = -1);
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "selector.h"
+#include <algorithm>
 
 bool selector_detail::RuleMatches(const std::string& selector,
                                   const std::string& token) {
@@ -19,3 +20,55 @@ bool selector_detail::RuleMatches(const std::string& selector,
          std::mismatch(selector.begin(), selector.end(), token.begin()).first ==
              selector.end();
 }
+
+void SelectorTrie::Add(const Selector& selector, uint32_t value) {
+  uint32_t node = 0;
+  for (auto rule = selector.rbegin(); rule != selector.rend(); ++rule) {
+    auto it = nodes_[node].children.find(*rule);
+    if (it != nodes_[node].children.end()) {
+      node = it->second;
+      continue;
+    }
+    uint32_t child = nodes_.size();
+    nodes_.emplace_back();
+    Node& parent = nodes_[node];
+    parent.children.emplace(*rule, child);
+    auto len = std::lower_bound(parent.rule_lengths.begin(),
+                                parent.rule_lengths.end(), rule->length());
+    if (len == parent.rule_lengths.end() || *len != rule->length()) {
+      parent.rule_lengths.insert(len, rule->length());
+    }
+    node = child;
+  }
+  nodes_[node].values.push_back(value);
+}
+
+std::vector<uint32_t> SelectorTrie::Match(
+    const std::vector<std::string>& tag) const {
+  // a selector may skip tag elements, so every node reached stays live
+  std::vector<uint32_t> live{0};
+  std::vector<bool> reached(nodes_.size(), false);
+  reached[0] = true;
+  std::vector<uint32_t> out(nodes_[0].values);
+  std::string prefix;
+  for (auto element = tag.rbegin(); element != tag.rend(); ++element) {
+    // nodes reached through this element can't consume it again
+    const size_t num_live = live.size();
+    for (size_t i = 0; i < num_live; i++) {
+      const Node& node = nodes_[live[i]];
+      for (size_t len : node.rule_lengths) {
+        if (len > element->length()) break;
+        prefix.assign(*element, 0, len);
+        auto it = node.children.find(prefix);
+        if (it == node.children.end() || reached[it->second]) continue;
+        reached[it->second] = true;
+        live.push_back(it->second);
+        const auto& values = nodes_[it->second].values;
+        out.insert(out.end(), values.begin(), values.end());
+      }
+    }
+  }
+  std::sort(out.begin(), out.end());
+  out.erase(std::unique(out.begin(), out.end()), out.end());
+  return out;
+}
@@ -15,6 +15,8 @@
 
 #include <stdint.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace selector_detail {
 
@@ -36,3 +38,29 @@ bool SelectorMatches(const TSel& selector, const TTag& tag) {
   return selector_detail::SelectorMatches(selector.begin(), selector.end(),
                                           tag.begin(), tag.end());
 }
+
+// A set of selectors compiled into a trie over their rules, last rule first
+// (the order SelectorMatches consumes them in). Matching a tag path visits
+// each tag element once per live trie node, rather than running every
+// selector against the path; results agree with SelectorMatches.
+class SelectorTrie {
+ public:
+  typedef std::vector<std::string> Selector;
+
+  // value is reported by Match for tags matched by selector
+  void Add(const Selector& selector, uint32_t value);
+
+  // sorted, de-duplicated values of all selectors matching tag
+  std::vector<uint32_t> Match(const std::vector<std::string>& tag) const;
+
+ private:
+  struct Node {
+    std::unordered_map<std::string, uint32_t> children;
+    // distinct lengths of the keys in children, ascending: a tag element can
+    // only match a child through its prefix of one of these lengths
+    std::vector<size_t> rule_lengths;
+    std::vector<uint32_t> values;
+  };
+
+  std::vector<Node> nodes_{Node()};
+};
@@ -0,0 +1,55 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "selector.h"
+#include <gtest/gtest.h>
+
+typedef std::vector<std::string> Strings;
+
+TEST(SelectorTrie, AgreesWithSelectorMatches) {
+  const std::vector<Strings> selectors = {
+      {},
+      {"comment"},
+      {"comment.line"},
+      {"source", "comment"},
+      {"meta.function", "entity.name"},
+      {"meta", "meta", "string"},
+      {"str"},
+  };
+  const std::vector<Strings> tags = {
+      {},
+      {"comment.line.double-slash"},
+      {"source.cc", "comment.block"},
+      {"source.cc", "meta.function.cc", "entity.name.function"},
+      {"meta.a", "string.quoted"},
+      {"meta.a", "meta.b", "string.quoted"},
+      {"entity.name", "meta.function"},
+  };
+  SelectorTrie trie;
+  for (size_t i = 0; i < selectors.size(); i++) trie.Add(selectors[i], i);
+  for (const auto& tag : tags) {
+    std::vector<uint32_t> expect;
+    for (size_t i = 0; i < selectors.size(); i++) {
+      if (SelectorMatches(selectors[i], tag)) expect.push_back(i);
+    }
+    EXPECT_EQ(expect, trie.Match(tag));
+  }
+}
+
+TEST(SelectorTrie, DuplicateValuesReportedOnce) {
+  SelectorTrie trie;
+  trie.Add({"comment"}, 3);
+  trie.Add({"comment.line"}, 3);
+  EXPECT_EQ(std::vector<uint32_t>{3}, trie.Match({"comment.line"}));
+  EXPECT_EQ(std::vector<uint32_t>{}, trie.Match({"string"}));
+}
@@ -15,38 +15,140 @@
 #include <grpc++/security/server_credentials.h>
 #include <grpc++/server.h>
 #include <grpc++/server_builder.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <thread>
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_split.h"
 #include "absl/synchronization/mutex.h"
 #include "application.h"
 #include "buffer.h"
+#include "buffer_snapshot.h"
+#include "command_batcher.h"
+#include "line_index.h"
 #include "log.h"
 #include "proto/project_service.grpc.pb.h"
+#include "read.h"
 #include "run.h"
+#include "shm_transport.h"
 #include "src_hash.h"
+#include "viewport_filter.h"
+#include "worker_pool.h"
+#include "wrap_syscall.h"
 
-class ProjectServer : public Application, public ProjectService::Service {
+DEFINE_int32(server_threads, 2,
+             "Threads polling the server's completion queues (each gets its "
+             "own queue)");
+DEFINE_int32(server_workers, 8,
+             "Threads running the requests too slow for a poller: unary "
+             "calls, and the greetings that open edit sessions");
+DEFINE_string(listen_tcp, "",
+              "Also accept connections at this host:port, for editors "
+              "running on other machines (see the client's -server). Needs "
+              "-tcp_token_file; loopback only without -listen_tcp_remote");
+DEFINE_bool(listen_tcp_remote, false,
+            "Let -listen_tcp bind other than a loopback address. Edits "
+            "travel unencrypted: prefer tunnelling to a loopback port");
+DEFINE_string(tcp_token_file, "",
+              "File holding a secret that connections over TCP must "
+              "present: the server's with -listen_tcp, the client's with "
+              "-server");
+DEFINE_bool(daemon, false,
+            "Serve every project of this user from one server, sharing "
+            "libclang and tool discovery between them");
+DEFINE_int32(ready_fd, -1,
+             "Descriptor to write a byte to (and close) once the server is "
+             "accepting connections");
+
+namespace {
+
+// Every completion queue tag is one of these: run on a polling thread with
+// whether the operation succeeded
+typedef std::function<void(bool ok)> CqTag;
+
+}  // namespace
+
+class ProjectServer : public Application {
  public:
   ProjectServer(int argc, char** argv)
-      : project_(PathFromArgs(argc, argv), false),
+      : address_path_(PathFromArgs(argc, argv)),
         active_requests_(0),
         last_activity_(absl::Now()),
         quit_requested_(false) {
-    if (PathFromArgs(argc, argv) !=
-        project_.aspect<ProjectRoot>()->LocalAddressPath()) {
-      throw std::runtime_error(absl::StrCat(
-          "Project path misalignment: ", PathFromArgs(argc, argv).string(), " ",
-          project_.aspect<ProjectRoot>()->LocalAddressPath().string()));
+    if (FLAGS_daemon) {
+      if (address_path_ != DaemonAddressPath()) {
+        throw std::runtime_error(
+            absl::StrCat("Daemon path misalignment: ", address_path_.string(),
+                         " ", DaemonAddressPath().string()));
+      }
+    } else {
+      Project* project = AttachProject(address_path_);
+      if (address_path_ != project->aspect<ProjectRoot>()->LocalAddressPath()) {
+        throw std::runtime_error(absl::StrCat(
+            "Project path misalignment: ", address_path_.string(), " ",
+            project->aspect<ProjectRoot>()->LocalAddressPath().string()));
+      }
     }
 
-    server_ =
-        grpc::ServerBuilder()
-            .RegisterService(this)
-            .AddListeningPort(project_.aspect<ProjectRoot>()->LocalAddress(),
-                              grpc::InsecureServerCredentials())
-            .BuildAndStart();
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&service_).AddListeningPort(
+        absl::StrCat("unix:", address_path_.string()),
+        grpc::InsecureServerCredentials());
+    builder.SetMaxReceiveMessageSize(kMaxMessageBytes);
+    builder.SetMaxSendMessageSize(kMaxMessageBytes);
+    if (!FLAGS_listen_tcp.empty()) {
+      if (!FLAGS_listen_tcp_remote && !IsLoopback(FLAGS_listen_tcp)) {
+        throw std::runtime_error(absl::StrCat(
+            "Refusing to listen at ", FLAGS_listen_tcp,
+            ", which is not a loopback address, without -listen_tcp_remote"));
+      }
+      tcp_token_ = ReadTcpToken();
+      builder.AddListeningPort(FLAGS_listen_tcp,
+                               grpc::InsecureServerCredentials());
+      // remote clients keep their idle edit streams alive with pings
+      builder.AddChannelArgument(
+          GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+          kRemoteKeepalivePingMs / 2);
+    }
+    for (int i = 0; i < std::max(1, FLAGS_server_threads); i++) {
+      cqs_.emplace_back(builder.AddCompletionQueue());
+    }
+    server_ = builder.BuildAndStart();
+
+    for (auto& cq : cqs_) {
+      new UnaryCall<ConnectionHelloRequest, ConnectionHelloResponse>(
+          this, cq.get(), &ProjectService::AsyncService::RequestConnectionHello,
+          &ProjectServer::ConnectionHello);
+      new UnaryCall<Empty, Empty>(this, cq.get(),
+                                  &ProjectService::AsyncService::RequestQuit,
+                                  &ProjectServer::Quit);
+      new UnaryCall<Empty, ServerStats>(
+          this, cq.get(), &ProjectService::AsyncService::RequestGetStats,
+          &ProjectServer::GetStats);
+      new EditCall(this, cq.get());
+    }
+    for (auto& cq : cqs_) {
+      pollers_.emplace_back([this, cq = cq.get()]() { Poll(cq); });
+    }
+    SignalReady();
 
     Log() << "Created server " << server_.get() << " @ "
-          << project_.aspect<ProjectRoot>()->LocalAddress();
+          << address_path_ << (FLAGS_daemon ? " (daemon)" : "")
+          << (FLAGS_listen_tcp.empty() ? "" : " and ") << FLAGS_listen_tcp
+          << " with " << cqs_.size() << " polling threads";
   }
 
   int Run() override {
@@ -63,78 +165,260 @@ class ProjectServer : public Application, public ProjectService::Service {
         ;
     }
     server_->Shutdown();
+    // outstanding call requests now complete (not ok) and free themselves
+    for (auto& cq : cqs_) cq->Shutdown();
+    for (auto& t : pollers_) t.join();
     return 0;
   }
 
-  grpc::Status ConnectionHello(grpc::ServerContext* context,
-                               const ConnectionHelloRequest* req,
-                               ConnectionHelloResponse* rsp) override {
+ private:
+  // lets the client that spawned us connect without polling for the socket
+  static void SignalReady() {
+    if (FLAGS_ready_fd < 0) return;
+    try {
+      // gRPC ignores SIGPIPE, so a client that gave up just fails the write
+      char ready = 1;
+      WrapSyscall("write", [&]() { return write(FLAGS_ready_fd, &ready, 1); });
+    } catch (std::exception& e) {
+      Log() << "Signalling readiness: " << e.what();
+    }
+    close(FLAGS_ready_fd);
+  }
+
+  void Poll(grpc::ServerCompletionQueue* cq) {
+    void* tag;
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+      const absl::Time start = absl::Now();
+      // handlers that can fail catch their own exceptions and end their
+      // call: this only keeps the poller alive
+      try {
+        (*static_cast<CqTag*>(tag))(ok);
+      } catch (std::exception& e) {
+        Log() << "Completion handler failed: " << e.what();
+      }
+      poll_busy_ns_ += absl::ToInt64Nanoseconds(absl::Now() - start);
+    }
+  }
+
+  grpc::Status ConnectionHello(const grpc::ServerContext& ctx,
+                               const ConnectionHelloRequest& req,
+                               ConnectionHelloResponse* rsp) {
     rsp->set_src_hash(ced_src_hash);
+    rsp->set_shm_transport(FLAGS_shm_transport && IsLocalPeer(ctx));
+    // a per project server serves its own project regardless; a daemon only
+    // attaches projects for peers on its own (per user) socket
+    if (FLAGS_daemon && !req.project_root().empty() && IsLocalPeer(ctx)) {
+      try {
+        AttachProject(req.project_root(), true);
+      } catch (std::exception& e) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, e.what());
+      }
+    }
     return grpc::Status::OK;
   }
 
-  grpc::Status Quit(grpc::ServerContext* context, const Empty* req,
-                    Empty* rsp) override {
+  grpc::Status Quit(const grpc::ServerContext& ctx, const Empty& req,
+                    Empty* rsp) {
     absl::MutexLock lock(&mu_);
     quit_requested_ = true;
     return grpc::Status::OK;
   }
 
-  grpc::Status Edit(
-      grpc::ServerContext* context,
-      grpc::ServerReaderWriter<EditMessage, EditMessage>* stream) override {
-    ScopedRequest scoped_request(this);
-    EditMessage msg;
-    if (!stream->Read(&msg)) {
-      return grpc::Status(grpc::INVALID_ARGUMENT,
-                          "Stream closed with no greeting");
-    }
-    if (msg.type_case() != EditMessage::kClientHello) {
-      return grpc::Status(grpc::INVALID_ARGUMENT,
-                          "First message from client must be ClientHello");
-    }
-    Buffer* buffer = GetBuffer(msg.client_hello().buffer_name());
-    if (!buffer) {
-      return grpc::Status(grpc::INVALID_ARGUMENT,
-                          "Unable to access requested buffer");
-    }
-    Site site;
-    auto listener = buffer->Listen(
-        [stream, &site](const AnnotatedString& initial) {
-          EditMessage out;
-          auto body = out.mutable_server_hello();
-          body->set_site_id(site.site_id());
-          *body->mutable_current_state() = initial.AsProto();
-          stream->Write(out);
-        },
-        [stream](const CommandSet* commands) {
-          EditMessage out;
-          *out.mutable_commands() = *commands;
-          stream->Write(out);
-        });
-    while (stream->Read(&msg)) {
-      if (msg.type_case() != EditMessage::kCommands) {
-        return grpc::Status(grpc::INVALID_ARGUMENT,
-                            "Expected commands after greetings");
+  grpc::Status GetStats(const grpc::ServerContext& ctx, const Empty& req,
+                        ServerStats* rsp) {
+    rsp->set_src_hash(ced_src_hash);
+    std::vector<const Buffer*> buffers;
+    {
+      absl::MutexLock lock(&mu_);
+      rsp->set_active_requests(active_requests_);
+      for (const auto& p : projects_) rsp->add_projects(p.first.string());
+      for (const auto& b : buffers_) buffers.push_back(b.second.buffer.get());
+      for (EditCall* session : sessions_) {
+        session->GetStats(rsp->add_sessions());
       }
-      buffer->PushChanges(&msg.commands(), true);
     }
-    CommandSet cleanup_commands;
-    buffer->ContentSnapshot().MakeDeleteAttributesBySite(&cleanup_commands,
-                                                         site);
-    buffer->PushChanges(&msg.commands(), false);
+    // buffers stay open until the server quits: they're measured unlocked
+    for (const Buffer* buffer : buffers) {
+      GetBufferStats(buffer, rsp->add_buffers());
+    }
+    const absl::Duration uptime = absl::Now() - started_;
+    rsp->set_uptime_seconds(absl::ToDoubleSeconds(uptime));
+    rsp->set_polling_threads(pollers_.size());
+    rsp->set_polling_utilization(
+        absl::ToDoubleSeconds(absl::Nanoseconds(poll_busy_ns_.load())) /
+        (absl::ToDoubleSeconds(uptime) * pollers_.size()));
+    GetProcessStats(rsp);
     return grpc::Status::OK;
   }
 
- private:
-  Project project_;
+  static void GetBufferStats(const Buffer* buffer, BufferStats* out) {
+    out->set_filename(buffer->filename().string());
+    const Buffer::Stats stats = buffer->GetStats();
+    out->set_version(stats.version);
+    out->set_logged_commands(stats.logged_commands);
+    out->set_listeners(stats.listeners);
+    for (const auto& c : stats.collaborators) {
+      auto* collaborator = out->add_collaborators();
+      collaborator->set_name(c.first);
+      for (uint64_t n : c.second) collaborator->add_latency_ms_log2_buckets(n);
+    }
+    // walks the whole string, so kept off the buffer's lock
+    const AnnotatedString::Stats content =
+        buffer->ContentSnapshot().GetStats();
+    out->set_chars(content.chars);
+    out->set_tombstones(content.tombstones);
+    out->set_attributes(content.attributes);
+    out->set_graveyard(content.graveyard);
+    for (const auto& by_type : content.annotations_by_type) {
+      const auto* field =
+          Attribute::descriptor()->FindFieldByNumber(by_type.first);
+      (*out->mutable_annotations_by_type())[field ? field->name() : "?"] =
+          by_type.second;
+    }
+  }
+
+  // from /proc, where there is one
+  static void GetProcessStats(ServerStats* out) {
+    std::string status;
+    try {
+      status = Read("/proc/self/status");
+    } catch (std::exception& e) {
+      return;
+    }
+    for (absl::string_view line : absl::StrSplit(status, '\n')) {
+      std::vector<absl::string_view> fields =
+          absl::StrSplit(line, absl::ByAnyChar(" \t"), absl::SkipEmpty());
+      uint64_t value;
+      if (fields.size() < 2 || !absl::SimpleAtoi(fields[1], &value)) continue;
+      if (fields[0] == "Threads:") {
+        out->set_process_threads(value);
+      } else if (fields[0] == "VmRSS:") {
+        out->set_rss_bytes(value * 1024);
+      }
+    }
+  }
+
+  // The project rooted at or above hint, made on first use. Only attached
+  // projects' files can be opened.
+  // from_client: the hint is a client's, so whatever root it finds becomes a
+  // sandbox; it must be a real project, and not one spanning whole trees
+  Project* AttachProject(const boost::filesystem::path& hint,
+                         bool from_client = false) LOCKS_EXCLUDED(mu_) {
+    {
+      absl::MutexLock lock(&mu_);
+      auto it = projects_.find(hint);
+      if (it != projects_.end()) return it->second.get();
+    }
+    // made unlocked: aspects may read configuration or load libraries
+    std::unique_ptr<Project> project(new Project(hint, false));
+    const boost::filesystem::path root =
+        project->aspect<ProjectRoot>()->Path();
+    if (from_client) {
+      if (!project->marked_root()) {
+        throw std::runtime_error(absl::StrCat(
+            "No project marker (.ced or WORKSPACE) at or above ",
+            hint.string()));
+      }
+      if (IsTooBroadRoot(root)) {
+        throw std::runtime_error(
+            absl::StrCat("Refusing to serve ", root.string(), " as a project"));
+      }
+    }
+    absl::MutexLock lock(&mu_);
+    std::unique_ptr<Project>& attached = projects_[root];
+    if (!attached) {
+      Log() << "Serving project " << root;
+      attached = std::move(project);
+    }
+    return attached.get();
+  }
+
+  // the innermost attached project holding path
+  Project* ProjectFor(const boost::filesystem::path& path) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    Project* found = nullptr;
+    size_t found_length = 0;
+    for (const auto& p : projects_) {
+      const std::string root = p.first.string();
+      if (IsChildOf(path, p.first) && root.length() >= found_length) {
+        found = p.second.get();
+        found_length = root.length();
+      }
+    }
+    return found;
+  }
+
+  const boost::filesystem::path address_path_;
+  ProjectService::AsyncService service_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
   std::unique_ptr<grpc::Server> server_;
+  std::vector<std::thread> pollers_;
+  // after the queues: finishes its work before they go
+  WorkerPool workers_{FLAGS_server_workers};
+  const absl::Time started_ = absl::Now();
+  // time the pollers have spent in completion handlers
+  std::atomic<int64_t> poll_busy_ns_{0};
 
   absl::Mutex mu_;
   int active_requests_ GUARDED_BY(mu_);
   absl::Time last_activity_ GUARDED_BY(mu_);
-  std::map<boost::filesystem::path, std::unique_ptr<Buffer>> buffers_
+  // The snapshot last encoded for a buffer's ServerHellos: sessions that
+  // open the buffer at the same version share one encoding
+  class HelloSnapshot {
+   public:
+    struct Encoded {
+      // the snapshot less its annotations, serialized: sessions send it as
+      // it is
+      std::string state;
+      // only the annotations, which each session filters to its viewport
+      AnnotatedStringMsg annotations;
+    };
+
+    std::shared_ptr<const Encoded> Get(const AnnotatedString& content)
+        LOCKS_EXCLUDED(mu_) {
+      // encoded under mu_, so sessions arriving together wait for one
+      // encoding rather than each making their own
+      absl::MutexLock lock(&mu_);
+      if (!encoded_ || !content.SameTotalIdentity(content_)) {
+        content_ = content;
+        AnnotatedStringMsg msg = content.AsProto();
+        auto encoded = std::make_shared<Encoded>();
+        encoded->annotations.mutable_annotations()->Swap(
+            msg.mutable_annotations());
+        msg.SerializeToString(&encoded->state);
+        encoded_ = std::move(encoded);
+      }
+      return encoded_;
+    }
+
+   private:
+    absl::Mutex mu_;
+    AnnotatedString content_ GUARDED_BY(mu_);
+    std::shared_ptr<const Encoded> encoded_ GUARDED_BY(mu_);
+  };
+
+  struct OpenBuffer {
+    std::unique_ptr<Buffer> buffer;
+    // must be reset before buffer
+    std::unique_ptr<LineIndex> lines;
+    std::unique_ptr<HelloSnapshot> hello_snapshot;
+  };
+  // by root; outlive the buffers in them
+  std::map<boost::filesystem::path, std::unique_ptr<Project>> projects_
       GUARDED_BY(mu_);
+  std::map<boost::filesystem::path, OpenBuffer> buffers_ GUARDED_BY(mu_);
+  class EditCall;
+  // every edit session past its greeting
+  std::set<EditCall*> sessions_ GUARDED_BY(mu_);
+  // every site issued to an edit session, and the session that holds it
+  // now (null once it ends): a dropped session only cleans up after its
+  // site if no resumed one has taken it over
+  std::map<uint16_t, EditCall*> site_owners_ GUARDED_BY(mu_);
+  // identifies this process to clients resuming sessions
+  const uint64_t incarnation_ = NewIncarnation();
+  // set with -listen_tcp
+  std::string tcp_token_;
   bool quit_requested_ GUARDED_BY(mu_);
 
   static bool IsChildOf(boost::filesystem::path needle,
@@ -155,23 +439,107 @@ class ProjectServer : public Application, public ProjectService::Service {
                       needle_str.begin());
   }
 
-  Buffer* GetBuffer(boost::filesystem::path path) {
+  static bool IsTooBroadRoot(const boost::filesystem::path& root) {
+    boost::system::error_code ec;
+    const boost::filesystem::path canonical =
+        boost::filesystem::canonical(root, ec);
+    if (ec) return true;
+    if (canonical == canonical.root_path()) return true;
+    const char* home = getenv("HOME");
+    if (home == nullptr) return false;
+    const boost::filesystem::path home_canonical =
+        boost::filesystem::canonical(home, ec);
+    return !ec && canonical == home_canonical;
+  }
+
+  // peers on the server's unix socket: the rest come over -listen_tcp
+  static bool IsLocalPeer(const grpc::ServerContext& ctx) {
+    return absl::StartsWith(ctx.peer(), "unix:");
+  }
+
+  static bool IsLoopback(const std::string& host_port) {
+    for (const char* host : {"localhost:", "127.", "[::1]:"}) {
+      if (absl::StartsWith(host_port, host)) return true;
+    }
+    return false;
+  }
+
+  // TCP peers must present -tcp_token_file's secret
+  grpc::Status Authenticate(const grpc::ServerContext& ctx) const {
+    if (IsLocalPeer(ctx)) return grpc::Status::OK;
+    auto token = ctx.client_metadata().find(kTcpTokenMetadataKey);
+    if (tcp_token_.empty() || token == ctx.client_metadata().end() ||
+        !ConstantTimeEquals(token->second, tcp_token_)) {
+      return grpc::Status(grpc::UNAUTHENTICATED, "Bad or missing token");
+    }
+    return grpc::Status::OK;
+  }
+
+  static bool ConstantTimeEquals(grpc::string_ref a, const std::string& b) {
+    if (a.size() != b.size()) return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < b.size(); i++) diff |= a.data()[i] ^ b[i];
+    return diff == 0;
+  }
+
+  static uint64_t NewIncarnation() {
+    std::random_device rd;
+    return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+  }
+
+  bool SiteIssued(uint16_t site) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    return site_owners_.count(site) != 0;
+  }
+
+  void ClaimSite(uint16_t site, EditCall* call) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    site_owners_[site] = call;
+  }
+
+  // true if call held site, which it now gives up
+  bool ReleaseSite(uint16_t site, EditCall* call) LOCKS_EXCLUDED(mu_) {
+    absl::MutexLock lock(&mu_);
+    auto it = site_owners_.find(site);
+    if (it == site_owners_.end() || it->second != call) return false;
+    it->second = nullptr;
+    return true;
+  }
+
+  OpenBuffer* GetBuffer(boost::filesystem::path path) {
     path = boost::filesystem::absolute(path);
-    if (!IsChildOf(path, project_.aspect<ProjectRoot>()->Path())) {
-      Log() << "Attempt to access outside of project sandbox: " << path
-            << " in project root " << project_.aspect<ProjectRoot>()->Path();
+    Project* project = ProjectFor(path);
+    if (project == nullptr) {
+      Log() << "Attempt to access outside of every project sandbox: " << path;
       return nullptr;
     }
+    {
+      absl::MutexLock lock(&mu_);
+      auto it = buffers_.find(path);
+      if (it != buffers_.end()) {
+        return &it->second;
+      }
+    }
+    // loaded unlocked, so opening a big buffer doesn't hold up other calls
+    absl::optional<BufferSnapshot::Restored> restored =
+        BufferSnapshot::Load(project, path);
     absl::MutexLock lock(&mu_);
     auto it = buffers_.find(path);
     if (it != buffers_.end()) {
-      return it->second.get();
+      return &it->second;
+    }
+    OpenBuffer* open = &buffers_[path];
+    Buffer::Builder builder;
+    builder.SetFilename(path).SetProject(project);
+    if (restored) {
+      builder.SetInitialString(restored->content)
+          .SetRestoredSites(restored->sites);
     }
-    return buffers_
-        .emplace(
-            path,
-            Buffer::Builder().SetFilename(path).SetProject(&project_).Make())
-        .first->second.get();
+    open->buffer = builder.Make();
+    // ahead of every session's listener, so their filters see it updated
+    open->lines.reset(new LineIndex(open->buffer.get()));
+    open->hello_snapshot.reset(new HelloSnapshot);
+    return open;
   }
 
   class ScopedRequest {
@@ -192,6 +560,475 @@ class ProjectServer : public Application, public ProjectService::Service {
     ProjectServer* const p_;
   };
 
+  // A unary call, answered by handler on the server's workers: attaching a
+  // project reads configuration and loads libraries, which shouldn't stall
+  // a poller. Callers are authenticated first, on the poller. Each accepted
+  // call requests the next one on the same queue.
+  template <class Request, class Response>
+  class UnaryCall {
+   public:
+    typedef void (ProjectService::AsyncService::*RequestFn)(
+        grpc::ServerContext*, Request*,
+        grpc::ServerAsyncResponseWriter<Response>*, grpc::CompletionQueue*,
+        grpc::ServerCompletionQueue*, void*);
+    typedef grpc::Status (ProjectServer::*HandlerFn)(
+        const grpc::ServerContext& ctx, const Request&, Response*);
+
+    UnaryCall(ProjectServer* server, grpc::ServerCompletionQueue* cq,
+              RequestFn request_fn, HandlerFn handler)
+        : server_(server),
+          cq_(cq),
+          request_fn_(request_fn),
+          handler_(handler),
+          responder_(&ctx_) {
+      on_request_ = [this](bool ok) {
+        if (!ok) {
+          delete this;
+          return;
+        }
+        new UnaryCall(server_, cq_, request_fn_, handler_);
+        scoped_request_.reset(new ScopedRequest(server_));
+        grpc::Status auth = server_->Authenticate(ctx_);
+        if (!auth.ok()) {
+          responder_.Finish(response_, auth, &on_finish_);
+          return;
+        }
+        server_->workers_.Run([this]() {
+          grpc::Status status;
+          try {
+            status = (server_->*handler_)(ctx_, request_, &response_);
+          } catch (std::exception& e) {
+            status = grpc::Status(grpc::StatusCode::INTERNAL, e.what());
+          }
+          responder_.Finish(response_, status, &on_finish_);
+        });
+      };
+      on_finish_ = [this](bool) { delete this; };
+      (server_->service_.*request_fn_)(&ctx_, &request_, &responder_, cq_,
+                                       cq_, &on_request_);
+    }
+
+   private:
+    ProjectServer* const server_;
+    grpc::ServerCompletionQueue* const cq_;
+    const RequestFn request_fn_;
+    const HandlerFn handler_;
+    grpc::ServerContext ctx_;
+    Request request_;
+    Response response_;
+    grpc::ServerAsyncResponseWriter<Response> responder_;
+    CqTag on_request_;
+    CqTag on_finish_;
+    std::unique_ptr<ScopedRequest> scoped_request_;
+  };
+
+  // One Edit stream. Reads and writes are completion queue operations, so an
+  // idle stream holds no thread and listener updates never block on the
+  // network: they queue, coalescing behind any write in flight. Shared
+  // memory sessions, whose rings block, keep a reader thread of their own.
+  class EditCall {
+   public:
+    EditCall(ProjectServer* server, grpc::ServerCompletionQueue* cq)
+        : server_(server), cq_(cq), stream_(&ctx_) {
+      on_request_ = [this](bool ok) { Accepted(ok); };
+      // opening a buffer may load its snapshot from disk: greetings are
+      // handled on the server's workers
+      on_hello_ = [this](bool ok) {
+        server_->workers_.Run(
+            [this, ok]() { Guarded([this, ok]() { ReadHello(ok); }); });
+      };
+      on_read_ = [this](bool ok) { Guarded([this, ok]() { ReadDone(ok); }); };
+      on_write_ = [this](bool ok) { WriteDone(ok); };
+      on_finish_ = [this](bool) { delete this; };
+      server_->service_.RequestEdit(&ctx_, &stream_, cq_, cq_, &on_request_);
+    }
+
+    ~EditCall() {
+      if (!registered_) return;
+      absl::MutexLock lock(&server_->mu_);
+      server_->sessions_.erase(this);
+    }
+
+    // called with the server's mu_ held, which keeps the session alive
+    void GetStats(SessionStats* out) LOCKS_EXCLUDED(mu_) {
+      out->set_buffer(buffer_->filename().string());
+      out->set_peer(ctx_.peer());
+      out->set_site_id(site_->site_id());
+      out->set_shm(shm_ != nullptr);
+      absl::MutexLock lock(&mu_);
+      out->set_queued_messages(queued_.size());
+      out->set_pending_commands(pending_commands_.commands_size() +
+                                before_hello_.commands_size());
+      out->set_write_in_flight(write_in_flight_);
+    }
+
+   private:
+    void Accepted(bool ok) {
+      if (!ok) {
+        delete this;
+        return;
+      }
+      new EditCall(server_, cq_);
+      scoped_request_.reset(new ScopedRequest(server_));
+      // before anything of the peer's is read, let alone acted on
+      grpc::Status auth = server_->Authenticate(ctx_);
+      if (!auth.ok()) return FinishWith(auth);
+      stream_.Read(&in_, &on_hello_);
+    }
+
+    // Runs a completion handler, which leaves no read outstanding if it
+    // throws: the session then ends, rather than leaking along with the
+    // ScopedRequest that keeps the server from exiting
+    void Guarded(const std::function<void()>& handler) {
+      grpc::Status status;
+      try {
+        handler();
+        return;
+      } catch (std::exception& e) {
+        Log() << "Edit session failed: " << e.what();
+        status = grpc::Status(grpc::StatusCode::INTERNAL, e.what());
+      }
+      try {
+        EndSession(status);
+      } catch (std::exception& e) {
+        Log() << "Ending failed edit session: " << e.what();
+        FinishWith(status);
+      }
+    }
+
+    void ReadHello(bool ok) {
+      if (!ok) {
+        return FinishWith(grpc::Status(grpc::INVALID_ARGUMENT,
+                                       "Stream closed with no greeting"));
+      }
+      if (in_.type_case() != EditMessage::kClientHello) {
+        return FinishWith(
+            grpc::Status(grpc::INVALID_ARGUMENT,
+                         "First message from client must be ClientHello"));
+      }
+      const auto& hello = in_.client_hello();
+      OpenBuffer* open = server_->GetBuffer(hello.buffer_name());
+      if (!open) {
+        return FinishWith(grpc::Status(grpc::INVALID_ARGUMENT,
+                                       "Unable to access requested buffer"));
+      }
+      buffer_ = open->buffer.get();
+      hello_snapshot_ = open->hello_snapshot.get();
+      line_of_ = [lines = open->lines.get()](ID id) {
+        return lines->LineOf(id);
+      };
+      if (hello.has_viewport()) SetViewport(hello.viewport());
+      if (hello.resume_site_id() > UINT16_MAX) {
+        return FinishWith(
+            grpc::Status(grpc::INVALID_ARGUMENT, "Bad site to resume"));
+      }
+      // a resumed session keeps its site so its commands stay attributed,
+      // but only a site this process issued to an edit session: any other
+      // may be in use by a collaborator, or another session
+      const bool resuming =
+          hello.resume_site_id() != 0 &&
+          hello.resume_incarnation() == server_->incarnation_ &&
+          server_->SiteIssued(hello.resume_site_id());
+      if (hello.resume_site_id() != 0 && !resuming) {
+        Log() << "Not resuming site " << hello.resume_site_id()
+              << ": not issued by this server";
+      }
+      site_.reset(new Site(resuming
+                               ? absl::optional<int>(hello.resume_site_id())
+                               : absl::optional<int>()));
+      // the offer names a process and descriptor to open: only taken from
+      // peers on this machine's socket, and only used if it holds the key
+      // the peer sent
+      if (FLAGS_shm_transport && hello.has_shm() && IsLocalPeer(ctx_)) {
+        try {
+          shm_ = ShmChannel::Open(hello.shm().pid(), hello.shm().fd(),
+                                  hello.shm().key());
+          batcher_.reset(new CommandBatcher(
+              CommandBatcher::Options::FromFlags(),
+              [this](const EditMessage& out) { return shm_->Write(out); }));
+        } catch (std::exception& e) {
+          Log() << "Falling back to gRPC for edits: " << e.what();
+          shm_.reset();
+        }
+      }
+
+      auto update = [this](const CommandSet* commands) {
+        QueueCommands(*commands);
+      };
+      if (resuming) {
+        // marks the dropped session held back don't show in the client's
+        // version vector, so every live mark is offered again (ahead of
+        // missing, which may delete some)
+        CommandSet resend;
+        bool filtering;
+        {
+          absl::MutexLock lock(&mu_);
+          filtering = viewport_filter_.enabled();
+        }
+        if (filtering) {
+          auto live = hello_snapshot_->Get(buffer_->ContentSnapshot());
+          for (const auto& anno : live->annotations.annotations()) {
+            Command* cmd = resend.add_commands();
+            cmd->set_id(anno.id());
+            *cmd->mutable_mark() = anno.anno();
+          }
+        }
+        listener_ = buffer_->ListenFrom(
+            site_->site_id(), VersionVectorFromProto(hello.seen()),
+            [this, &resend](const VersionVector& seen,
+                            const CommandSet& missing) {
+              EditMessage out;
+              auto body = out.mutable_server_hello();
+              body->set_site_id(site_->site_id());
+              body->set_resumed(true);
+              body->set_shm_accepted(shm_ != nullptr);
+              body->set_incarnation(server_->incarnation_);
+              VersionVectorToProto(seen, body->mutable_seen());
+              QueueMessage(std::move(out));
+              Log() << "Resuming site " << site_->site_id() << " with "
+                    << missing.commands_size() << " missed commands";
+              resend.MergeFrom(missing);
+              QueueCommands(resend);
+            },
+            update);
+        // from here on the dropped session leaves the site's marks be
+        if (listener_) server_->ClaimSite(site_->site_id(), this);
+      }
+      if (!listener_) {
+        // the client gets the whole buffer again, on a site of its own
+        if (resuming) site_.reset(new Site());
+        server_->ClaimSite(site_->site_id(), this);
+        {
+          absl::MutexLock lock(&mu_);
+          hello_pending_ = true;
+        }
+        // only the (persistent) string is taken under the buffer's lock:
+        // collaborators carry on while it's encoded
+        AnnotatedString initial;
+        listener_ = buffer_->Listen(
+            [&initial](const AnnotatedString& content) { initial = content; },
+            update);
+        SendHello(initial);
+      }
+
+      if (shm_) shm_reader_ = std::thread([this]() { ReadShm(); });
+      {
+        absl::MutexLock lock(&server_->mu_);
+        server_->sessions_.insert(this);
+        registered_ = true;
+      }
+      stream_.Read(&in_, &on_read_);
+    }
+
+    void ReadDone(bool ok) {
+      if (ok && shm_) {
+        // over shared memory the stream is only watched for the client
+        // leaving
+        stream_.Read(&in_, &on_read_);
+        return;
+      }
+      if (ok && in_.type_case() == EditMessage::kViewport) {
+        SetViewport(in_.viewport());
+        stream_.Read(&in_, &on_read_);
+        return;
+      }
+      if (ok) {
+        if (!ReadCommands(in_, &commands_)) {
+          return EndSession(grpc::Status(grpc::INVALID_ARGUMENT,
+                                         "Expected commands after greetings"));
+        }
+        buffer_->PushChanges(&commands_, true);
+        stream_.Read(&in_, &on_read_);
+        return;
+      }
+      EndSession(grpc::Status::OK);
+    }
+
+    void ReadShm() {
+      EditMessage msg;
+      CommandSet commands;
+      while (shm_->Read(&msg)) {
+        if (msg.type_case() == EditMessage::kViewport) {
+          SetViewport(msg.viewport());
+          continue;
+        }
+        if (!ReadCommands(msg, &commands)) {
+          Log() << "Expected commands over shared memory";
+          break;
+        }
+        buffer_->PushChanges(&commands, true);
+      }
+      // ends the stream read too, which ends the session
+      ctx_.TryCancel();
+    }
+
+    // Called once no read is outstanding
+    void EndSession(grpc::Status status) {
+      if (shm_) {
+        shm_->Close();
+        if (shm_reader_.joinable()) shm_reader_.join();
+      }
+      // unless a resumed session has taken the site (and its marks) over
+      if (site_ && server_->ReleaseSite(site_->site_id(), this)) {
+        CommandSet cleanup_commands;
+        buffer_->ContentSnapshot().MakeDeleteAttributesBySite(
+            &cleanup_commands, *site_);
+        buffer_->PushChanges(&cleanup_commands, false);
+      }
+      listener_.reset();
+      batcher_.reset();
+      Log() << "Edit stream closed: "
+            << CommandBatcher::FormatStats(CommandBatcher::GlobalStats());
+      FinishWith(status);
+    }
+
+    void QueueMessage(EditMessage msg) LOCKS_EXCLUDED(mu_) {
+      absl::MutexLock lock(&mu_);
+      queued_.emplace_back(std::move(msg));
+      MaybeWriteLocked();
+    }
+
+    void QueueCommands(const CommandSet& commands) LOCKS_EXCLUDED(mu_) {
+      absl::MutexLock lock(&mu_);
+      if (hello_pending_) {
+        before_hello_.MergeFrom(commands);
+        return;
+      }
+      CommandSet visible;
+      viewport_filter_.Filter(commands, line_of_, &visible);
+      SendCommandsLocked(visible);
+    }
+
+    // Sends the hello with content as its state, then the updates that
+    // arrived while it was encoded
+    void SendHello(const AnnotatedString& content) LOCKS_EXCLUDED(mu_) {
+      std::shared_ptr<const HelloSnapshot::Encoded> snapshot =
+          hello_snapshot_->Get(content);
+      EditMessage out;
+      auto body = out.mutable_server_hello();
+      body->set_site_id(site_->site_id());
+      body->set_shm_accepted(shm_ != nullptr);
+      body->set_incarnation(server_->incarnation_);
+      // copied, but not encoded again
+      body->set_encoded_state(snapshot->state);
+      absl::MutexLock lock(&mu_);
+      viewport_filter_.FilterSnapshot(snapshot->annotations, line_of_,
+                                      body->mutable_current_state());
+      queued_.emplace_back(std::move(out));
+      hello_pending_ = false;
+      CommandSet visible;
+      viewport_filter_.Filter(before_hello_, line_of_, &visible);
+      before_hello_.Clear();
+      SendCommandsLocked(visible);
+      MaybeWriteLocked();
+    }
+
+    void SetViewport(const EditMessage::Viewport& viewport)
+        LOCKS_EXCLUDED(mu_) {
+      absl::MutexLock lock(&mu_);
+      CommandSet released;
+      viewport_filter_.SetViewport(viewport.first_line(), viewport.lines(),
+                                   line_of_, &released);
+      SendCommandsLocked(released);
+    }
+
+    // under mu_ so that released marks can't overtake their deletion
+    void SendCommandsLocked(const CommandSet& commands)
+        EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      if (commands.commands_size() == 0) return;
+      if (batcher_) {
+        batcher_->Add(commands);
+        return;
+      }
+      pending_commands_.MergeFrom(commands);
+      MaybeWriteLocked();
+    }
+
+    void FinishWith(grpc::Status status) LOCKS_EXCLUDED(mu_) {
+      absl::MutexLock lock(&mu_);
+      finish_status_ = status;
+      MaybeWriteLocked();
+    }
+
+    void WriteDone(bool ok) LOCKS_EXCLUDED(mu_) {
+      absl::MutexLock lock(&mu_);
+      write_in_flight_ = false;
+      if (!ok) {
+        broken_ = true;
+        queued_.clear();
+        pending_commands_.Clear();
+      }
+      MaybeWriteLocked();
+    }
+
+    // Starts the next write if none is in flight; once everything is
+    // written and a status is set, finishes the call
+    void MaybeWriteLocked() EXCLUSIVE_LOCKS_REQUIRED(mu_) {
+      if (write_in_flight_ || finishing_) return;
+      if (!broken_) {
+        if (!queued_.empty()) {
+          writing_ = std::move(queued_.front());
+          queued_.pop_front();
+        } else if (pending_commands_.commands_size() != 0) {
+          writing_ = EncodeCommands(&pending_commands_, compress_threshold_);
+          pending_commands_.Clear();
+        } else {
+          writing_.Clear();
+        }
+        if (writing_.type_case() != EditMessage::TYPE_NOT_SET) {
+          write_in_flight_ = true;
+          stream_.Write(writing_, &on_write_);
+          return;
+        }
+      }
+      if (finish_status_) {
+        finishing_ = true;
+        stream_.Finish(*finish_status_, &on_finish_);
+      }
+    }
+
+    ProjectServer* const server_;
+    grpc::ServerCompletionQueue* const cq_;
+    const size_t compress_threshold_ =
+        CommandBatcher::Options::FromFlags().compress_threshold;
+    grpc::ServerContext ctx_;
+    grpc::ServerAsyncReaderWriter<EditMessage, EditMessage> stream_;
+    CqTag on_request_;
+    CqTag on_hello_;
+    CqTag on_read_;
+    CqTag on_write_;
+    CqTag on_finish_;
+    std::unique_ptr<ScopedRequest> scoped_request_;
+
+    // only touched by whichever completion is running: one read at a time
+    EditMessage in_;
+    CommandSet commands_;
+    Buffer* buffer_ = nullptr;
+    HelloSnapshot* hello_snapshot_ = nullptr;
+    std::unique_ptr<Site> site_;
+    std::unique_ptr<ShmChannel> shm_;
+    std::unique_ptr<CommandBatcher> batcher_;
+    std::unique_ptr<BufferListener> listener_;
+    std::thread shm_reader_;
+    ViewportFilter::LineOf line_of_;
+    // in the server's sessions_
+    bool registered_ = false;
+
+    absl::Mutex mu_;
+    ViewportFilter viewport_filter_ GUARDED_BY(mu_);
+    // set until the hello is queued; updates wait in before_hello_
+    bool hello_pending_ GUARDED_BY(mu_) = false;
+    CommandSet before_hello_ GUARDED_BY(mu_);
+    std::deque<EditMessage> queued_ GUARDED_BY(mu_);
+    // updates not yet written, merged into one message
+    CommandSet pending_commands_ GUARDED_BY(mu_);
+    EditMessage writing_ GUARDED_BY(mu_);
+    bool write_in_flight_ GUARDED_BY(mu_) = false;
+    bool broken_ GUARDED_BY(mu_) = false;
+    absl::optional<grpc::Status> finish_status_ GUARDED_BY(mu_);
+    bool finishing_ GUARDED_BY(mu_) = false;
+  };
+
   static boost::filesystem::path PathFromArgs(int argc, char** argv) {
     if (argc != 2) throw std::runtime_error("Expected path");
     return argv[1];
@@ -200,17 +1037,86 @@ class ProjectServer : public Application, public ProjectService::Service {
 
 REGISTER_APPLICATION(ProjectServer);
 
-void SpawnServer(const boost::filesystem::path& ced_bin,
-                 const Project& project) {
-  run_daemon(
-      ced_bin,
-      {
-          "-mode",
-          "ProjectServer",
-          "-logfile",
-          (project.aspect<ProjectRoot>()->LocalAddressPath().parent_path() /
-           absl::StrCat(".cedlog.server.", ced_src_hash))
-              .string(),
-          project.aspect<ProjectRoot>()->LocalAddressPath().string(),
-      });
+std::string ReadTcpToken() {
+  if (FLAGS_tcp_token_file.empty()) {
+    throw std::runtime_error("Connecting over TCP needs -tcp_token_file");
+  }
+  std::string token(absl::StripAsciiWhitespace(Read(FLAGS_tcp_token_file)));
+  if (token.empty()) {
+    throw std::runtime_error(
+        absl::StrCat("Empty token in ", FLAGS_tcp_token_file));
+  }
+  return token;
+}
+
+boost::filesystem::path DaemonAddressPath() {
+  const char* runtime = getenv("XDG_RUNTIME_DIR");
+  boost::filesystem::path dir =
+      runtime ? boost::filesystem::path(runtime) / "ced"
+              : boost::filesystem::path(absl::StrCat("/tmp/ced-", getuid()));
+  // private to this user: whoever reaches the daemon can open their files
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    throw std::runtime_error(
+        absl::StrCat("Failed to create ", dir.string(), ": ", strerror(errno)));
+  }
+  // it may have been there already, made by someone else
+  struct stat st;
+  WrapSyscall("lstat", [&]() { return lstat(dir.c_str(), &st); });
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+      (st.st_mode & 077) != 0) {
+    throw std::runtime_error(absl::StrCat(
+        "Refusing to use ", dir.string(),
+        ": not a directory private to this user"));
+  }
+  return dir / "daemon.cedport";
+}
+
+int SpawnServer(const boost::filesystem::path& ced_bin,
+                const Project& project) {
+  const boost::filesystem::path address =
+      FLAGS_daemon ? DaemonAddressPath()
+                   : project.aspect<ProjectRoot>()->LocalAddressPath();
+  int ready[2];
+  WrapSyscall("pipe", [&]() { return pipe(ready); });
+  for (int fd : ready) {
+    // only the server should hold the write end, or EOF never comes
+    WrapSyscall("fcntl", [fd]() { return fcntl(fd, F_SETFD, FD_CLOEXEC); });
+  }
+  try {
+    run_daemon(ced_bin,
+               {
+                   "-mode",
+                   "ProjectServer",
+                   "-logfile",
+                   (address.parent_path() /
+                    absl::StrCat(".cedlog.server.", ced_src_hash))
+                       .string(),
+                   absl::StrCat("-daemon=", FLAGS_daemon),
+                   "-ready_fd",
+                   absl::StrCat(kDaemonInheritedFd),
+                   address.string(),
+               },
+               ready[1]);
+  } catch (...) {
+    close(ready[0]);
+    close(ready[1]);
+    throw;
+  }
+  close(ready[1]);
+  return ready[0];
+}
+
+bool WaitForServer(int ready_fd, absl::Duration timeout) {
+  const absl::Time deadline = absl::Now() + timeout;
+  pollfd pfd = {ready_fd, POLLIN, 0};
+  for (;;) {
+    const int64_t ms = absl::ToInt64Milliseconds(deadline - absl::Now());
+    if (ms <= 0) return false;
+    if (WrapSyscall("poll", [&]() { return poll(&pfd, 1, ms); }) == 0) {
+      continue;
+    }
+    char ready;
+    return WrapSyscall("read", [&]() { return read(ready_fd, &ready, 1); }) ==
+           1;
+  }
 }
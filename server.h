@@ -13,7 +13,37 @@
 // limitations under the License.
 #pragma once
 
+#include <gflags/gflags.h>
+#include <string>
+#include "absl/time/time.h"
 #include "project.h"
 
-void SpawnServer(const boost::filesystem::path& ced_bin,
-                 const Project& project);
+// a pipe the server signals once it accepts connections, as SpawnServer's
+DECLARE_int32(ready_fd);
+DECLARE_bool(daemon);
+
+// how often clients connected over TCP ping an otherwise idle connection
+constexpr int kRemoteKeepalivePingMs = 20000;
+
+// a hello carries a whole buffer, and a load one file's worth of inserts:
+// both ends accept messages far past gRPC's 4MB default
+constexpr int kMaxMessageBytes = 1 << 30;
+
+// connections over TCP carry -tcp_token_file's secret in this metadata
+constexpr char kTcpTokenMetadataKey[] = "ced-token";
+
+// The secret in -tcp_token_file; throws if there is none
+std::string ReadTcpToken();
+
+// The socket of this user's daemon, serving every project (see -daemon)
+boost::filesystem::path DaemonAddressPath();
+
+// Starts a server for project (or this user's daemon, given -daemon) in the
+// background. Returns a pipe that the server writes a byte to once it accepts
+// connections, or that reaches EOF if it exits first; the caller closes it.
+int SpawnServer(const boost::filesystem::path& ced_bin,
+                const Project& project);
+
+// Waits on a pipe like SpawnServer's; false if the server exits or timeout
+// passes before it's ready
+bool WaitForServer(int ready_fd, absl::Duration timeout);
@@ -0,0 +1,280 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "shm_transport.h"
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "wrap_syscall.h"
+
+DEFINE_bool(shm_transport, true,
+            "Carry Edit sessions between a client and server on the same "
+            "host over shared memory rather than gRPC");
+
+namespace {
+
+constexpr uint32_t kMagic = 0x63656472;  // 'cedr'
+// largest message either side will accept from the other
+constexpr uint32_t kMaxMessageSize = 1 << 30;
+constexpr size_t kMaxCapacity = 1 << 30;
+// a channel's key, ahead of its rings (keeping them cache line aligned)
+constexpr size_t kKeyBytes = 64;
+constexpr char kMemfdName[] = "ced-edit";
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  std::atomic<uint64_t>::is_always_lock_free,
+              "atomics shared between processes must be lock free");
+
+void FutexWait(std::atomic<uint32_t>* word, uint32_t expect) {
+  // EAGAIN (word already moved on) and EINTR both just mean re-check
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expect,
+          nullptr, nullptr, 0);
+}
+
+void FutexWakeAll(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX,
+          nullptr, nullptr, 0);
+}
+
+}  // namespace
+
+struct ShmRing::Header {
+  uint32_t magic;
+  uint32_t capacity;
+  std::atomic<uint32_t> closed;
+  // producer side: bytes ever written, bumped with each write
+  alignas(64) std::atomic<uint64_t> head;
+  std::atomic<uint32_t> written_seq;
+  std::atomic<uint32_t> readers_waiting;
+  // consumer side: bytes ever read, bumped with each read
+  alignas(64) std::atomic<uint64_t> tail;
+  std::atomic<uint32_t> read_seq;
+  std::atomic<uint32_t> writers_waiting;
+};
+
+// Blocks until ready() or seq moves on. The waiting count lets the other
+// side skip the wake syscall when nobody sleeps.
+template <class F>
+static void WaitFor(std::atomic<uint32_t>* seq, std::atomic<uint32_t>* waiting,
+                    F ready) {
+  uint32_t seen = seq->load(std::memory_order_acquire);
+  waiting->fetch_add(1);
+  if (!ready()) FutexWait(seq, seen);
+  waiting->fetch_sub(1);
+}
+
+static void Wake(std::atomic<uint32_t>* seq, std::atomic<uint32_t>* waiting) {
+  seq->fetch_add(1);
+  if (waiting->load() != 0) FutexWakeAll(seq);
+}
+
+size_t ShmRing::MappedSize(size_t capacity) {
+  return sizeof(Header) + capacity;
+}
+
+ShmRing ShmRing::Create(void* mem, size_t capacity) {
+  if (capacity == 0 || capacity > kMaxCapacity) {
+    throw std::runtime_error("Bad shared memory ring capacity");
+  }
+  Header* header = new (mem) Header();
+  header->magic = kMagic;
+  header->capacity = capacity;
+  return ShmRing(header, static_cast<char*>(mem) + sizeof(Header), capacity);
+}
+
+ShmRing ShmRing::Attach(void* mem, size_t size) {
+  Header* header = static_cast<Header*>(mem);
+  if (size < sizeof(Header) || header->magic != kMagic ||
+      header->capacity == 0 || MappedSize(header->capacity) != size) {
+    throw std::runtime_error("Not a shared memory ring");
+  }
+  return ShmRing(header, static_cast<char*>(mem) + sizeof(Header),
+                 header->capacity);
+}
+
+bool ShmRing::WriteBytes(const char* p, size_t n) {
+  while (n > 0) {
+    if (header_->closed.load(std::memory_order_acquire)) return false;
+    const uint64_t head = header_->head.load(std::memory_order_relaxed);
+    const uint64_t used = head - header_->tail.load(std::memory_order_acquire);
+    if (used > capacity_) return false;  // the peer scribbled on the header
+    if (used == capacity_) {
+      WaitFor(&header_->read_seq, &header_->writers_waiting, [&]() {
+        return header_->tail.load() != head - used || header_->closed.load();
+      });
+      continue;
+    }
+    const size_t offset = head % capacity_;
+    const size_t chunk =
+        std::min({n, static_cast<size_t>(capacity_ - used),
+                  static_cast<size_t>(capacity_ - offset)});
+    memcpy(data_ + offset, p, chunk);
+    header_->head.store(head + chunk, std::memory_order_release);
+    Wake(&header_->written_seq, &header_->readers_waiting);
+    p += chunk;
+    n -= chunk;
+  }
+  return true;
+}
+
+bool ShmRing::ReadBytes(char* p, size_t n) {
+  while (n > 0) {
+    const uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    const uint64_t avail = header_->head.load(std::memory_order_acquire) - tail;
+    if (avail > capacity_) return false;
+    if (avail == 0) {
+      if (header_->closed.load(std::memory_order_acquire)) return false;
+      WaitFor(&header_->written_seq, &header_->readers_waiting, [&]() {
+        return header_->head.load() != tail || header_->closed.load();
+      });
+      continue;
+    }
+    const size_t offset = tail % capacity_;
+    const size_t chunk = std::min({n, static_cast<size_t>(avail),
+                                   static_cast<size_t>(capacity_ - offset)});
+    memcpy(p, data_ + offset, chunk);
+    header_->tail.store(tail + chunk, std::memory_order_release);
+    Wake(&header_->read_seq, &header_->writers_waiting);
+    p += chunk;
+    n -= chunk;
+  }
+  return true;
+}
+
+bool ShmRing::Write(absl::string_view msg) {
+  if (msg.size() > kMaxMessageSize) return false;
+  const uint32_t len = msg.size();
+  return WriteBytes(reinterpret_cast<const char*>(&len), sizeof(len)) &&
+         WriteBytes(msg.data(), msg.size());
+}
+
+bool ShmRing::Read(std::string* msg) {
+  uint32_t len;
+  if (!ReadBytes(reinterpret_cast<char*>(&len), sizeof(len))) return false;
+  if (len > kMaxMessageSize) return false;
+  msg->resize(len);
+  return ReadBytes(&(*msg)[0], len);
+}
+
+void ShmRing::Close() {
+  header_->closed.store(1, std::memory_order_release);
+  header_->written_seq.fetch_add(1);
+  header_->read_seq.fetch_add(1);
+  FutexWakeAll(&header_->written_seq);
+  FutexWakeAll(&header_->read_seq);
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::Create(size_t ring_capacity) {
+  const size_t ring_size = ShmRing::MappedSize(ring_capacity);
+  const size_t size = kKeyBytes + 2 * ring_size;
+  std::string key(kKeyBytes, '\0');
+  std::random_device rd;
+  for (char& c : key) c = static_cast<char>(rd());
+  int fd = WrapSyscall("memfd_create", []() {
+    return syscall(SYS_memfd_create, kMemfdName, MFD_CLOEXEC);
+  });
+  void* mem = MAP_FAILED;
+  try {
+    WrapSyscall("ftruncate", [&]() { return ftruncate(fd, size); });
+    mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) throw std::runtime_error("mmap failed");
+    char* base = static_cast<char*>(mem);
+    std::copy(key.begin(), key.end(), base);
+    base += kKeyBytes;
+    ShmRing to_server = ShmRing::Create(base, ring_capacity);
+    ShmRing to_client = ShmRing::Create(base + ring_size, ring_capacity);
+    return std::unique_ptr<ShmChannel>(
+        new ShmChannel(fd, std::move(key), mem, size, to_server, to_client));
+  } catch (...) {
+    if (mem != MAP_FAILED) munmap(mem, size);
+    close(fd);
+    throw;
+  }
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::Open(int pid, int client_fd,
+                                             absl::string_view key) {
+  if (key.size() != kKeyBytes) {
+    throw std::runtime_error("Bad shared memory channel key");
+  }
+  const std::string path = absl::StrCat("/proc/", pid, "/fd/", client_fd);
+  // pid and fd are only the client's word: open nothing but a channel memfd
+  char target[64];
+  ssize_t len = WrapSyscall("readlink", [&]() {
+    return readlink(path.c_str(), target, sizeof(target));
+  });
+  if (!absl::StartsWith(absl::string_view(target, len),
+                        absl::StrCat("/memfd:", kMemfdName, " "))) {
+    throw std::runtime_error("Not a shared memory channel");
+  }
+  int fd = WrapSyscall(
+      "open", [&]() { return open(path.c_str(), O_RDWR | O_CLOEXEC); });
+  void* mem = MAP_FAILED;
+  size_t size = 0;
+  try {
+    struct stat st;
+    WrapSyscall("fstat", [&]() { return fstat(fd, &st); });
+    size = st.st_size;
+    if (!S_ISREG(st.st_mode) || size < kKeyBytes ||
+        (size - kKeyBytes) % 2 != 0 ||
+        size > kKeyBytes + 2 * ShmRing::MappedSize(kMaxCapacity)) {
+      throw std::runtime_error("Bad shared memory channel size");
+    }
+    mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) throw std::runtime_error("mmap failed");
+    char* base = static_cast<char*>(mem);
+    // compared in full, so the time taken gives nothing away
+    unsigned char diff = 0;
+    for (size_t i = 0; i < kKeyBytes; i++) diff |= base[i] ^ key[i];
+    if (diff != 0) {
+      throw std::runtime_error("Shared memory channel key mismatch");
+    }
+    base += kKeyBytes;
+    const size_t ring_size = (size - kKeyBytes) / 2;
+    ShmRing to_server = ShmRing::Attach(base, ring_size);
+    ShmRing to_client = ShmRing::Attach(base + ring_size, ring_size);
+    return std::unique_ptr<ShmChannel>(new ShmChannel(
+        fd, std::string(key), mem, size, to_client, to_server));
+  } catch (...) {
+    if (mem != MAP_FAILED) munmap(mem, size);
+    close(fd);
+    throw;
+  }
+}
+
+ShmChannel::~ShmChannel() {
+  munmap(mem_, size_);
+  close(fd_);
+}
+
+bool ShmChannel::Write(const EditMessage& msg) {
+  return out_.Write(msg.SerializeAsString());
+}
+
+bool ShmChannel::Read(EditMessage* msg) {
+  std::string buf;
+  return in_.Read(&buf) && msg->ParseFromString(buf);
+}
+
+void ShmChannel::Close() {
+  out_.Close();
+  in_.Close();
+}
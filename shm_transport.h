@@ -0,0 +1,109 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <gflags/gflags.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include "absl/strings/string_view.h"
+#include "proto/project_service.pb.h"
+
+DECLARE_bool(shm_transport);
+
+// Single producer, single consumer byte ring laid out in memory that may be
+// shared with another process. Messages are length prefixed and may be
+// larger than the ring: they're streamed through it as space frees up.
+// Both sides block on futexes in the shared memory itself, so no other
+// channel is needed to signal.
+class ShmRing {
+ public:
+  // bytes of shared memory a ring with capacity data bytes occupies
+  static size_t MappedSize(size_t capacity);
+
+  // Lays out an empty ring in mem (of MappedSize(capacity) bytes)
+  static ShmRing Create(void* mem, size_t capacity);
+  // Attaches to a ring another process created: its header is checked
+  // against size, but the memory stays untrusted
+  static ShmRing Attach(void* mem, size_t size);
+
+  // Both block; false once the ring is closed (the reader first drains what
+  // was written before that)
+  bool Write(absl::string_view msg);
+  bool Read(std::string* msg);
+
+  // Wakes and fails all current and future writes, and reads once drained
+  void Close();
+
+ private:
+  struct Header;
+  ShmRing(Header* header, char* data, uint32_t capacity)
+      : header_(header), data_(data), capacity_(capacity) {}
+
+  bool WriteBytes(const char* p, size_t n);
+  bool ReadBytes(char* p, size_t n);
+
+  Header* header_;
+  char* data_;
+  uint32_t capacity_;
+};
+
+// A pair of ShmRings in a memfd, carrying the EditMessages of one Edit
+// session between a client and a server on the same host. The client
+// creates it and names it, with the random key written ahead of the rings,
+// in its ClientHello; the server opens it through /proc, and only uses it
+// if the key matches. gRPC exposes neither the socket nor its peer's
+// credentials, so the key is what shows the memfd is the client's own. The
+// gRPC stream stays open alongside it to carry the hellos and notice either
+// side going away.
+class ShmChannel {
+ public:
+  // client side: ring_capacity bytes in each direction
+  static std::unique_ptr<ShmChannel> Create(size_t ring_capacity);
+  // server side: the channel the client process pid holds as fd, which
+  // must be a channel memfd holding key
+  static std::unique_ptr<ShmChannel> Open(int pid, int fd,
+                                          absl::string_view key);
+
+  ~ShmChannel();
+
+  ShmChannel(const ShmChannel&) = delete;
+  ShmChannel& operator=(const ShmChannel&) = delete;
+
+  // the memfd and its key, as the client should name them
+  int fd() const { return fd_; }
+  const std::string& key() const { return key_; }
+
+  bool Write(const EditMessage& msg);
+  bool Read(EditMessage* msg);
+  // closes both directions
+  void Close();
+
+ private:
+  ShmChannel(int fd, std::string key, void* mem, size_t size, ShmRing out,
+             ShmRing in)
+      : fd_(fd),
+        key_(std::move(key)),
+        mem_(mem),
+        size_(size),
+        out_(out),
+        in_(in) {}
+
+  const int fd_;
+  const std::string key_;
+  void* const mem_;
+  const size_t size_;
+  ShmRing out_;
+  ShmRing in_;
+};
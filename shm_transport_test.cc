@@ -0,0 +1,90 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "shm_transport.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+
+TEST(ShmRingTest, StreamsMessagesLargerThanTheRing) {
+  std::vector<char> mem(ShmRing::MappedSize(16));
+  ShmRing writer = ShmRing::Create(mem.data(), 16);
+  ShmRing reader = ShmRing::Attach(mem.data(), mem.size());
+  std::vector<std::string> sent;
+  for (int i = 0; i < 100; i++) {
+    sent.push_back(std::string(i, 'a' + i % 26));
+  }
+  std::thread producer([&]() {
+    for (const auto& msg : sent) ASSERT_TRUE(writer.Write(msg));
+    writer.Close();
+  });
+  std::string msg;
+  for (const auto& expect : sent) {
+    ASSERT_TRUE(reader.Read(&msg));
+    EXPECT_EQ(expect, msg);
+  }
+  EXPECT_FALSE(reader.Read(&msg));
+  producer.join();
+}
+
+TEST(ShmRingTest, CloseWakesBlockedWriter) {
+  std::vector<char> mem(ShmRing::MappedSize(8));
+  ShmRing ring = ShmRing::Create(mem.data(), 8);
+  std::thread closer([&]() {
+    usleep(10000);
+    ring.Close();
+  });
+  EXPECT_FALSE(ring.Write(std::string(64, 'x')));
+  closer.join();
+}
+
+TEST(ShmRingTest, RejectsForeignMemory) {
+  std::vector<char> mem(ShmRing::MappedSize(8));
+  EXPECT_THROW(ShmRing::Attach(mem.data(), mem.size()), std::runtime_error);
+}
+
+TEST(ShmChannelTest, RoundTripsThroughProc) {
+  auto client = ShmChannel::Create(64);
+  auto server = ShmChannel::Open(getpid(), client->fd(), client->key());
+
+  EditMessage msg;
+  auto* cmd = msg.mutable_commands()->add_commands();
+  cmd->set_id(42);
+  cmd->mutable_insert()->set_characters(std::string(1000, 'q'));
+  std::thread writer([&]() { ASSERT_TRUE(client->Write(msg)); });
+  EditMessage got;
+  ASSERT_TRUE(server->Read(&got));
+  writer.join();
+  EXPECT_EQ(msg.SerializeAsString(), got.SerializeAsString());
+
+  server->Close();
+  EXPECT_FALSE(client->Read(&got));
+}
+
+TEST(ShmChannelTest, OpensOnlyChannelsWhoseKeyItIsGiven) {
+  auto client = ShmChannel::Create(64);
+  std::string key = client->key();
+  key[0] ^= 1;
+  EXPECT_THROW(ShmChannel::Open(getpid(), client->fd(), key),
+               std::runtime_error);
+  EXPECT_THROW(ShmChannel::Open(getpid(), client->fd(), ""),
+               std::runtime_error);
+  // nor anything but a channel, whatever its content
+  int fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  ASSERT_NE(-1, fd);
+  EXPECT_THROW(ShmChannel::Open(getpid(), fd, client->key()),
+               std::runtime_error);
+  close(fd);
+}
@@ -0,0 +1,103 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <set>
+#include "buffer.h"
+#include "buffer_snapshot.h"
+#include "log.h"
+
+// Keeps the buffer's snapshot up to date once it settles, and retires what
+// a snapshot restored: a restored site's marks and attributes are deleted as
+// soon as a live site publishes marks of any type the restored site had, and
+// at the latest once every collaborator has been over the loaded file (types
+// no live collaborator produces any more would otherwise linger forever).
+class SnapshotCollaborator final : public SyncCollaborator {
+ public:
+  SnapshotCollaborator(const Buffer* buffer)
+      : SyncCollaborator("snapshot", absl::Seconds(5),
+                         absl::Milliseconds(100)),
+        buffer_(buffer),
+        restored_(buffer->restored_sites().begin(),
+                  buffer->restored_sites().end()),
+        unretired_(restored_) {}
+
+  EditResponse Edit(const EditNotification& notification) override;
+
+ private:
+  void Retire(const AnnotatedString& content, bool first_pass_complete,
+              CommandSet* commands);
+
+  const Buffer* const buffer_;
+  const std::set<uint16_t> restored_;
+  std::set<uint16_t> unretired_;
+  AnnotatedString last_saved_;
+};
+
+void SnapshotCollaborator::Retire(const AnnotatedString& content,
+                                  bool first_pass_complete,
+                                  CommandSet* commands) {
+  std::set<uint16_t> superseded;
+  if (first_pass_complete) {
+    superseded = unretired_;
+  } else {
+    const auto* types = Attribute::descriptor()->FindOneofByName("data");
+    for (int i = 0; i < types->field_count(); i++) {
+      bool live = false;
+      std::set<uint16_t> restored_with_type;
+      content.ForEachAnnotation(
+          static_cast<Attribute::DataCase>(types->field(i)->number()),
+          [&](ID id, ID, ID, const Attribute&) {
+            if (restored_.count(id.site) != 0) {
+              if (unretired_.count(id.site) != 0) {
+                restored_with_type.insert(id.site);
+              }
+            } else {
+              live = true;
+            }
+          });
+      if (live) {
+        superseded.insert(restored_with_type.begin(), restored_with_type.end());
+      }
+    }
+  }
+  for (uint16_t site_id : superseded) {
+    Log() << buffer_->filename() << ": retiring restored site " << site_id;
+    Site site{absl::optional<int>(site_id)};
+    content.MakeDeleteAttributesBySite(commands, site);
+    unretired_.erase(site_id);
+  }
+}
+
+EditResponse SnapshotCollaborator::Edit(const EditNotification& notification) {
+  EditResponse response;
+  if (!unretired_.empty()) {
+    Retire(notification.content, notification.first_pass_complete,
+           &response.content_updates);
+  }
+  if (notification.fully_loaded &&
+      !last_saved_.SameTotalIdentity(notification.content)) {
+    try {
+      BufferSnapshot::Save(buffer_->project(), buffer_->filename(),
+                           notification.content);
+      last_saved_ = notification.content;
+    } catch (std::exception& e) {
+      Log() << "Failed saving snapshot of " << buffer_->filename() << ": "
+            << e.what();
+    }
+  }
+  return response;
+}
+
+SERVER_COLLABORATOR(SnapshotCollaborator, buffer) {
+  return FLAGS_buffer_snapshots && !buffer->synthetic();
+}
@@ -0,0 +1,135 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include <grpc++/create_channel.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <iostream>
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/time/time.h"
+#include "application.h"
+#include "client.h"
+#include "project.h"
+#include "proto/project_service.grpc.pb.h"
+#include "server.h"
+
+// Prints what a running server is doing, without starting one. Usage:
+//   ced -mode Stats [path in the project]
+class Stats : public Application {
+ public:
+  Stats(int argc, char** argv)
+      : path_(argc >= 2 ? boost::filesystem::path(argv[1])
+                        : boost::filesystem::current_path()) {}
+
+  int Run() override {
+    std::string address;
+    std::string tcp_token;
+    if (!FLAGS_server.empty()) {
+      address = FLAGS_server;
+      tcp_token = ReadTcpToken();
+    } else {
+      Project project(path_, true);
+      const boost::filesystem::path port =
+          FLAGS_daemon ? DaemonAddressPath()
+                       : project.aspect<ProjectRoot>()->LocalAddressPath();
+      if (!boost::filesystem::exists(port)) {
+        std::cerr << "No server running at " << port.string() << "\n";
+        return 1;
+      }
+      address = absl::StrCat("unix:", port.string());
+    }
+
+    auto stub = ProjectService::NewStub(
+        grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+    grpc::ClientContext ctx;
+    ctx.set_deadline(gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC),
+                                  gpr_time_from_seconds(10, GPR_TIMESPAN)));
+    if (!tcp_token.empty()) ctx.AddMetadata(kTcpTokenMetadataKey, tcp_token);
+    Empty req;
+    ServerStats stats;
+    grpc::Status status = stub->GetStats(&ctx, req, &stats);
+    if (!status.ok()) {
+      std::cerr << "GetStats failed: " << status.error_message() << "\n";
+      return 1;
+    }
+    Print(stats);
+    return 0;
+  }
+
+ private:
+  // upper bound of the bucket the q'th quantile falls in
+  static std::string Quantile(const CollaboratorStats& c, double q) {
+    uint64_t total = 0;
+    for (uint64_t n : c.latency_ms_log2_buckets()) total += n;
+    uint64_t seen = 0;
+    for (int i = 0; i < c.latency_ms_log2_buckets_size(); i++) {
+      seen += c.latency_ms_log2_buckets(i);
+      if (seen >= q * total) {
+        if (i == c.latency_ms_log2_buckets_size() - 1) {
+          return absl::StrCat(">=", 1 << (i - 1), "ms");
+        }
+        return absl::StrCat("<", 1 << i, "ms");
+      }
+    }
+    return "?";
+  }
+
+  static void Print(const ServerStats& stats) {
+    std::cout << "server " << stats.src_hash() << ", up "
+              << absl::FormatDuration(absl::Seconds(
+                     static_cast<int64_t>(stats.uptime_seconds())))
+              << ", rss " << stats.rss_bytes() / (1024 * 1024) << "MiB, "
+              << stats.process_threads() << " threads\n";
+    std::cout << "polling: " << stats.polling_threads() << " threads, "
+              << 100 * stats.polling_utilization() << "% busy, "
+              << stats.active_requests() << " active requests\n";
+    std::cout << "projects: " << absl::StrJoin(stats.projects(), " ") << "\n";
+    for (const auto& b : stats.buffers()) {
+      std::cout << "buffer " << b.filename() << ": " << b.chars()
+                << " chars, " << b.tombstones() << " tombstones, "
+                << b.attributes() << " attributes, " << b.graveyard()
+                << " in graveyard, version " << b.version() << ", "
+                << b.logged_commands() << " logged commands, "
+                << b.listeners() << " listeners\n";
+      std::vector<std::string> annotations;
+      for (const auto& a : b.annotations_by_type()) {
+        annotations.push_back(absl::StrCat(a.first, " ", a.second));
+      }
+      std::sort(annotations.begin(), annotations.end());
+      std::cout << "  annotations: " << absl::StrJoin(annotations, ", ")
+                << "\n";
+      for (const auto& c : b.collaborators()) {
+        uint64_t responses = 0;
+        for (uint64_t n : c.latency_ms_log2_buckets()) responses += n;
+        std::cout << "  " << c.name() << ": " << responses << " responses";
+        if (responses != 0) {
+          std::cout << ", p50 " << Quantile(c, 0.5) << ", p99 "
+                    << Quantile(c, 0.99);
+        }
+        std::cout << "\n";
+      }
+    }
+    for (const auto& s : stats.sessions()) {
+      std::cout << "session " << s.peer() << " site " << s.site_id() << " on "
+                << s.buffer() << (s.shm() ? " (shm)" : "") << ": "
+                << s.queued_messages() << " queued messages, "
+                << s.pending_commands() << " pending commands"
+                << (s.write_in_flight() ? ", writing" : "") << "\n";
+    }
+  }
+
+  const boost::filesystem::path path_;
+};
+
+REGISTER_APPLICATION(Stats);
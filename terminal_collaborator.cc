@@ -23,7 +23,7 @@
 DEFINE_bool(buffer_profile_display, false,
             "Show buffer collaborator latency HUD");
 
-absl::Mutex TerminalCollaborator::mu_;
+absl::Mutex TerminalCollaborator::all_mu_;
 std::vector<TerminalCollaborator*> TerminalCollaborator::all_;
 
 constexpr char ctrl(char c) { return c & 0x1f; }
@@ -34,32 +34,72 @@ TerminalCollaborator::TerminalCollaborator(const Buffer* buffer)
       editor_(Editor::Make(buffer_->site())),
       recently_used_(false),
       state_(State::EDITING) {
-  absl::MutexLock lock(&mu_);
+  {
+    absl::MutexLock lock(&mu_);
+    PublishRenderState();
+  }
+  absl::MutexLock lock(&all_mu_);
   all_.push_back(this);
 }
 
 TerminalCollaborator::~TerminalCollaborator() {
-  absl::MutexLock lock(&mu_);
+  absl::MutexLock lock(&all_mu_);
   all_.erase(std::remove(all_.begin(), all_.end(), this), all_.end());
 }
 
-void TerminalCollaborator::All_Render(TerminalRenderContainers containers) {
-  absl::MutexLock lock(&mu_);
-  for (auto t : all_) t->Render(containers);
+bool TerminalCollaborator::All_Render(TerminalRenderContainers containers) {
+  absl::MutexLock lock(&all_mu_);
+  bool drew_main = false;
+  for (auto t : all_) drew_main |= t->Render(containers);
+  return drew_main;
 }
 
 void TerminalCollaborator::All_ProcessKey(AppEnv* app_env, int key) {
-  absl::MutexLock lock(&mu_);
-  for (auto t : all_) t->ProcessKey(app_env, key);
+  absl::MutexLock lock(&all_mu_);
+  for (auto t : all_) {
+    // side buffers take no keys: don't wait on their locks for nothing
+    if (t->buffer_->synthetic()) continue;
+    absl::MutexLock editor_lock(&t->mu_);
+    t->ProcessKey(app_env, key);
+  }
+}
+
+void TerminalCollaborator::PublishRenderState() {
+  std::shared_ptr<RenderState> render_state(new RenderState);
+  render_state->loaded = loaded_;
+  render_state->editor = TerminalRenderer::MakeDrawable(
+      editor_->PrepareRender<TerminalRenderContext>(!buffer_->synthetic()));
+  editor_->CurrentState().content.ForEachAttribute(
+      Attribute::kDiagnostic, [&](ID, const Attribute& attribute) {
+        if (render_state->diagnostics.size() >= 10) return;
+        std::string msg = absl::StrCat(
+            "[", Diagnostic_Severity_Name(attribute.diagnostic().severity()),
+            "] ", attribute.diagnostic().message());
+        render_state->diagnostics.emplace_back(TerminalRenderer::MakeDrawable(
+            [msg](TerminalRenderContext* context) {
+              context->Put(0, 0, msg, context->color->Theme({}, 0));
+            }));
+      });
+  std::atomic_store(&render_state_, RenderStatePtr(std::move(render_state)));
 }
 
 void TerminalCollaborator::Push(const EditNotification& notification) {
   LogTimer tmr("term_push");
+  // the update is built unlocked, so keys are never held up behind it
+  Editor::StateUpdate update;
+  {
+    absl::MutexLock lock(&mu_);
+    update = editor_->BeginUpdate(notification);
+  }
+  update.Prepare(&tmr);
+  tmr.Mark("update");
   {
     absl::MutexLock lock(&mu_);
     tmr.Mark("lock");
-    editor_->UpdateState(&tmr, notification);
-    tmr.Mark("update");
+    editor_->FinishUpdate(std::move(update));
+    loaded_ = true;
+    PublishRenderState();
+    tmr.Mark("publish");
   }
   InvalidateTerminal();
 }
@@ -74,6 +114,7 @@ EditResponse TerminalCollaborator::Pull() {
   LogTimer tmr("term_pull");
   EditResponse r = editor_->MakeResponse();
   tmr.Mark("make");
+  PublishRenderState();
   r.become_used |= recently_used_;
   recently_used_ = false;
   mu_.Unlock();
@@ -84,15 +125,19 @@ EditResponse TerminalCollaborator::Pull() {
   return r;
 }
 
-void TerminalCollaborator::Render(TerminalRenderContainers containers) {
+bool TerminalCollaborator::Render(TerminalRenderContainers containers) {
+  RenderStatePtr render_state = std::atomic_load(&render_state_);
+  // until then the editor would draw an empty buffer
+  const bool drew_main = !buffer_->synthetic() && render_state->loaded;
+
   /*
    * edit item
    */
-  (buffer_->synthetic() ? containers.side_bar : containers.main)
-      .AddItem(
-          LAY_LEFT | LAY_VFILL,
-          editor_->PrepareRender<TerminalRenderContext>(!buffer_->synthetic()))
-      .FixSize(80, 0);
+  if (buffer_->synthetic() || drew_main) {
+    (buffer_->synthetic() ? containers.side_bar : containers.main)
+        .AddItem(LAY_LEFT | LAY_VFILL, render_state->editor)
+        .FixSize(80, 0);
+  }
 
   if (FLAGS_buffer_profile_display) {
     std::vector<std::string> profile = buffer_->ProfileData();
@@ -117,24 +162,10 @@ void TerminalCollaborator::Render(TerminalRenderContainers containers) {
 
   auto diagnostics =
       containers.ext_status.AddContainer(LAY_TOP | LAY_HFILL, LAY_COLUMN);
-
-  int num_diagnostics = 0;
-  editor_->CurrentState().content.ForEachAttribute(
-      Attribute::kDiagnostic, [&](ID, const Attribute& attribute) {
-        if (num_diagnostics < 10) {
-          std::string msg = absl::StrCat(
-              "[", Diagnostic_Severity_Name(attribute.diagnostic().severity()),
-              "] ", attribute.diagnostic().message());
-          diagnostics
-              .AddItem(LAY_TOP | LAY_HFILL,
-                       [msg](TerminalRenderContext* context) {
-                         Log() << *context->window;
-                         context->Put(0, 0, msg, context->color->Theme({}, 0));
-                       })
-              .FixSize(0, 1);
-          num_diagnostics++;
-        }
-      });
+  for (const auto& diagnostic : render_state->diagnostics) {
+    diagnostics.AddItem(LAY_TOP | LAY_HFILL, diagnostic).FixSize(0, 1);
+  }
+  return drew_main;
 }
 
 template <class EditorType>
@@ -223,6 +254,7 @@ void TerminalCollaborator::ProcessKey(AppEnv* app_env, int key) {
             break;
         }
       }
+      PublishRenderState();
       break;
 #if 0
     case State::FINDING:
@@ -238,4 +270,6 @@ void TerminalCollaborator::ProcessKey(AppEnv* app_env, int key) {
   }
 }
 
-CLIENT_COLLABORATOR(TerminalCollaborator, buffer) { return true; }
+CLIENT_COLLABORATOR(TerminalCollaborator, buffer) {
+  return !buffer->headless();
+}
@@ -14,32 +14,50 @@
 #pragma once
 
 #include <curses.h>
+#include <functional>
+#include <memory>
 #include "absl/synchronization/mutex.h"
 #include "absl/time/time.h"
 #include "buffer.h"
+#include "cell_grid.h"
 #include "editor.h"
 #include "line_editor.h"
 #include "log.h"
 #include "render.h"
 #include "terminal_color.h"
 
+// The screen as handed to curses
+typedef CellGrid<chtype> TerminalFrame;
+
+// One cell of an offscreen pane: attributes stay unresolved so panes can be
+// drawn off the UI thread. chr == 0 marks a cell the pane never drew, which
+// is transparent when the pane is composited into the TerminalFrame.
+struct TerminalCell {
+  uint32_t chr;
+  TerminalColor::Attr attr;
+};
+typedef CellGrid<TerminalCell> TerminalPane;
+
 struct TerminalRenderContext {
   TerminalColor* const color;
+  // sized to window, in window-relative coordinates
+  TerminalPane* const pane;
   const Renderer<TerminalRenderContext>::Rect* window;
 
   int crow;
   int ccol;
   bool animating;
 
-  void Put(int row, int col, chtype ch, chtype attr) {
+  void Put(int row, int col, chtype ch, TerminalColor::Attr attr) {
     if (row < 0 || col < 0 || col >= window->width() ||
         row >= window->height()) {
       return;
     }
-    mvaddch(row + window->row(), col + window->column(), ch | attr);
+    pane->Set(row, col, TerminalCell{static_cast<uint32_t>(ch), attr});
   }
 
-  void Put(int row, int col, const std::string& str, chtype attr) {
+  void Put(int row, int col, const std::string& str,
+           TerminalColor::Attr attr) {
     for (auto c : str) {
       Put(row, col++, c, attr);
     }
@@ -75,7 +93,8 @@ class TerminalCollaborator final : public AsyncCollaborator {
   void Push(const EditNotification& notification) override;
   EditResponse Pull() override;
 
-  static void All_Render(TerminalRenderContainers containers);
+  // true if a (non-synthetic) buffer's content was drawn into main
+  static bool All_Render(TerminalRenderContainers containers);
   static void All_ProcessKey(AppEnv* app_env, int key);
 
  private:
@@ -84,16 +103,30 @@ class TerminalCollaborator final : public AsyncCollaborator {
     FINDING,
   };
 
-  void Render(TerminalRenderContainers containers)
-      EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  // Everything the render thread needs from this collaborator, published
+  // whenever editor state changes and picked up without taking mu_
+  struct RenderState {
+    TerminalRenderer::DrawablePtr editor;
+    std::vector<TerminalRenderer::DrawablePtr> diagnostics;
+    // the editor has been sent the buffer's content
+    bool loaded = false;
+  };
+  typedef std::shared_ptr<const RenderState> RenderStatePtr;
+
+  bool Render(TerminalRenderContainers containers);
   void ProcessKey(AppEnv* app_env, int key) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void PublishRenderState() EXCLUSIVE_LOCKS_REQUIRED(mu_);
 
   const Buffer* const buffer_;
-  static absl::Mutex mu_;
+  absl::Mutex mu_;
   std::shared_ptr<Editor> editor_ GUARDED_BY(mu_);
   LineEditor find_editor_ GUARDED_BY(mu_);
   bool recently_used_ GUARDED_BY(mu_);
+  bool loaded_ GUARDED_BY(mu_) = false;
   State state_ GUARDED_BY(mu_);
+  // accessed with std::atomic_load/std::atomic_store
+  RenderStatePtr render_state_;
 
-  static std::vector<TerminalCollaborator*> all_ GUARDED_BY(mu_);
+  static absl::Mutex all_mu_;
+  static std::vector<TerminalCollaborator*> all_ GUARDED_BY(all_mu_);
 };
@@ -1,5 +1,7 @@
 #include "terminal_color.h"
 #include <math.h>
+#include <algorithm>
+#include <array>
 #include "log.h"
 
 TerminalColor::TerminalColor(std::unique_ptr<::Theme> theme)
@@ -8,16 +10,26 @@ TerminalColor::TerminalColor(std::unique_ptr<::Theme> theme)
   Log() << "HAS_COLORS: " << has_colors();
 }
 
+// sRGB component -> linear intensity, for every 8 bit value
+static const std::array<float, 256>& LinearTable() {
+  static const std::array<float, 256> table = []() {
+    std::array<float, 256> t;
+    for (int i = 0; i < 256; i++) {
+      float c = static_cast<float>(i) / 255.0f;
+      t[i] = (c > 0.04045f) ? powf((c + 0.055f) / 1.055f, 2.4f) : c / 12.92f;
+    }
+    return t;
+  }();
+  return table;
+}
+
 TerminalColor::LAB TerminalColor::RGB2LAB(RGB rgb) {
-  float r = static_cast<float>(std::get<0>(rgb)) / 255.0f;
-  float g = static_cast<float>(std::get<1>(rgb)) / 255.0f;
-  float b = static_cast<float>(std::get<2>(rgb)) / 255.0f;
+  const auto& linear = LinearTable();
+  float r = linear[std::get<0>(rgb)];
+  float g = linear[std::get<1>(rgb)];
+  float b = linear[std::get<2>(rgb)];
   float x, y, z;
 
-  r = (r > 0.04045f) ? powf((r + 0.055f) / 1.055f, 2.4f) : r / 12.92f;
-  g = (g > 0.04045f) ? powf((g + 0.055f) / 1.055f, 2.4f) : g / 12.92f;
-  b = (b > 0.04045f) ? powf((b + 0.055f) / 1.055f, 2.4f) : b / 12.92f;
-
   x = (r * 0.4124f + g * 0.3576f + b * 0.1805f) / 0.95047f;
   y = (r * 0.2126f + g * 0.7152f + b * 0.0722f) / 1.00000f;
   z = (r * 0.0193f + g * 0.1192f + b * 0.9505f) / 1.08883f;
@@ -29,16 +41,34 @@ TerminalColor::LAB TerminalColor::RGB2LAB(RGB rgb) {
   return LAB((116.0f * y) - 16.0f, 500.0f * (x - y), 200.0f * (y - z));
 }
 
-template <int I, class T>
-static T sqdiff(std::tuple<T, T, T> a, std::tuple<T, T, T> b) {
-  T d = std::get<I>(a) - std::get<I>(b);
-  return d * d;
+void TerminalColor::LoadPalette() {
+  if (palette_loaded_) return;
+  palette_loaded_ = true;
+  for (int i = 0; i < COLORS; i++) {
+    short r, g, b;
+    color_content(i, &r, &g, &b);
+    LAB lab = RGB2LAB(RGB(r * 255 / 1000, g * 255 / 1000, b * 255 / 1000));
+    palette_l_.push_back(std::get<0>(lab));
+    palette_a_.push_back(std::get<1>(lab));
+    palette_b_.push_back(std::get<2>(lab));
+  }
+  Log() << "Loaded " << palette_l_.size() << " color palette";
 }
 
-float TerminalColor::RGBDistance(RGB a, RGB b) {
-  LAB la = RGB2LAB(a);
-  LAB lb = RGB2LAB(b);
-  return sqdiff<0>(la, lb) + sqdiff<1>(la, lb) + sqdiff<2>(la, lb);
+int TerminalColor::NearestPaletteColor(LAB lab) const {
+  const float l = std::get<0>(lab);
+  const float a = std::get<1>(lab);
+  const float b = std::get<2>(lab);
+  const size_t n = palette_l_.size();
+  // distances first in a branch free loop (vectorizes), then the minimum
+  std::vector<float> dist(n);
+  for (size_t i = 0; i < n; i++) {
+    const float dl = palette_l_[i] - l;
+    const float da = palette_a_[i] - a;
+    const float db = palette_b_[i] - b;
+    dist[i] = dl * dl + da * da + db * db;
+  }
+  return std::min_element(dist.begin(), dist.end()) - dist.begin();
 }
 
 int TerminalColor::ColorToIndex(Theme::Color c) {
@@ -62,31 +92,23 @@ int TerminalColor::ColorToIndex(Theme::Color c) {
     color_cache_.insert(std::make_pair(rgb, n));
     return n;
   } else {
-    float best_diff = -1;
-    int best_clr = -1;
-    for (int i = 0; i < COLORS; i++) {
-      short r, g, b;
-      color_content(i, &r, &g, &b);
-      RGB sys(r * 255 / 1000, g * 255 / 1000, b * 255 / 1000);
-      float diff = RGBDistance(rgb, sys);
-      Log() << "color[" << i << " is " << r << "," << g << "," << b
-            << " ; diff=" << diff;
-      if (i == 0 || best_diff > diff) {
-        best_diff = diff;
-        best_clr = i;
-      }
-    }
+    LoadPalette();
+    int best_clr = NearestPaletteColor(RGB2LAB(rgb));
+    Log() << "nearest color to " << (int)c.r << "," << (int)c.g << ","
+          << (int)c.b << " is " << best_clr;
     color_cache_.insert(std::make_pair(rgb, best_clr));
     return best_clr;
   }
 }
 
-chtype TerminalColor::Theme(::Theme::Tag token, uint32_t flags) {
-  auto key = std::make_pair(token, flags);
-  auto it = cache_.find(key);
-  if (it != cache_.end()) return it->second;
+chtype TerminalColor::ResolveSlow(Attr attr) {
+  const ::Theme::StyleID style = attr / ::Theme::kNumFlagCombinations;
+  const uint32_t flags = attr % ::Theme::kNumFlagCombinations;
+  if (attr >= cache_.size()) {
+    cache_.resize(attr + ::Theme::kNumFlagCombinations);
+  }
 
-  Theme::Result r = theme_->ThemeToken(token, flags);
+  Theme::Result r = theme_->ThemeStyle(style, flags);
 
   int fg = ColorToIndex(r.foreground);
   int bg = ColorToIndex(r.background);
@@ -97,6 +119,5 @@ chtype TerminalColor::Theme(::Theme::Tag token, uint32_t flags) {
     Log() << init_pair(n, fg, bg);
     pit = pair_cache_.insert(std::make_pair(std::make_pair(fg, bg), n)).first;
   }
-  return cache_.insert(std::make_pair(key, COLOR_PAIR(pit->second)))
-      .first->second;
+  return cache_[attr] = COLOR_PAIR(pit->second);
 }
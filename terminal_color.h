@@ -1,27 +1,64 @@
 #pragma once
 
+#include <assert.h>
 #include <curses.h>
 #include <tuple>
+#include <vector>
 #include "theme.h"
 
 class TerminalColor {
  public:
   explicit TerminalColor(std::unique_ptr<::Theme> theme);
 
-  chtype Theme(::Theme::Tag token, uint32_t flags);
+  // A style plus render flags. Computing one is pure (beyond tag
+  // interning, which Theme synchronizes), so pane renderers can do it from
+  // worker threads; Resolve turns it into a curses attribute on the UI
+  // thread.
+  typedef uint32_t Attr;
+
+  Attr Theme(::Theme::Tag token, uint32_t flags) {
+    return Theme(theme_->InternTag(token), flags);
+  }
+  Attr Theme(::Theme::StyleID style, uint32_t flags) {
+    assert(flags < ::Theme::kNumFlagCombinations);
+    return style * ::Theme::kNumFlagCombinations + flags;
+  }
+
+  // UI thread only: may allocate curses colors and pairs
+  chtype Resolve(Attr attr) {
+    if (attr < cache_.size() && cache_[attr] != 0) return cache_[attr];
+    return ResolveSlow(attr);
+  }
+
+  ::Theme::StyleID Style(const ::Theme::Tag& token) {
+    return theme_->InternTag(token);
+  }
+  ::Theme::StyleID CombineStyles(::Theme::StyleID a, ::Theme::StyleID b) {
+    return theme_->CombineStyles(a, b);
+  }
 
  private:
   typedef std::tuple<uint8_t, uint8_t, uint8_t> RGB;
   typedef std::tuple<float, float, float> LAB;
 
   static LAB RGB2LAB(RGB x);
-  static float RGBDistance(RGB a, RGB b);
 
   int ColorToIndex(Theme::Color c);
+  // reads the terminal's palette into palette_* (once)
+  void LoadPalette();
+  // index of the palette entry perceptually closest to lab
+  int NearestPaletteColor(LAB lab) const;
+  chtype ResolveSlow(Attr attr);
 
   std::unique_ptr<::Theme> theme_;
-  std::map<std::pair<::Theme::Tag, uint32_t>, chtype> cache_;
+  // indexed by Attr; 0 ==> not yet resolved
+  std::vector<chtype> cache_;
   std::map<RGB, int> color_cache_;
+  // the terminal's palette in LAB, one array per component
+  bool palette_loaded_ = false;
+  std::vector<float> palette_l_;
+  std::vector<float> palette_a_;
+  std::vector<float> palette_b_;
   std::map<std::pair<int, int>, chtype> pair_cache_;
   int next_color_ = 16;
   int next_pair_ = 1;
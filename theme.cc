@@ -16,16 +16,19 @@
 #include <unordered_map>
 #include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
-#include "default_theme.h"
+#include "default_theme_table.h"
 #include "log.h"
-#include "plist.h"
-#include "read.h"
+#include "theme_source.h"
 
 #include <iostream>
 
-Theme::Theme(const std::string& filename) { Load(Read(filename)); }
+Theme::Theme(const std::string& filename) {
+  Load(ThemeSource::FromFile(filename));
+}
 
-Theme::Theme(default_type) { Load(default_theme); }
+Theme::Theme(default_type) {
+  Load(ThemeSource::FromTable(default_theme_table));
+}
 
 static Theme::Highlight Merge(Theme::Highlight a, Theme::Highlight b) {
   if (a == Theme::Highlight::UNSET) return b;
@@ -58,22 +61,15 @@ static absl::optional<Theme::Color> Merge(absl::optional<Theme::Color> a,
 }
 
 Theme::Result Theme::ThemeToken(Tag token, uint32_t flags) {
-  auto key = std::make_pair(token, flags);
-  auto it = theme_cache_.find(key);
-  if (it != theme_cache_.end()) return it->second;
-
-  Log() << "Theme: " << absl::StrJoin(token, ":") << " flags=" << flags;
+  return ThemeStyle(InternTag(token), flags);
+}
 
+Theme::Setting Theme::CompositeSetting(const Tag& tag) const {
   Setting composite;
-  for (auto sit = settings_.crbegin(); sit != settings_.crend(); ++sit) {
-    bool matches = false;
-    for (const auto& sel : sit->scopes) {
-      if (SelectorMatches(sel, token)) {
-        matches = true;
-        break;
-      }
-    }
-    if (!matches) continue;
+  // later settings take precedence
+  std::vector<uint32_t> matches = selectors_.Match(tag);
+  for (auto mit = matches.crbegin(); mit != matches.crend(); ++mit) {
+    const Setting* sit = &settings_[*mit];
     composite.font_style = Merge(composite.font_style, sit->font_style);
     composite.bracket_contents_options = Merge(
         composite.bracket_contents_options, sit->bracket_contents_options);
@@ -114,40 +110,87 @@ Theme::Result Theme::ThemeToken(Tag token, uint32_t flags) {
         Merge(composite.highlight_foreground, sit->highlight_foreground);
     composite.shadow = Merge(composite.shadow, sit->shadow);
   }
+  return composite;
+}
 
-  OptColor foreground = composite.foreground;
-  OptColor background = composite.background;
-  Highlight highlight = composite.font_style;
+Theme::Result Theme::ThemeStyle(StyleID style, uint32_t flags) {
+  const size_t idx = style * kNumFlagCombinations + flags;
+  if (idx < style_results_.size() && style_results_[idx]) {
+    return *style_results_[idx];
+  }
 
-  if (flags & HIGHLIGHT_LINE) {
-    background = Merge(composite.line_highlight, background);
+  Tag token = StyleTag(style);
+  Log() << "Theme: " << absl::StrJoin(token, ":");
+  const Setting composite = CompositeSetting(token);
+
+  // one composite serves every flag combination of the style
+  const size_t base = style * kNumFlagCombinations;
+  if (style_results_.size() < base + kNumFlagCombinations) {
+    style_results_.resize(base + kNumFlagCombinations);
   }
-  if (flags & SELECTED) {
-    background = Merge(composite.selection, background);
+  for (uint32_t f = 0; f < kNumFlagCombinations; f++) {
+    OptColor foreground = composite.foreground;
+    OptColor background = composite.background;
+    Highlight highlight = composite.font_style;
+
+    if (f & HIGHLIGHT_LINE) {
+      background = Merge(composite.line_highlight, background);
+    }
+    if (f & SELECTED) {
+      background = Merge(composite.selection, background);
+    }
+
+    style_results_[base + f] =
+        Result{foreground ? *foreground : Color{255, 255, 255, 255},
+               background ? *background : Color{0, 0, 0, 255},
+               highlight != Highlight::UNSET ? highlight : Highlight::NONE};
   }
+  return *style_results_[idx];
+}
 
-  Result result{foreground ? *foreground : Color{255, 255, 255, 255},
-                background ? *background : Color{0, 0, 0, 255},
-                highlight != Highlight::UNSET ? highlight : Highlight::NONE};
-  theme_cache_.insert(std::make_pair(key, result));
-  return result;
+Theme::StyleID Theme::InternTag(const Tag& tag) {
+  {
+    absl::ReaderMutexLock lock(&styles_mu_);
+    auto it = style_ids_.find(tag);
+    if (it != style_ids_.end()) return it->second;
+  }
+  absl::MutexLock lock(&styles_mu_);
+  return InternTagLocked(tag);
 }
 
-static std::string GetName(const plist::Dict* d) {
-  auto* name_node = d->Get("name");
-  if (!name_node) return "<<unnamed>>";
-  auto* str = name_node->AsString();
-  if (!str) return "<<name_not_string>>";
-  return *str;
+Theme::StyleID Theme::InternTagLocked(const Tag& tag) {
+  auto it = style_ids_.find(tag);
+  if (it != style_ids_.end()) return it->second;
+  StyleID id = styles_.size();
+  styles_.push_back(tag);
+  style_ids_.emplace(tag, id);
+  return id;
 }
 
-std::vector<Theme::Selector> Theme::ParseScopes(const plist::Dict* d) {
-  auto scopes_node = d->Get("scope");
-  if (!scopes_node) return {Selector()};
-  auto* str = scopes_node->AsString();
-  if (!str) throw std::runtime_error("scope not a string");
+Theme::StyleID Theme::CombineStyles(StyleID a, StyleID b) {
+  if (a == kDefaultStyle) return b;
+  if (b == kDefaultStyle) return a;
+  auto key = std::make_pair(a, b);
+  {
+    absl::ReaderMutexLock lock(&styles_mu_);
+    auto it = combined_styles_.find(key);
+    if (it != combined_styles_.end()) return it->second;
+  }
+  absl::MutexLock lock(&styles_mu_);
+  auto it = combined_styles_.find(key);
+  if (it != combined_styles_.end()) return it->second;
+  Tag tag = styles_[a];
+  tag.insert(tag.end(), styles_[b].begin(), styles_[b].end());
+  StyleID id = InternTagLocked(tag);
+  combined_styles_.emplace(key, id);
+  return id;
+}
+
+std::vector<Theme::Selector> Theme::ParseScopes(
+    const absl::optional<std::string>& scope) {
+  if (!scope) return {Selector()};
   std::vector<Selector> r;
-  for (auto alt : absl::StrSplit(*str, ',')) {
+  for (auto alt : absl::StrSplit(*scope, ',')) {
     Selector s;
     for (auto sel_row : absl::StrSplit(alt, ' ')) {
       if (sel_row.empty()) continue;
@@ -158,7 +201,7 @@ std::vector<Theme::Selector> Theme::ParseScopes(const plist::Dict* d) {
   return r;
 }
 
-void Theme::Load(const std::string& src) {
+void Theme::Load(const ThemeSource& source) {
   static const std::unordered_map<
       std::string, std::function<void(const std::string&, Setting*)>>
       load_setting = {
@@ -194,40 +237,27 @@ void Theme::Load(const std::string& src) {
           {"shadow", LoadColor<&Setting::shadow>()},
       };
 
-  auto root_node = plist::Parse(src);
-  if (!root_node) throw std::runtime_error("Failed to parse theme");
-  auto root = root_node->AsDict();
-  if (!root) throw std::runtime_error("Root not a dict");
-  auto settings_node = root->Get("settings");
-  if (!settings_node) throw std::runtime_error("No settings node");
-  auto settings = settings_node->AsArray();
-  if (!settings) throw std::runtime_error("Settings not an array");
-  for (const auto& top : *settings) {
+  for (const auto& src : source.settings) {
     Setting s;
-    auto top_dict = top->AsDict();
-    if (!top_dict) throw std::runtime_error("Setting not a dict");
-    auto name = GetName(top_dict);
     try {
-      s.scopes = ParseScopes(top_dict);
-      auto setting = top_dict->Get("settings");
-      if (!setting) throw std::runtime_error("No settings");
-      auto setting_dict = setting->AsDict();
-      if (!setting_dict) throw std::runtime_error("Setting not a dict");
-      for (const auto& kv : *setting_dict) {
+      s.scopes = ParseScopes(src.scope);
+      for (const auto& kv : src.values) {
         try {
           auto load_it = load_setting.find(kv.first);
           if (load_it == load_setting.end()) {
             throw std::runtime_error("Dont know how to load setting");
           }
-          auto value = kv.second->AsString();
-          if (!value) throw std::runtime_error("Value is not a string");
-          load_it->second(*value, &s);
+          load_it->second(kv.second, &s);
         } catch (std::exception& e) {
           throw std::runtime_error("Parsing '" + kv.first + "': " + e.what());
         }
       }
     } catch (std::exception& e) {
-      throw std::runtime_error("Parsing " + name + ": " + e.what());
+      throw std::runtime_error("Parsing " + src.name.value_or("<<unnamed>>") +
+                               ": " + e.what());
+    }
+    for (const auto& scope : s.scopes) {
+      selectors_.Add(scope, settings_.size());
     }
     settings_.push_back(s);
   }
@@ -17,12 +17,11 @@
 #include <string>
 #include <vector>
 
+#include "absl/synchronization/mutex.h"
 #include "absl/types/optional.h"
 #include "selector.h"
 
-namespace plist {
-class Dict;
-}
+struct ThemeSource;
 
 class Theme {
  public:
@@ -62,10 +61,31 @@ class Theme {
 
   typedef std::vector<std::string> Tag;
 
+  // Small integer handle for an interned Tag; renderers resolve these once
+  // per distinct tag set and then only deal in integers
+  typedef uint32_t StyleID;
+  static constexpr StyleID kDefaultStyle = 0;  // the empty Tag
+  static constexpr uint32_t kNumFlagCombinations = 4;
+
+  // Not thread safe: called while resolving styles on the UI thread
   Result ThemeToken(Tag token, uint32_t flags);
+  Result ThemeStyle(StyleID style, uint32_t flags);
+
+  // Style interning is thread safe: panes are drawn concurrently
+  StyleID InternTag(const Tag& tag) LOCKS_EXCLUDED(styles_mu_);
+  // style for a character carrying both tag sets (a's tags, then b's)
+  StyleID CombineStyles(StyleID a, StyleID b) LOCKS_EXCLUDED(styles_mu_);
+  Tag StyleTag(StyleID style) const LOCKS_EXCLUDED(styles_mu_) {
+    absl::ReaderMutexLock lock(&styles_mu_);
+    return styles_[style];
+  }
+  size_t num_styles() const LOCKS_EXCLUDED(styles_mu_) {
+    absl::ReaderMutexLock lock(&styles_mu_);
+    return styles_.size();
+  }
 
  private:
-  void Load(const std::string& src);
+  void Load(const ThemeSource& source);
 
   typedef absl::optional<Color> OptColor;
   typedef std::vector<std::string> Selector;
@@ -154,8 +174,22 @@ class Theme {
   };
   static void LoadIgnored(const std::string& value, Setting* setting) {}
 
-  std::vector<Selector> ParseScopes(const plist::Dict* d);
+  static std::vector<Selector> ParseScopes(
+      const absl::optional<std::string>& scope);
+  Setting CompositeSetting(const Tag& tag) const;
 
   std::vector<Setting> settings_;
-  std::map<std::pair<Tag, uint32_t>, Result> theme_cache_;
+  // every scope of every setting, valued by index into settings_
+  SelectorTrie selectors_;
+  // indexed by StyleID * kNumFlagCombinations + flags
+  std::vector<absl::optional<Result>> style_results_;
+
+  StyleID InternTagLocked(const Tag& tag) EXCLUSIVE_LOCKS_REQUIRED(styles_mu_);
+
+  mutable absl::Mutex styles_mu_;
+  std::vector<Tag> styles_ GUARDED_BY(styles_mu_){Tag()};
+  std::map<Tag, StyleID> style_ids_ GUARDED_BY(styles_mu_){
+      {Tag(), kDefaultStyle}};
+  std::map<std::pair<StyleID, StyleID>, StyleID> combined_styles_
+      GUARDED_BY(styles_mu_);
 };
@@ -0,0 +1,102 @@
+# Copyright 2017 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Flattens a TextMate .tmTheme plist into constant ThemeTable data (see
+# theme_source.h) so that built in themes need no XML parsing at startup.
+# usage: theme2c.py out.cc out.h symbol in.tmTheme
+
+import plistlib
+import sys
+
+out_cc, out_h, sym, inp = sys.argv[1:5]
+
+with open(inp, 'rb') as f:
+  if hasattr(plistlib, 'load'):
+    theme = plistlib.load(f)
+  else:
+    theme = plistlib.readPlist(f)
+
+
+def is_string(x):
+  try:
+    return isinstance(x, basestring)
+  except NameError:
+    return isinstance(x, str)
+
+
+def c_string(s):
+  if s is None:
+    return 'nullptr'
+  if not isinstance(s, bytes):
+    s = s.encode('utf-8')
+  out = '"'
+  for c in bytearray(s):
+    ch = chr(c)
+    if ch in '"\\?':
+      out += '\\' + ch
+    elif 32 <= c < 127:
+      out += ch
+    else:
+      out += '\\%03o' % c
+  return out + '"'
+
+
+def fail(msg):
+  sys.stderr.write('%s: %s\n' % (inp, msg))
+  sys.exit(1)
+
+
+settings = theme.get('settings')
+if not isinstance(settings, list):
+  fail('settings not an array')
+
+lines = ['#include "%s"' % out_h.split('/')[-1], '', 'namespace {', '']
+entries = []
+for i, setting in enumerate(settings):
+  if not isinstance(setting, dict):
+    fail('setting not a dict')
+  name = setting.get('name')
+  if not is_string(name):
+    name = None
+  scope = setting.get('scope')
+  if scope is not None and not is_string(scope):
+    fail('%s: scope not a string' % name)
+  values = setting.get('settings')
+  if not isinstance(values, dict):
+    fail('%s: no settings dict' % name)
+  lines.append('constexpr ThemeTableValue kValues%d[] = {' % i)
+  for key in sorted(values.keys()):
+    value = values[key]
+    if not is_string(value):
+      fail('%s: %s is not a string' % (name, key))
+    # the plist reader trims character data; match it
+    lines.append('    {%s, %s},' % (c_string(key), c_string(value.strip())))
+  if not values:
+    lines.append('    {nullptr, nullptr},')
+  lines.append('};')
+  entries.append('    {%s, %s, kValues%d, %d},' %
+                 (c_string(name), c_string(scope.strip() if scope else scope),
+                  i, len(values)))
+
+lines += ['', 'constexpr ThemeTableSetting kSettings[] = {']
+lines += entries
+lines += ['};', '', '}  // namespace', '']
+lines.append('const ThemeTable %s = {kSettings, %d};' % (sym, len(entries)))
+
+with open(out_cc, 'w') as f:
+  f.write('\n'.join(lines) + '\n')
+
+with open(out_h, 'w') as f:
+  f.write('#pragma once\n#include "theme_source.h"\n')
+  f.write('extern const ThemeTable %s;\n' % sym)
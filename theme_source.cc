@@ -0,0 +1,248 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "theme_source.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <functional>
+#include "absl/strings/str_cat.h"
+#include "log.h"
+#include "plist.h"
+#include "read.h"
+
+static const char kCacheMagic[8] = {'c', 'e', 'd', 't', 'h', 'm', '0', '1'};
+
+ThemeSource ThemeSource::FromTable(const ThemeTable& table) {
+  ThemeSource out;
+  out.settings.resize(table.num_settings);
+  for (size_t i = 0; i < table.num_settings; i++) {
+    const ThemeTableSetting& in = table.settings[i];
+    Setting& s = out.settings[i];
+    if (in.name) s.name = in.name;
+    if (in.scope) s.scope = in.scope;
+    for (size_t j = 0; j < in.num_values; j++) {
+      s.values.emplace_back(in.values[j].key, in.values[j].value);
+    }
+  }
+  return out;
+}
+
+static std::string ToString(absl::string_view s) {
+  return std::string(s.data(), s.length());
+}
+
+ThemeSource ThemeSource::FromPlist(const std::string& src) {
+  plist::Document doc(src);
+  auto root = doc.root();
+  if (!root) throw std::runtime_error("Failed to parse theme");
+  if (!root.IsDict()) throw std::runtime_error("Root not a dict");
+  auto settings = root.Get("settings");
+  if (!settings) throw std::runtime_error("No settings node");
+  if (!settings.IsArray()) throw std::runtime_error("Settings not an array");
+  ThemeSource out;
+  out.settings.reserve(settings.size());
+  for (size_t i = 0; i < settings.size(); i++) {
+    auto top = settings[i];
+    if (!top.IsDict()) throw std::runtime_error("Setting not a dict");
+    Setting s;
+    auto name = top.Get("name");
+    if (name.IsString()) s.name = ToString(name.AsString());
+    try {
+      if (auto scope = top.Get("scope")) {
+        if (!scope.IsString()) throw std::runtime_error("scope not a string");
+        s.scope = ToString(scope.AsString());
+      }
+      auto setting = top.Get("settings");
+      if (!setting) throw std::runtime_error("No settings");
+      if (!setting.IsDict()) throw std::runtime_error("Setting not a dict");
+      for (size_t j = 0; j < setting.size(); j++) {
+        std::string key = ToString(setting.key(j));
+        if (!setting[j].IsString()) {
+          throw std::runtime_error("Parsing '" + key +
+                                   "': Value is not a string");
+        }
+        s.values.emplace_back(std::move(key),
+                              ToString(setting[j].AsString()));
+      }
+    } catch (std::exception& e) {
+      throw std::runtime_error("Parsing " + s.name.value_or("<<unnamed>>") +
+                               ": " + e.what());
+    }
+    out.settings.emplace_back(std::move(s));
+  }
+  return out;
+}
+
+namespace {
+
+class CacheWriter {
+ public:
+  void U32(uint32_t x) { out_.append(reinterpret_cast<char*>(&x), 4); }
+  void U64(uint64_t x) { out_.append(reinterpret_cast<char*>(&x), 8); }
+  void Str(const std::string& s) {
+    U32(s.length());
+    out_.append(s);
+  }
+  void OptStr(const absl::optional<std::string>& s) {
+    U32(s ? 1 : 0);
+    if (s) Str(*s);
+  }
+  void Raw(const char* p, size_t n) { out_.append(p, n); }
+  std::string Finish() { return std::move(out_); }
+
+ private:
+  std::string out_;
+};
+
+// every read fails (returns false) once the input is exhausted
+class CacheReader {
+ public:
+  explicit CacheReader(const std::string& in) : in_(in) {}
+
+  bool Raw(void* p, size_t n) {
+    if (in_.length() - pos_ < n) return false;
+    memcpy(p, in_.data() + pos_, n);
+    pos_ += n;
+    return true;
+  }
+  bool U32(uint32_t* x) { return Raw(x, 4); }
+  bool U64(uint64_t* x) { return Raw(x, 8); }
+  bool Str(std::string* s) {
+    uint32_t len;
+    if (!U32(&len) || in_.length() - pos_ < len) return false;
+    s->assign(in_, pos_, len);
+    pos_ += len;
+    return true;
+  }
+  bool OptStr(absl::optional<std::string>* s) {
+    uint32_t present;
+    if (!U32(&present)) return false;
+    if (!present) return true;
+    s->emplace();
+    return Str(&**s);
+  }
+  bool done() const { return pos_ == in_.length(); }
+
+ private:
+  const std::string& in_;
+  size_t pos_ = 0;
+};
+
+}  // namespace
+
+std::string ThemeSource::Serialize(uint64_t stamp) const {
+  CacheWriter w;
+  w.Raw(kCacheMagic, sizeof(kCacheMagic));
+  w.U64(stamp);
+  w.U32(settings.size());
+  for (const auto& s : settings) {
+    w.OptStr(s.name);
+    w.OptStr(s.scope);
+    w.U32(s.values.size());
+    for (const auto& kv : s.values) {
+      w.Str(kv.first);
+      w.Str(kv.second);
+    }
+  }
+  return w.Finish();
+}
+
+absl::optional<ThemeSource> ThemeSource::Deserialize(const std::string& data,
+                                                     uint64_t stamp) {
+  CacheReader r(data);
+  char magic[sizeof(kCacheMagic)];
+  uint64_t got_stamp;
+  uint32_t num_settings;
+  if (!r.Raw(magic, sizeof(magic)) ||
+      memcmp(magic, kCacheMagic, sizeof(magic)) != 0 || !r.U64(&got_stamp) ||
+      got_stamp != stamp || !r.U32(&num_settings)) {
+    return absl::nullopt;
+  }
+  ThemeSource out;
+  for (uint32_t i = 0; i < num_settings; i++) {
+    Setting s;
+    uint32_t num_values;
+    if (!r.OptStr(&s.name) || !r.OptStr(&s.scope) || !r.U32(&num_values)) {
+      return absl::nullopt;
+    }
+    for (uint32_t j = 0; j < num_values; j++) {
+      std::string key, value;
+      if (!r.Str(&key) || !r.Str(&value)) return absl::nullopt;
+      s.values.emplace_back(std::move(key), std::move(value));
+    }
+    out.settings.emplace_back(std::move(s));
+  }
+  if (!r.done()) return absl::nullopt;
+  return out;
+}
+
+// the modification time, to the nanosecond where the platform keeps it
+static std::string MtimeString(const struct stat& st) {
+#ifdef __APPLE__
+  return absl::StrCat(st.st_mtimespec.tv_sec, ".", st.st_mtimespec.tv_nsec);
+#else
+  return absl::StrCat(st.st_mtim.tv_sec, ".", st.st_mtim.tv_nsec);
+#endif
+}
+
+ThemeSource ThemeSource::FromFile(const std::string& filename) {
+  struct stat st;
+  const char* home = getenv("HOME");
+  if (home == nullptr || stat(filename.c_str(), &st) != 0) {
+    return FromPlist(Read(filename));
+  }
+  // reading the theme is cheap next to parsing it: hashing its text too
+  // catches rewrites that keep the size and land within the mtime's
+  // resolution
+  const std::string src = Read(filename);
+  const uint64_t stamp = std::hash<std::string>()(
+      absl::StrCat(MtimeString(st), ":", src.size(), ":", src));
+  boost::filesystem::path cache_dir =
+      boost::filesystem::path(home) / ".cache" / "ced" / "themes";
+  boost::filesystem::path cache_file =
+      cache_dir /
+      absl::StrCat(std::hash<std::string>()(
+                       boost::filesystem::absolute(filename).string()),
+                   ".bin");
+
+  try {
+    if (boost::filesystem::exists(cache_file)) {
+      auto cached = Deserialize(Read(cache_file), stamp);
+      if (cached) return std::move(*cached);
+      Log() << "Stale theme cache " << cache_file << " for " << filename;
+    }
+  } catch (std::exception& e) {
+    Log() << "Failed reading theme cache " << cache_file << ": " << e.what();
+  }
+
+  ThemeSource source = FromPlist(src);
+
+  // best effort: a theme that can't be cached still loads
+  try {
+    boost::filesystem::create_directories(cache_dir);
+    boost::filesystem::path tmp = cache_file;
+    tmp += ".tmp";
+    {
+      std::ofstream out(tmp.string(), std::ios::binary | std::ios::trunc);
+      out << source.Serialize(stamp);
+      if (!out) throw std::runtime_error("write failed");
+    }
+    boost::filesystem::rename(tmp, cache_file);
+  } catch (std::exception& e) {
+    Log() << "Failed writing theme cache " << cache_file << ": " << e.what();
+  }
+  return source;
+}
@@ -0,0 +1,65 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "absl/types/optional.h"
+
+// A TextMate theme flattened to its settings, values still spelled as in
+// the theme file. theme2c.py emits these as constant tables at build time
+// so built in themes load without parsing any XML.
+struct ThemeTableValue {
+  const char* key;
+  const char* value;
+};
+
+struct ThemeTableSetting {
+  const char* name;   // nullptr if unnamed
+  const char* scope;  // nullptr if the setting has no scope
+  const ThemeTableValue* values;
+  size_t num_values;
+};
+
+struct ThemeTable {
+  const ThemeTableSetting* settings;
+  size_t num_settings;
+};
+
+// Owned form of a ThemeTable, from a .tmTheme file or a theme cache
+struct ThemeSource {
+  struct Setting {
+    absl::optional<std::string> name;
+    absl::optional<std::string> scope;
+    std::vector<std::pair<std::string, std::string>> values;
+  };
+  std::vector<Setting> settings;
+
+  static ThemeSource FromTable(const ThemeTable& table);
+  // throws if src is not a well formed theme plist
+  static ThemeSource FromPlist(const std::string& src);
+  // Loads a .tmTheme file, going through a binary cache under
+  // ~/.cache/ced/themes that is keyed by path and invalidated when the
+  // file's contents or (nanosecond) modification time change
+  static ThemeSource FromFile(const std::string& filename);
+
+  // binary cache format; stamp identifies the source file's version
+  std::string Serialize(uint64_t stamp) const;
+  // nullopt if data is not a cache entry for stamp
+  static absl::optional<ThemeSource> Deserialize(const std::string& data,
+                                                 uint64_t stamp);
+};
@@ -0,0 +1,89 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "theme_source.h"
+#include <gtest/gtest.h>
+
+static const char* kTheme =
+    R"(<!DOCTYPE plist PUBLIC "-//Apple Computer//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+  <key>settings</key>
+  <array>
+    <dict>
+      <key>settings</key>
+      <dict>
+        <key>foreground</key>
+        <string>#ffffff</string>
+      </dict>
+    </dict>
+    <dict>
+      <key>name</key>
+      <string>Comment</string>
+      <key>scope</key>
+      <string>comment, punctuation.definition.comment</string>
+      <key>settings</key>
+      <dict>
+        <key>fontStyle</key>
+        <string>italic</string>
+      </dict>
+    </dict>
+  </array>
+</dict>
+</plist>
+)";
+
+static void ExpectSame(const ThemeSource& a, const ThemeSource& b) {
+  ASSERT_EQ(a.settings.size(), b.settings.size());
+  for (size_t i = 0; i < a.settings.size(); i++) {
+    EXPECT_EQ(a.settings[i].name, b.settings[i].name);
+    EXPECT_EQ(a.settings[i].scope, b.settings[i].scope);
+    EXPECT_EQ(a.settings[i].values, b.settings[i].values);
+  }
+}
+
+TEST(ThemeSource, FromPlist) {
+  ThemeSource src = ThemeSource::FromPlist(kTheme);
+  ASSERT_EQ(2, src.settings.size());
+  EXPECT_FALSE(src.settings[0].name);
+  EXPECT_FALSE(src.settings[0].scope);
+  EXPECT_EQ("Comment", *src.settings[1].name);
+  EXPECT_EQ("comment, punctuation.definition.comment",
+            *src.settings[1].scope);
+  EXPECT_EQ((std::vector<std::pair<std::string, std::string>>{
+                {"fontStyle", "italic"}}),
+            src.settings[1].values);
+}
+
+TEST(ThemeSource, FromTableMatchesPlist) {
+  static const ThemeTableValue kGlobal[] = {{"foreground", "#ffffff"}};
+  static const ThemeTableValue kComment[] = {{"fontStyle", "italic"}};
+  static const ThemeTableSetting kSettings[] = {
+      {nullptr, nullptr, kGlobal, 1},
+      {"Comment", "comment, punctuation.definition.comment", kComment, 1},
+  };
+  ExpectSame(ThemeSource::FromPlist(kTheme),
+             ThemeSource::FromTable(ThemeTable{kSettings, 2}));
+}
+
+TEST(ThemeSource, CacheRoundTrip) {
+  ThemeSource src = ThemeSource::FromPlist(kTheme);
+  std::string data = src.Serialize(42);
+  auto back = ThemeSource::Deserialize(data, 42);
+  ASSERT_TRUE(back);
+  ExpectSame(src, *back);
+  // a different source version or a damaged entry is a miss
+  EXPECT_FALSE(ThemeSource::Deserialize(data, 43));
+  EXPECT_FALSE(ThemeSource::Deserialize(data.substr(0, data.length() - 1), 42));
+  EXPECT_FALSE(ThemeSource::Deserialize(data + "x", 42));
+}
@@ -27,3 +27,16 @@ TEST(Theme, DefaultNoScope) {
   EXPECT_EQ((Theme::Color{0x28, 0x2c, 0x34, 0xff}), r.background);
   EXPECT_EQ(Theme::Highlight::NONE, r.highlight);
 }
+
+TEST(Theme, InternedStyles) {
+  Theme theme(Theme::DEFAULT);
+  EXPECT_EQ(Theme::kDefaultStyle, theme.InternTag(Theme::Tag()));
+  auto a = theme.InternTag({"comment"});
+  auto b = theme.InternTag({"invalid"});
+  EXPECT_NE(a, b);
+  EXPECT_EQ(a, theme.InternTag({"comment"}));
+  EXPECT_EQ(a, theme.CombineStyles(a, Theme::kDefaultStyle));
+  auto ab = theme.CombineStyles(a, b);
+  EXPECT_EQ(ab, theme.InternTag({"comment", "invalid"}));
+  EXPECT_EQ((Theme::Tag{"comment", "invalid"}), theme.StyleTag(ab));
+}
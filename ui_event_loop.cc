@@ -0,0 +1,136 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ui_event_loop.h"
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdexcept>
+#include "wrap_syscall.h"
+
+static int TimeoutMillis(absl::Duration timeout) {
+  if (timeout == absl::InfiniteDuration()) return -1;
+  if (timeout <= absl::ZeroDuration()) return 0;
+  // round up so we never wake just before a deadline
+  return static_cast<int>(
+      absl::ToInt64Milliseconds(timeout + absl::Milliseconds(1) -
+                                absl::Nanoseconds(1)));
+}
+
+void UIEventLoop::Signal() {
+  if (pending_.exchange(true, std::memory_order_acq_rel)) return;
+#ifdef __linux__
+  uint64_t one = 1;
+  WrapSyscall("write", [&]() { return write(event_fd_, &one, sizeof(one)); });
+#else
+  char c = 0;
+  WrapSyscall("write", [&]() { return write(pipe_[kWriteEnd], &c, 1); });
+#endif
+}
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+UIEventLoop::UIEventLoop(int input_fd) : input_fd_(input_fd) {
+  epoll_fd_ = WrapSyscall("epoll_create1",
+                          []() { return epoll_create1(EPOLL_CLOEXEC); });
+  event_fd_ = WrapSyscall(
+      "eventfd", []() { return eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); });
+  for (int fd : {input_fd_, event_fd_}) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    WrapSyscall("epoll_ctl",
+                [&]() { return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev); });
+  }
+}
+
+UIEventLoop::~UIEventLoop() {
+  close(event_fd_);
+  close(epoll_fd_);
+}
+
+void UIEventLoop::Drain() {
+  uint64_t n;
+  if (read(event_fd_, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+    throw std::runtime_error("Failed draining eventfd");
+  }
+}
+
+UIEventLoop::Result UIEventLoop::Wait(absl::Duration timeout) {
+  Result result;
+  struct epoll_event events[2];
+  int n = epoll_wait(epoll_fd_, events, 2, TimeoutMillis(timeout));
+  if (n < 0) {
+    if (errno != EINTR) throw std::runtime_error("epoll_wait failed");
+    result.input = true;
+    return result;
+  }
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.fd == input_fd_) result.input = true;
+    if (events[i].data.fd == event_fd_) result.signalled = true;
+  }
+  if (result.signalled) {
+    // drain before clearing pending_: a Signal() that still sees pending_ set
+    // published its state before we return, so the frame the caller renders
+    // next covers it; later Signal()s write a fresh wakeup
+    Drain();
+    pending_.store(false, std::memory_order_release);
+  }
+  return result;
+}
+#else  // portable fallback: self pipe + poll
+#include <fcntl.h>
+#include <poll.h>
+
+UIEventLoop::UIEventLoop(int input_fd) : input_fd_(input_fd) {
+  WrapSyscall("pipe", [this]() { return pipe(pipe_); });
+  for (int fd : {pipe_[kReadEnd], pipe_[kWriteEnd]}) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+}
+
+UIEventLoop::~UIEventLoop() {
+  close(pipe_[kReadEnd]);
+  close(pipe_[kWriteEnd]);
+}
+
+void UIEventLoop::Drain() {
+  char buf[64];
+  while (read(pipe_[kReadEnd], buf, sizeof(buf)) > 0) {
+  }
+}
+
+UIEventLoop::Result UIEventLoop::Wait(absl::Duration timeout) {
+  Result result;
+  struct pollfd poll_fds[] = {
+      {input_fd_, POLLIN, 0},
+      {pipe_[kReadEnd], POLLIN, 0},
+  };
+  int n = poll(poll_fds, 2, TimeoutMillis(timeout));
+  if (n < 0) {
+    if (errno != EINTR) throw std::runtime_error("poll failed");
+    result.input = true;
+    return result;
+  }
+  result.input = poll_fds[0].revents != 0;
+  result.signalled = poll_fds[1].revents != 0;
+  if (result.signalled) {
+    Drain();
+    pending_.store(false, std::memory_order_release);
+  }
+  return result;
+}
+#endif
@@ -0,0 +1,55 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <atomic>
+#include "absl/time/time.h"
+
+// Blocks the UI thread until terminal input is readable or some other thread
+// asks for a redraw. Any number of Signal() calls between two Wait()s wake
+// the loop exactly once.
+class UIEventLoop {
+ public:
+  explicit UIEventLoop(int input_fd);
+  ~UIEventLoop();
+
+  UIEventLoop(const UIEventLoop&) = delete;
+  UIEventLoop& operator=(const UIEventLoop&) = delete;
+
+  // thread safe
+  void Signal();
+
+  struct Result {
+    // input_fd is readable, or the wait was interrupted by a signal (eg
+    // SIGWINCH) that the input layer will want to report
+    bool input = false;
+    bool signalled = false;
+  };
+
+  Result Wait(absl::Duration timeout);
+
+ private:
+  void Drain();
+
+  const int input_fd_;
+  std::atomic<bool> pending_{false};
+#ifdef __linux__
+  int epoll_fd_;
+  int event_fd_;
+#else
+  static constexpr int kWriteEnd = 1;
+  static constexpr int kReadEnd = 0;
+  int pipe_[2];
+#endif
+};
@@ -0,0 +1,59 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ui_event_loop.h"
+#include <unistd.h>
+#include <thread>
+#include "gtest/gtest.h"
+
+class UIEventLoopTest : public ::testing::Test {
+ protected:
+  UIEventLoopTest() {
+    if (pipe(input_) != 0) abort();
+  }
+  ~UIEventLoopTest() {
+    close(input_[0]);
+    close(input_[1]);
+  }
+
+  int input_[2];
+};
+
+TEST_F(UIEventLoopTest, TimesOut) {
+  UIEventLoop loop(input_[0]);
+  auto r = loop.Wait(absl::Milliseconds(1));
+  EXPECT_FALSE(r.input);
+  EXPECT_FALSE(r.signalled);
+}
+
+TEST_F(UIEventLoopTest, SignalsCoalesce) {
+  UIEventLoop loop(input_[0]);
+  for (int i = 0; i < 100; i++) loop.Signal();
+  auto r = loop.Wait(absl::InfiniteDuration());
+  EXPECT_TRUE(r.signalled);
+  EXPECT_FALSE(r.input);
+  r = loop.Wait(absl::ZeroDuration());
+  EXPECT_FALSE(r.signalled);
+}
+
+TEST_F(UIEventLoopTest, InputWakes) {
+  UIEventLoop loop(input_[0]);
+  std::thread writer([this]() {
+    char c = 'x';
+    EXPECT_EQ(1, write(input_[1], &c, 1));
+  });
+  auto r = loop.Wait(absl::InfiniteDuration());
+  writer.join();
+  EXPECT_TRUE(r.input);
+  EXPECT_FALSE(r.signalled);
+}
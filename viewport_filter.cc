@@ -0,0 +1,149 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "viewport_filter.h"
+#include <gflags/gflags.h>
+#include <algorithm>
+
+DEFINE_int32(viewport_margin_lines, 100,
+             "Lines either side of a client's viewport whose annotations are "
+             "streamed to it; the rest follow as it scrolls (negative: send "
+             "every annotation)");
+
+ViewportFilter::ViewportFilter()
+    : ViewportFilter(FLAGS_viewport_margin_lines) {}
+
+ViewportFilter::ViewportFilter(int margin) : margin_(margin) {}
+
+void ViewportFilter::SetViewport(ID first_line, int lines,
+                                 const LineOf& line_of, CommandSet* release) {
+  lines = std::max(0, lines);
+  if (first_line_ && *first_line_ == first_line && lines_ == lines) return;
+  first_line_ = first_line;
+  lines_ = lines;
+  // every held mark is at a new distance from the new window
+  std::vector<uint64_t> ids;
+  for (const auto& held : held_) ids.push_back(held.first);
+  Recheck(std::move(ids), CurrentWindow(line_of), line_of, release);
+}
+
+absl::optional<ViewportFilter::Window> ViewportFilter::CurrentWindow(
+    const LineOf& line_of) const {
+  if (margin_ < 0 || !first_line_) return absl::optional<Window>();
+  // resolved on each use: edits above the viewport move its line number
+  absl::optional<int> first = line_of(*first_line_);
+  if (!first) return absl::optional<Window>();
+  return Window{*first - margin_, *first + lines_ + margin_};
+}
+
+int ViewportFilter::Distance(const Annotation& annotation,
+                             const absl::optional<Window>& window,
+                             const LineOf& line_of) {
+  if (!window) return 0;
+  absl::optional<int> begin = line_of(annotation.begin());
+  absl::optional<int> end = line_of(annotation.end());
+  if (!begin || !end) return 0;
+  const int first = std::min(*begin, *end);
+  const int last = std::max(*begin, *end);
+  if (last < window->first) return window->first - last;
+  if (first > window->last) return first - window->last;
+  return 0;
+}
+
+bool ViewportFilter::MaybeHold(Command command,
+                               const absl::optional<Window>& window,
+                               const LineOf& line_of) {
+  const uint64_t id = command.id();
+  // a mark sent again replaces the one held
+  auto it = held_.find(id);
+  if (it != held_.end()) {
+    due_.erase(it->second.due);
+    held_.erase(it);
+  }
+  const int distance = Distance(command.mark(), window, line_of);
+  if (distance == 0) return false;
+  Held& held = held_[id];
+  held.command = std::move(command);
+  held.due = due_.emplace(deletions_ + distance, id);
+  return true;
+}
+
+void ViewportFilter::Recheck(std::vector<uint64_t> ids,
+                             const absl::optional<Window>& window,
+                             const LineOf& line_of, CommandSet* out) {
+  for (uint64_t id : ids) {
+    auto it = held_.find(id);
+    Command command = std::move(it->second.command);
+    due_.erase(it->second.due);
+    held_.erase(it);
+    if (!MaybeHold(command, window, line_of)) {
+      *out->add_commands() = std::move(command);
+    }
+  }
+}
+
+void ViewportFilter::Filter(const CommandSet& in, const LineOf& line_of,
+                            CommandSet* out) {
+  absl::optional<Window> window = CurrentWindow(line_of);
+  if (!window && !held_.empty()) {
+    // nothing to scope to any more
+    std::vector<uint64_t> ids;
+    for (const auto& held : held_) ids.push_back(held.first);
+    Recheck(std::move(ids), window, line_of, out);
+  }
+  for (const auto& cmd : in.commands()) {
+    switch (cmd.command_case()) {
+      case Command::kDelete:
+        deletions_++;
+        break;
+      case Command::kMark:
+        if (MaybeHold(cmd, window, line_of)) continue;
+        break;
+      case Command::kDelMark: {
+        // deleted before the client saw it: it never needs to
+        auto it = held_.find(cmd.id());
+        if (it != held_.end()) {
+          due_.erase(it->second.due);
+          held_.erase(it);
+          continue;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    *out->add_commands() = cmd;
+  }
+  // deleted lines pull held marks towards the window, but no further than
+  // one line a deletion
+  std::vector<uint64_t> ids;
+  for (auto it = due_.begin(); it != due_.end() && it->first <= deletions_;
+       ++it) {
+    ids.push_back(it->second);
+  }
+  if (!ids.empty()) Recheck(std::move(ids), window, line_of, out);
+}
+
+void ViewportFilter::FilterSnapshot(const AnnotatedStringMsg& snapshot,
+                                    const LineOf& line_of,
+                                    AnnotatedStringMsg* out) {
+  absl::optional<Window> window = CurrentWindow(line_of);
+  for (const auto& anno : snapshot.annotations()) {
+    Command cmd;
+    cmd.set_id(anno.id());
+    *cmd.mutable_mark() = anno.anno();
+    if (!MaybeHold(std::move(cmd), window, line_of)) {
+      *out->add_annotations() = anno;
+    }
+  }
+}
@@ -0,0 +1,101 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "absl/types/optional.h"
+#include "annotated_string.h"
+
+// Scopes the annotations sent to one client to the lines it displays, plus
+// a margin either side. Marks elsewhere are held back, and released once
+// the window moves over them; a mark deleted while held is never sent.
+// Every other command passes straight through, so the client's text and
+// the attributes marks refer to are always complete.
+//
+// A held mark is only looked at again once the window moves, or once enough
+// text has been deleted that it could have come within reach: each deleted
+// character takes at most one line break with it.
+class ViewportFilter {
+ public:
+  // line number of the line holding a character; nullopt if not known yet,
+  // in which case marks touching it are sent
+  typedef std::function<absl::optional<int>(ID)> LineOf;
+
+  // margin from --viewport_margin_lines
+  ViewportFilter();
+  // a negative margin sends everything
+  explicit ViewportFilter(int margin);
+
+  ViewportFilter(const ViewportFilter&) = delete;
+  ViewportFilter& operator=(const ViewportFilter&) = delete;
+
+  // Until the first viewport is set everything is sent. Held marks that the
+  // new window covers are appended to release.
+  void SetViewport(ID first_line, int lines, const LineOf& line_of,
+                   CommandSet* release);
+
+  // Appends to out the commands in `in` to send now, holding the rest; held
+  // marks that edits have moved into the window are released into out too.
+  void Filter(const CommandSet& in, const LineOf& line_of, CommandSet* out);
+
+  // As Filter, for the annotations of a snapshot: out gets only the
+  // annotations to send now, and none of the rest of the snapshot
+  void FilterSnapshot(const AnnotatedStringMsg& snapshot,
+                      const LineOf& line_of, AnnotatedStringMsg* out);
+
+  bool enabled() const { return margin_ >= 0; }
+  size_t held() const { return held_.size(); }
+
+ private:
+  struct Window {
+    int first;
+    int last;
+    bool operator==(const Window& other) const {
+      return first == other.first && last == other.last;
+    }
+  };
+
+  // deletions seen when a held mark must be checked again -> its id
+  typedef std::multimap<uint64_t, uint64_t> Due;
+  struct Held {
+    Command command;
+    Due::iterator due;
+  };
+
+  // the current window of lines (inclusive), nullopt to send everything
+  absl::optional<Window> CurrentWindow(const LineOf& line_of) const;
+  // lines between annotation and window; 0 if it is to be sent
+  static int Distance(const Annotation& annotation,
+                      const absl::optional<Window>& window,
+                      const LineOf& line_of);
+  // holds command unless it is visible; true if held
+  bool MaybeHold(Command command, const absl::optional<Window>& window,
+                 const LineOf& line_of);
+  // checks the held marks ids against window again, releasing those it
+  // covers into out
+  void Recheck(std::vector<uint64_t> ids, const absl::optional<Window>& window,
+               const LineOf& line_of, CommandSet* out);
+
+  const int margin_;
+  absl::optional<ID> first_line_;
+  int lines_ = 0;
+  // delete commands seen so far
+  uint64_t deletions_ = 0;
+  // mark id -> its command
+  std::unordered_map<uint64_t, Held> held_;
+  Due due_;
+};
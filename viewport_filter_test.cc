@@ -0,0 +1,204 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "viewport_filter.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+// characters of site 1 sit on line clock / 100; other sites are unknown
+absl::optional<int> LineOf(ID id) {
+  if (id.site != 1) return absl::optional<int>();
+  return id.clock / 100;
+}
+
+ID Char(int line) { return ID(1, line * 100); }
+
+Command Mark(uint64_t clock, int first_line, int last_line) {
+  Command cmd;
+  cmd.set_id(ID(2, clock).id);
+  cmd.mutable_mark()->set_begin(Char(first_line).id);
+  cmd.mutable_mark()->set_end(Char(last_line).id);
+  return cmd;
+}
+
+Command DelMark(uint64_t clock) {
+  Command cmd;
+  cmd.set_id(ID(2, clock).id);
+  cmd.mutable_del_mark();
+  return cmd;
+}
+
+Command Insert(uint64_t clock) {
+  Command cmd;
+  cmd.set_id(ID(3, clock).id);
+  cmd.mutable_insert()->set_characters("x");
+  return cmd;
+}
+
+CommandSet Cmds(std::initializer_list<Command> cmds) {
+  CommandSet set;
+  for (const auto& c : cmds) *set.add_commands() = c;
+  return set;
+}
+
+std::vector<uint64_t> Ids(const CommandSet& set) {
+  std::vector<uint64_t> ids;
+  for (const auto& c : set.commands()) ids.push_back(c.id());
+  return ids;
+}
+
+}  // namespace
+
+TEST(ViewportFilterTest, SendsEverythingUntilAViewportIsSet) {
+  ViewportFilter filter(10);
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 500, 500), Insert(1)}), LineOf, &out);
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 1).id, ID(3, 1).id}), Ids(out));
+  EXPECT_EQ(0, filter.held());
+}
+
+TEST(ViewportFilterTest, HoldsMarksOutsideTheWindow) {
+  ViewportFilter filter(10);
+  CommandSet release;
+  filter.SetViewport(Char(100), 20, LineOf, &release);
+  EXPECT_EQ(0, release.commands_size());
+
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 85, 89), Mark(2, 90, 90), Mark(3, 130, 131),
+                      Mark(4, 131, 140), Mark(5, 0, 1000), Insert(1)}),
+                LineOf, &out);
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 2).id, ID(2, 3).id, ID(2, 5).id,
+                                   ID(3, 1).id}),
+            Ids(out));
+  EXPECT_EQ(2, filter.held());
+}
+
+TEST(ViewportFilterTest, ReleasesHeldMarksOnScroll) {
+  ViewportFilter filter(0);
+  CommandSet release;
+  filter.SetViewport(Char(0), 10, LineOf, &release);
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 50, 50), Mark(2, 200, 200)}), LineOf, &out);
+  EXPECT_EQ(0, out.commands_size());
+
+  filter.SetViewport(Char(45), 10, LineOf, &release);
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 1).id}), Ids(release));
+  EXPECT_EQ(1, filter.held());
+
+  // marks already sent aren't sent again
+  release.Clear();
+  filter.SetViewport(Char(40), 10, LineOf, &release);
+  EXPECT_EQ(0, release.commands_size());
+}
+
+TEST(ViewportFilterTest, ReleasesHeldMarksEditsMoveIntoTheWindow) {
+  ViewportFilter filter(0);
+  // lines deleted below the viewport, pulling those after them up
+  int deleted = 0;
+  auto line_of = [&deleted](ID id) {
+    absl::optional<int> line = LineOf(id);
+    if (line && *line > 20) *line = std::max(20, *line - deleted);
+    return line;
+  };
+  CommandSet release;
+  filter.SetViewport(Char(10), 10, line_of, &release);
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 50, 50), Mark(2, 200, 200)}), line_of, &out);
+  EXPECT_EQ(0, out.commands_size());
+
+  // each deleted character takes at most one line break with it
+  CommandSet dels;
+  for (deleted = 0; deleted < 35; deleted++) {
+    Command* del = dels.add_commands();
+    del->set_id(ID(1, 2100 + deleted).id);
+    del->mutable_delete_();
+  }
+  filter.Filter(dels, line_of, &out);
+  ASSERT_EQ(36, out.commands_size());
+  EXPECT_EQ(ID(2, 1).id, out.commands(35).id());
+  EXPECT_EQ(1, filter.held());
+}
+
+TEST(ViewportFilterTest, LeavesHeldMarksOutOfReachOfEdits) {
+  ViewportFilter filter(0);
+  int lookups = 0;
+  auto line_of = [&lookups](ID id) {
+    if (id == Char(500)) lookups++;
+    return LineOf(id);
+  };
+  CommandSet release;
+  filter.SetViewport(Char(0), 10, line_of, &release);
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 500, 500)}), line_of, &out);
+  lookups = 0;
+  Command del;
+  del.set_id(ID(1, 2100).id);
+  del.mutable_delete_();
+  filter.Filter(Cmds({del, Insert(1)}), line_of, &out);
+  EXPECT_EQ(0, lookups);
+  EXPECT_EQ(1, filter.held());
+}
+
+TEST(ViewportFilterTest, DropsDeletionsOfHeldMarks) {
+  ViewportFilter filter(0);
+  CommandSet release;
+  filter.SetViewport(Char(0), 10, LineOf, &release);
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 50, 50), Mark(2, 5, 5)}), LineOf, &out);
+  out.Clear();
+  filter.Filter(Cmds({DelMark(1), DelMark(2)}), LineOf, &out);
+  EXPECT_EQ((std::vector<uint64_t>{ID(2, 2).id}), Ids(out));
+  EXPECT_EQ(0, filter.held());
+}
+
+TEST(ViewportFilterTest, SendsMarksOnUnknownText) {
+  ViewportFilter filter(0);
+  CommandSet release;
+  filter.SetViewport(Char(0), 10, LineOf, &release);
+  Command mark = Mark(1, 50, 50);
+  mark.mutable_mark()->set_end(ID(4, 1).id);
+  CommandSet out;
+  filter.Filter(Cmds({mark}), LineOf, &out);
+  EXPECT_EQ(1, out.commands_size());
+}
+
+TEST(ViewportFilterTest, HoldsSnapshotAnnotations) {
+  ViewportFilter filter(0);
+  CommandSet release;
+  filter.SetViewport(Char(0), 10, LineOf, &release);
+  AnnotatedStringMsg snapshot;
+  for (auto cmd : {Mark(1, 1, 2), Mark(2, 50, 50), Mark(3, 3, 3)}) {
+    auto* anno = snapshot.add_annotations();
+    anno->set_id(cmd.id());
+    *anno->mutable_anno() = cmd.mark();
+  }
+  AnnotatedStringMsg filtered;
+  filter.FilterSnapshot(snapshot, LineOf, &filtered);
+  ASSERT_EQ(2, filtered.annotations_size());
+  EXPECT_EQ(ID(2, 1).id, filtered.annotations(0).id());
+  EXPECT_EQ(ID(2, 3).id, filtered.annotations(1).id());
+
+  filter.SetViewport(Char(50), 10, LineOf, &release);
+  ASSERT_EQ(1, release.commands_size());
+  EXPECT_EQ(Char(50).id, release.commands(0).mark().begin());
+}
+
+TEST(ViewportFilterTest, NegativeMarginSendsEverything) {
+  ViewportFilter filter(-1);
+  CommandSet release;
+  filter.SetViewport(Char(0), 10, LineOf, &release);
+  CommandSet out;
+  filter.Filter(Cmds({Mark(1, 500, 500)}), LineOf, &out);
+  EXPECT_EQ(1, out.commands_size());
+}
@@ -0,0 +1,83 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "worker_pool.h"
+#include <algorithm>
+
+WorkerPool::WorkerPool(int threads) {
+  for (int i = 0; i < std::max(1, threads); i++) {
+    threads_.emplace_back([this]() { Work(); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    absl::MutexLock lock(&mu_);
+    shutdown_ = true;
+  }
+  for (auto& t : threads_) t.join();
+}
+
+void WorkerPool::Run(std::function<void()> work) {
+  absl::MutexLock lock(&mu_);
+  queue_.emplace_back(std::move(work));
+}
+
+void WorkerPool::Fork(size_t n, const std::function<void()>& work) {
+  struct Join {
+    absl::Mutex mu;
+    bool closed GUARDED_BY(mu) = false;
+    int running GUARDED_BY(mu) = 0;
+  };
+  // outlives the call for runs that only start after it returns
+  auto join = std::make_shared<Join>();
+  const size_t helpers = std::min(n > 0 ? n - 1 : 0, threads_.size());
+  for (size_t i = 0; i < helpers; i++) {
+    Run([join, &work]() {
+      {
+        absl::MutexLock lock(&join->mu);
+        if (join->closed) return;
+        join->running++;
+      }
+      work();
+      absl::MutexLock lock(&join->mu);
+      join->running--;
+    });
+  }
+  work();
+  absl::MutexLock lock(&join->mu);
+  join->closed = true;
+  auto joined = [&join]() {
+    join->mu.AssertHeld();
+    return join->running == 0;
+  };
+  join->mu.Await(absl::Condition(&joined));
+}
+
+void WorkerPool::Work() {
+  auto has_work = [this]() {
+    mu_.AssertHeld();
+    return !queue_.empty() || shutdown_;
+  };
+  for (;;) {
+    std::function<void()> work;
+    {
+      absl::MutexLock lock(&mu_);
+      mu_.Await(absl::Condition(&has_work));
+      if (queue_.empty()) return;  // shutdown_
+      work = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    work();
+  }
+}
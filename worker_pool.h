@@ -0,0 +1,52 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "absl/synchronization/mutex.h"
+
+// A fixed set of threads running work in the order it was queued. However
+// much work arrives, no more than that many pieces of it run at once.
+class WorkerPool {
+ public:
+  // at least one thread, whatever threads says
+  explicit WorkerPool(int threads);
+  // finishes the work already queued
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // work must not throw
+  void Run(std::function<void()> work) LOCKS_EXCLUDED(mu_);
+  // Splits one job: runs work on the calling thread and on up to n - 1 of
+  // the pool's, returning once every run that started has returned. Runs
+  // still queued when the caller's returns are skipped, so work should keep
+  // taking pieces of the job until none are left. work must not throw.
+  void Fork(size_t n, const std::function<void()>& work) LOCKS_EXCLUDED(mu_);
+
+  size_t threads() const { return threads_.size(); }
+
+ private:
+  void Work() LOCKS_EXCLUDED(mu_);
+
+  absl::Mutex mu_;
+  std::deque<std::function<void()>> queue_ GUARDED_BY(mu_);
+  bool shutdown_ GUARDED_BY(mu_) = false;
+  std::vector<std::thread> threads_;
+};
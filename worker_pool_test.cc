@@ -0,0 +1,85 @@
+// Copyright 2017 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "worker_pool.h"
+#include <atomic>
+#include <vector>
+#include "gtest/gtest.h"
+
+TEST(WorkerPoolTest, FinishesQueuedWorkBeforeGoing) {
+  std::atomic<int> done(0);
+  {
+    WorkerPool pool(2);
+    for (int i = 0; i < 100; i++) pool.Run([&done]() { done++; });
+  }
+  EXPECT_EQ(100, done);
+}
+
+TEST(WorkerPoolTest, RunsNoMoreThanItsThreadsAtOnce) {
+  absl::Mutex mu;
+  int running = 0;
+  int most = 0;
+  bool go = false;
+  {
+    WorkerPool pool(3);
+    EXPECT_EQ(3u, pool.threads());
+    for (int i = 0; i < 10; i++) {
+      pool.Run([&]() {
+        absl::MutexLock lock(&mu);
+        running++;
+        most = std::max(most, running);
+        mu.Await(absl::Condition(&go));
+        running--;
+      });
+    }
+    absl::MutexLock lock(&mu);
+    auto all_busy = [&]() { return running == 3; };
+    mu.Await(absl::Condition(&all_busy));
+    go = true;
+  }
+  EXPECT_EQ(3, most);
+}
+
+TEST(WorkerPoolTest, RunsWithAtLeastOneThread) {
+  std::atomic<bool> done(false);
+  {
+    WorkerPool pool(0);
+    pool.Run([&done]() { done = true; });
+  }
+  EXPECT_TRUE(done);
+}
+
+TEST(WorkerPoolTest, ForkSplitsAJobWithTheCaller) {
+  WorkerPool pool(3);
+  std::atomic<int> next(0);
+  std::vector<int> done(1000);
+  pool.Fork(4, [&]() {
+    for (int i; (i = next++) < 1000;) done[i]++;
+  });
+  EXPECT_EQ(std::vector<int>(1000, 1), done);
+}
+
+TEST(WorkerPoolTest, ForkDoesNotWaitForABusyPool) {
+  absl::Mutex mu;
+  bool go = false;
+  WorkerPool pool(1);
+  pool.Run([&]() {
+    absl::MutexLock lock(&mu);
+    mu.Await(absl::Condition(&go));
+  });
+  int runs = 0;
+  pool.Fork(2, [&runs]() { runs++; });
+  EXPECT_EQ(1, runs);
+  absl::MutexLock lock(&mu);
+  go = true;
+}